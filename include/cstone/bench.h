@@ -0,0 +1,35 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "cstone/profile.h"
+
+// Distribution of keys accessed by a benchmark
+typedef enum {
+  BENCH_KEYS_SEQUENTIAL = 0,
+  BENCH_KEYS_UNIFORM,
+  BENCH_KEYS_SKEWED     // Low keys are accessed more often than high keys
+} BenchKeyDist;
+
+typedef struct {
+  size_t        table_size;   // Number of props, hash entries, or hub subscribers
+  size_t        iterations;   // Operations per thread
+  BenchKeyDist  key_dist;
+  unsigned      threads;      // Concurrent tasks for benchmarks that support them
+} BenchConfig;
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void bench_init(ProfileTimerCount get_timer_count, uint32_t timer_clock_hz);
+void bench_default_config(BenchConfig *cfg);
+bool bench_run(const char *name, BenchConfig *cfg);
+void bench_run_all(BenchConfig *cfg);
+int32_t cmd_bench(uint8_t argc, char *argv[], void *eval_ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BENCH_H
@@ -1,12 +1,15 @@
 #ifndef LOG_COMPRESS_H
 #define LOG_COMPRESS_H
 
+#include "util/mempool.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 
 bool logdb_compress_block(LogDBBlock *block, LogDBBlock **compressed_block);
+bool logdb_compress_block_arena(LogDBBlock *block, LogDBBlock **compressed_block, mpArena *arena);
 
 size_t logdb_uncompressed_size(LogDBBlock *compressed_block);
 size_t logdb_decompress_block(LogDBBlock *compressed_block, uint8_t **decompressed);
@@ -31,6 +31,7 @@ typedef struct {
 #define BLOCK_KIND_PROP_DB  0x01
 #define BLOCK_KIND_DEBUG2   0x02
 #define BLOCK_KIND_DEBUG3   0x03
+#define BLOCK_KIND_PROP_DELTA 0x04  // Props changed since the last BLOCK_KIND_PROP_DB
 
 
 #ifdef __cplusplus
@@ -43,11 +44,13 @@ void logdb_format(LogDB *db); // Wipe all data
 bool logdb_mount(LogDB *db);  // Scan data for active blocks
 
 bool logdb_write_block(LogDB *db, LogDBBlock *block);
+bool logdb_write_erases(LogDB *db, size_t data_len, size_t block_start); // Write will erase block
 
 void logdb_read_init(LogDB *db);  // Reset read iterator to oldest block
 bool logdb_read_next(LogDB *db, LogDBBlock *block); // Read from iterator and advance
 bool logdb_read_next_header(LogDB *db, LogDBBlock *block, size_t *block_start);
 bool logdb_read_last(LogDB *db, LogDBBlock *block); // Read newest block
+bool logdb_read_at(LogDB *db, size_t block_start, LogDBBlock *block); // Read block from logdb_read_next_header()
 bool logdb_at_last_block(LogDB *db);  // Read iterator is at last block
 bool logdb_validate_header(LogDBBlock *block);
 
@@ -2,7 +2,14 @@
 #define LOG_INDEX_H
 
 typedef struct {
-  dhash hash;
+  uint32_t data_len;
+  uint32_t block_start;
+} LogDBIndexItem;
+
+#include "cstone/ihash_LogDBIndexItem.h"
+
+typedef struct {
+  IHash_LogDBIndexItem hash;  // Block location for each kind
 } LogDBIndex;
 
 #ifdef __cplusplus
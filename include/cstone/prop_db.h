@@ -49,10 +49,24 @@ DEALINGS IN THE SOFTWARE.
 
 #define P_EVENT_STORAGE_PROP_UPDATE   (P1_EVENT | P2_STORAGE | P3_PROP | P4_UPDATE)
 
+// Props changed inside a transaction are reported together in one message.
+// The payload is an array of prop IDs. Get the count with prop_batch_count().
+#define P_EVENT_STORAGE_PROP_BATCH    (P1_EVENT | P2_STORAGE | P3_PROP | P4_BATCH)
+
+// Number of prop IDs requested for each batch message
+#define PROP_DB_BATCH_SIZE  32
+
 // Property state stored in hash table
 typedef struct {
-  uintptr_t value;  // Integer value, pointer to data, or callback function
-  size_t    size;   // Size of data
+  union {
+    struct {
+      uintptr_t value;  // Integer value, pointer to data, or callback function
+      size_t    size;   // Size of data
+    };
+    // Small strings and blobs are stored in place of value and size.
+    // Use prop_entry_data() and prop_entry_size() to access string and blob data.
+    uint8_t inline_data[sizeof(uintptr_t) + sizeof(size_t)];
+  };
 
   // NOTE: This struct is padded out to sizeof(uintptr_t) in the dhash.
   // With 32-bit pointers we can have four bytes of additional field values without
@@ -62,9 +76,27 @@ typedef struct {
   uint8_t   persist   :1;
   uint8_t   protect   :1;
   uint8_t   dirty     :1;
-  uint8_t   reserved  :4;
+  uint8_t   is_inline :1; // Data is in inline_data
+  uint8_t   reserved  :3;
+  uint8_t   inline_size;  // Bytes of data in inline_data
 } PropDBEntry;
 
+// Largest blob stored inline. Strings need an extra byte for their NUL.
+#define PROP_INLINE_SIZE  sizeof(((PropDBEntry *)0)->inline_data)
+
+static inline void *prop_entry_data(PropDBEntry *entry) {
+  return entry->is_inline ? (void *)entry->inline_data : (void *)entry->value;
+}
+
+static inline size_t prop_entry_size(PropDBEntry *entry) {
+  return entry->is_inline ? entry->inline_size : entry->size;
+}
+
+static inline bool prop_entry_fits_inline(uint8_t kind, size_t size) {
+  return (kind == P_KIND_STRING && size < PROP_INLINE_SIZE) ||
+         (kind == P_KIND_BLOB && size <= PROP_INLINE_SIZE);
+}
+
 
 typedef struct {
   uint32_t  prop;
@@ -84,6 +116,21 @@ typedef struct {
 #define P_STR(p,  val, attr)  {(p), (uintptr_t)(val), P_KIND_STRING, (attr)}
 #define P_END_DEFAULTS        {0, 0, P_KIND_NONE, 0}
 
+typedef struct PropDBSnapshot PropDBSnapshot;
+
+
+// Watcher callback. value is NULL when the prop was removed.
+typedef void (*PropWatchCallback)(uint32_t prop, PropDBEntry *value, void *ctx);
+
+// Direct notification of changes to a prop or a masked group of props.
+// Watcher objects are owned by the caller and must remain valid until unwatched.
+typedef struct PropWatcher {
+  struct PropWatcher *next;
+  uint32_t            prop;   // Prop ID or masked prop
+  PropWatchCallback   watch_cb;
+  void               *ctx;
+} PropWatcher;
+
 typedef struct {
   dhash       hash;         // Contains the properties
   mpPoolSet  *pool_set;     // Memory pool for allocated values
@@ -91,9 +138,65 @@ typedef struct {
   SemaphoreHandle_t lock;
   uint32_t    transactions; // Number of pending transactions (NOTE: This is actually atomic_uint)
   bool        persist_updated; // Persisted properties have been changed
+  uint32_t    version;      // Incremented on every update
+  PropDBSnapshot *snapshots; // Active snapshots sharing values with the DB
+  uint32_t   *batch;        // Props changed in the current transaction. Ref counted from system pools
+  uint16_t    batch_len;
+  uint16_t    batch_max;
+  uintptr_t   batch_owner;  // Task whose transaction collects the batch (NOTE: This is actually atomic_uintptr_t)
+  uint16_t    batch_depth;  // Transaction nesting of the batch owner
+  bool        checkpoint_needed; // Next save must include all persistent props
+  uint16_t    delta_saves;  // Delta blocks saved since the last checkpoint
+  size_t      checkpoint_offset; // Log location of the last checkpoint
+  uint16_t    checkpoint_crc;    // Data CRC of the last checkpoint
+
+  // Ordered index for prefix queries
+  uint32_t   *index;        // Sorted prop IDs
+  size_t      index_len;
+  size_t      index_max;
+  bool        index_stale;  // Index must be rebuilt before use
+
+  // Watchers
+  dhash       watch_hash;   // Exact prop ID to list of PropWatcher
+  PropWatcher *watch_masked; // Watchers with mask fields
+  SemaphoreHandle_t watch_lock;
+  unsigned    num_watchers;
+  bool        watch_hash_ready;
 } PropDB;
 
 
+// prop_db_snapshot() capture flags
+#define P_SNAP_PERSIST     0x01  // Only props saved to storage
+#define P_SNAP_DIRTY       0x02  // Only props changed since they were last saved
+#define P_SNAP_CHECKPOINT  0x04  // Mark captured props as saved
+
+
+// Prop captured in a snapshot
+typedef struct {
+  uint32_t    prop;
+  PropDBEntry entry;
+} PropDBSnapItem;
+
+// String or blob value shared between a snapshot and the DB
+typedef struct {
+  void *value;
+  bool  retired;  // Removed from the DB while shared. Freed when the snapshot is released
+} PropDBSnapValue;
+
+// Consistent view of a prop DB that can be read without holding the DB lock.
+// Values of string and blob props are shared with the DB rather than copied.
+struct PropDBSnapshot {
+  PropDBSnapshot  *next;
+  PropDB          *db;
+  uint32_t         version;     // DB version when the snapshot was taken
+  PropDBSnapItem  *items;
+  size_t           num_items;
+  PropDBSnapValue *values;
+  size_t           num_values;
+  bool             heap_alloc;  // Items were allocated from the heap
+};
+
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -103,10 +206,17 @@ bool prop_db_init(PropDB *db, size_t init_capacity, size_t max_storage, mpPoolSe
 void prop_db_free(PropDB *db);
 void prop_db_set_defaults(PropDB *db, const PropDefaultDef *defaults);
 void prop_db_set_msg_hub(PropDB *db, UMsgTarget *msg_hub);
+bool prop_db_watch(PropDB *db, PropWatcher *watcher, uint32_t prop, PropWatchCallback watch_cb,
+                   void *ctx);
+bool prop_db_unwatch(PropDB *db, PropWatcher *watcher);
 
 void prop_db_transact_begin(PropDB *db);
 void prop_db_transact_end(PropDB *db);
 void prop_db_transact_end_no_update(PropDB *db);
+
+static inline size_t prop_batch_count(UMsg *msg) {
+  return msg->payload_size / sizeof(uint32_t);
+}
 static inline bool prop_db_update_pending(PropDB *db) { return db->persist_updated; };
 
 // ******************** Retrieval ********************
@@ -117,6 +227,7 @@ bool prop_set_str(PropDB *db, uint32_t prop, char *value, uint32_t source);
 bool prop_set_int(PropDB *db, uint32_t prop, int32_t value, uint32_t source);
 bool prop_set_uint(PropDB *db, uint32_t prop, uint32_t value, uint32_t source);
 bool prop_get(PropDB *db, uint32_t prop, PropDBEntry *value);
+size_t prop_get_batch(PropDB *db, const uint32_t *props, PropDBEntry *values, size_t num_props);
 
 bool prop_set_attributes(PropDB *db, uint32_t prop, uint8_t attributes);
 bool prop_get_attributes(PropDB *db, uint32_t prop, uint8_t *attributes);
@@ -131,14 +242,27 @@ static inline bool prop_db_dealloc(PropDB *db, void *element) {
 }
 
 size_t prop_db_count(PropDB *db);
+
+bool prop_db_snapshot(PropDB *db, PropDBSnapshot *snap, unsigned flags, mpArena *arena);
+void prop_db_snapshot_release(PropDBSnapshot *snap);
+static inline bool prop_db_snapshot_current(PropDBSnapshot *snap) {
+  return snap->version == snap->db->version;
+}
+
 bool prop_print(PropDB *db, uint32_t prop, bool dump_blob);
 void prop_db_dump(PropDB *db);
 
 bool prop_db_serialize(PropDB *db, LogDBBlock **block);
+bool prop_db_serialize_arena(PropDB *db, LogDBBlock **block, mpArena *arena);
+bool prop_db_serialize_delta(PropDB *db, LogDBBlock **block);
+bool prop_db_serialize_delta_arena(PropDB *db, LogDBBlock **block, mpArena *arena);
+void prop_db_request_checkpoint(PropDB *db);
 unsigned prop_db_deserialize(PropDB *db, uint8_t *data, size_t data_len);
 
 size_t prop_db_all_keys(PropDB *db, uint32_t **keys);
+size_t prop_db_all_keys_arena(PropDB *db, uint32_t **keys, mpArena *arena);
 void prop_db_sort_keys(PropDB *db, uint32_t *keys, size_t keys_len);
+size_t prop_db_query(PropDB *db, uint32_t masked_prop, uint32_t after, uint32_t *props, size_t max_props);
 void prop_db_dump_keys(PropDB *db, uint32_t *keys, size_t keys_len);
 
 #ifdef __cplusplus
@@ -439,6 +439,7 @@ M(P2, BUTTON,   11) \
 M(P2, MESSAGE,  12) \
 M(P2, GPIO,     13) \
 M(P2, GUI,      14) \
+M(P2, MEM,      15) \
 M(P2, R127,     127) \
 \
 M(P3, INFO,     1) \
@@ -454,6 +455,7 @@ M(P3, MEM,      10) \
 M(P3, BUTTON,   11) \
 M(P3, SEQUENCER, 12) \
 M(P3, LED,      13) \
+M(P3, LOCK,     14) \
 M(P3, R127,     127) \
 \
 M(P4, VALUE,    1) \
@@ -489,6 +491,11 @@ M(P4, LEFT,     30) \
 M(P4, RIGHT,    31) \
 M(P4, HOME,     32) \
 M(P4, BACK,     33) \
+M(P4, USED,     34) \
+M(P4, PEAK,     35) \
+M(P4, FAIL,     36) \
+M(P4, ALLOC,    37) \
+M(P4, BATCH,    38) \
 M(P4, R127,     127) \
 \
 M(P1, MSK, 0xFFul) \
@@ -553,6 +560,17 @@ struct PropNamespace {
 
 #define P_HW_GPIO_BUTTON_SELECT       (P1_HW | P2_GPIO | P3_BUTTON | P4_SELECT)
 
+// Memory pool telemetry
+#define P_STATS_MEM_INFO_COUNT        (P1_STATS | P2_MEM | P3_INFO | P4_COUNT)
+#define P_STATS_MEM_INFO_FAIL         (P1_STATS | P2_MEM | P3_INFO | P4_FAIL)
+#define P_STATS_MEM_LOCK_COUNT        (P1_STATS | P2_MEM | P3_LOCK | P4_COUNT)
+#define P_STATS_MEM_LOCK_MAX          (P1_STATS | P2_MEM | P3_LOCK | P4_MAX)
+#define P_STATS_MEM_n_SIZE            (P1_STATS | P2_MEM | P2_ARR(0) | P4_SIZE)
+#define P_STATS_MEM_n_COUNT           (P1_STATS | P2_MEM | P2_ARR(0) | P4_COUNT)
+#define P_STATS_MEM_n_ALLOC           (P1_STATS | P2_MEM | P2_ARR(0) | P4_ALLOC)
+#define P_STATS_MEM_n_USED            (P1_STATS | P2_MEM | P2_ARR(0) | P4_USED)
+#define P_STATS_MEM_n_PEAK            (P1_STATS | P2_MEM | P2_ARR(0) | P4_PEAK)
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -9,6 +9,7 @@
 #  define USE_ERROR_MONITOR
 #  define USE_EVENT_MONITOR
 #  define USE_LOG_DB
+#  define USE_MEM_MONITOR   // Publish mempool telemetry to "stats.mem" props
 #endif
 
 
@@ -19,6 +20,7 @@ extern UMsgHub g_msg_hub;
 
 
 #define LOAD_MONITOR_TASK_MS    1000
+#define MEM_MONITOR_TASK_MS     1000
 #define BLINK_TASK_MS           40    // Update LEDs
 #define EVENT_SEQUENCER_TASK_MS 50
 #define CONSOLE_TASK_MS         17    // Process RX data
@@ -3,6 +3,10 @@
 
 #include "FreeRTOS.h"
 #include "queue.h"
+#include "semphr.h"
+#include "task.h"
+
+#include "util/dhash.h"
 
 typedef struct {
   uint32_t  id;       // Prop id for type of message
@@ -23,6 +27,28 @@ typedef struct {
 // Number of filters per UMsgFilterChunk
 #define UMSG_FILTERS_IN_CHUNK  4
 
+// Max messages taken from a hub inbox for each dispatch
+#define UMSG_HUB_BATCH_SIZE  16
+
+// Max concurrent umsg_hub_query() calls waiting on a hub
+#define UMSG_HUB_MAX_QUERIES  4
+
+// Message priority classes derived from the P1 field of the message ID.
+// Hubs have an inbox lane for each class and dispatch from the highest
+// priority lane with messages waiting.
+#define UMSG_PRIO_HIGH    0   // Errors and query responses
+#define UMSG_PRIO_NORMAL  1
+#define UMSG_PRIO_LOW     2   // Debug messages
+#define UMSG_PRIORITIES   3
+
+// Action taken when a hub forwards a message to a full subscriber queue
+#define UMSG_OVERFLOW_BLOCK        0  // Wait for the send timeout then drop the message and report an error
+#define UMSG_OVERFLOW_DROP_NEWEST  1  // Drop the new message
+#define UMSG_OVERFLOW_DROP_OLDEST  2  // Remove the oldest queued message to make room
+#define UMSG_OVERFLOW_COALESCE     3  // Replace a queued message with the same ID or drop the oldest
+// Lock-free ring and hub subscribers can't have queued messages removed. They
+// drop the new message under the DROP_OLDEST and COALESCE policies.
+
 #define P_RSRC_SYS_LOCAL_TASK       (P1_RSRC | P2_SYS | P3_LOCAL | P4_TASK)
 #define P_RSRC_HW_LOCAL_TASK        (P1_RSRC | P2_HW  | P3_LOCAL | P4_TASK)
 
@@ -34,6 +60,23 @@ typedef struct UMsgFilterChunk {
 } UMsgFilterChunk;
 
 
+// Slot in a lock-free message ring
+typedef struct {
+  uint32_t  seq;    // Position this slot is ready for (NOTE: This is actually atomic_uint)
+  UMsg      msg;
+} UMsgRingSlot;
+
+// Lock-free multi-producer single-consumer message ring
+typedef struct {
+  UMsgRingSlot *slots;
+  uint32_t      mask;     // Number of slots - 1
+  uint32_t      head;     // Next position claimed by producers (NOTE: This is actually atomic_uint)
+  uint32_t      tail;     // Next position read by the consumer
+  uint32_t      waiting;  // Consumer is blocked waiting for a message (NOTE: This is actually atomic_uint)
+  TaskHandle_t  consumer; // Task notified when a message arrives while waiting
+} UMsgRing;
+
+
 typedef struct UMsgTarget UMsgTarget;
 
 typedef void(*UMsgTargetCallback)(UMsgTarget *tgt, UMsg *msg);
@@ -45,16 +88,63 @@ struct UMsgTarget {
   UMsgFilterChunk    *filter_chunks;  // List of filter masks for this target
   uintptr_t           user_data;
   QueueHandle_t       q;
+  UMsgRing           *ring;           // Lock-free queue used in place of q
   UMsgTargetCallback  msg_handler_cb;
   unsigned            dropped_messages;
+  uint8_t             overflow_policy; // UMSG_OVERFLOW_* applied by hubs sending to this target
+  bool                is_hub;         // Target is the inbox of a UMsgHub
 };
 
 
+// Subscriber filter in a hub's dispatch index
+typedef struct {
+  uint32_t    filter;
+  unsigned    rank;     // Position in subscriber list
+  UMsgTarget *tgt;
+} UMsgHubIndexEntry;
+
+// Pending delivery of a message in a hub batch
+typedef struct {
+  UMsgTarget *tgt;
+  uint8_t     msg_ix;   // Index into batch
+  bool        sent;
+  bool        ref_added; // Payload reference taken for a failed send
+} UMsgHubDelivery;
+
+// Pending response to a hub query
+typedef struct {
+  uint32_t          id;       // Correlation ID of the expected response. 0 when slot is free
+  SemaphoreHandle_t ready;    // Given when the response arrives
+  uintptr_t         payload;  // Response data
+  bool              done;     // Response has arrived
+} UMsgHubReply;
+
 // A hub is a target with a subscriber list of other targets
 typedef struct {
-  UMsgTarget inbox;
+  UMsgTarget inbox;   // Messages sent here are routed to lanes by priority
+
+  UMsgTarget lanes[UMSG_PRIORITIES];  // Inbox for each priority class
+  SemaphoreHandle_t lanes_ready;      // Count of messages in queued lanes
 
   UMsgTarget *subscribers;
+
+  // Dispatch index of subscriber filters. Only accessed from the task processing the inbox.
+  dhash               index;          // Filter to position of first entry in index_entries
+  UMsgHubIndexEntry  *index_entries;  // Sorted by filter then rank
+  UMsgHubIndexEntry **index_matches;  // Scratch list of entries matching a message
+  size_t              index_len;
+  unsigned            index_gen;      // Filter generation the index was built from
+  uint16_t            index_shapes;   // Bitmap of masked field combinations in use
+  bool                index_ready;
+
+  // Deliveries for the current batch. Only accessed from the task processing the inbox.
+  UMsgHubDelivery    *plan;
+  size_t              plan_len;
+  size_t              plan_max;
+
+  // Queries waiting for a response. Protected by critical sections.
+  UMsgHubReply        replies[UMSG_HUB_MAX_QUERIES];
+  unsigned            pending_replies;
 } UMsgHub;
 
 
@@ -63,8 +153,13 @@ extern "C" {
 #endif
 
 void umsg_tgt_queued_init(UMsgTarget *tgt, size_t max_msg);
+bool umsg_tgt_ring_init(UMsgTarget *tgt, size_t max_msg);
 void umsg_tgt_callback_init(UMsgTarget *tgt, UMsgTargetCallback msg_handler_cb);
 
+static inline void umsg_tgt_set_overflow_policy(UMsgTarget *tgt, uint8_t policy) {
+  tgt->overflow_policy = policy;
+}
+
 void umsg_tgt_free(UMsgTarget *tgt);
 bool umsg_tgt_add_filter(UMsgTarget *tgt, uint32_t filter_mask);
 bool umsg_tgt_remove_filter(UMsgTarget *tgt, uint32_t filter_mask);
@@ -73,6 +168,7 @@ bool umsg_tgt_send(UMsgTarget *tgt, UMsg *msg, uint32_t timeout);
 bool umsg_tgt_recv(UMsgTarget *tgt, UMsg *msg, uint32_t timeout);
 
 void umsg_discard(UMsg *msg);
+unsigned umsg_priority(uint32_t msg_id);
 
 void umsg_hub_init(UMsgHub *hub, size_t max_msg);
 void umsg_hub_free(UMsgHub *hub);
@@ -50,6 +50,12 @@ for the bucket array size.
 #define DH_MAX_HASH_ENTRIES  INT32_MAX
 
 
+// Initial number of retired allocations held per epoch in a concurrent hash.
+// The lists grow if readers keep an epoch open over several grow operations.
+
+#define DH_INIT_RETIRED  6
+
+
 // Bucket indices are signed so that -1 can indicate a failed lookup
 #if DH_MAX_HASH_ENTRIES > INT32_MAX
 typedef int64_t  dhBucketIndex;
@@ -87,11 +93,15 @@ typedef struct dhConfig {
   size_t          max_storage;  // Max bytes to use for bucket array
 
   void            *ext_storage; // Optional external buffer for buckets; Size in max_storage
+  bool            probe_tags;   // Keep dense arrays of hash tags and probe counts for lookups
+  size_t          migrate_step; // Buckets moved per update during incremental growth. 0 to grow all at once
+  bool            concurrent;   // Allow lookups without a lock while a single writer updates the hash
+  bool            int_keys;     // Keys are integers stored in dhKey.data. gen_hash and is_equal are unused
 
   // Callbacks
   ItemDestructor  destroy_item; // Required callback for evicted entries
-  ComputeHash     gen_hash;     // Required callback to convert dhKey into dhIKey
-  EqualKeys       is_equal;     // Required callback to test if two dhKeys match (on ikey collision)
+  ComputeHash     gen_hash;     // Required callback to convert dhKey into dhIKey (except int_keys)
+  EqualKeys       is_equal;     // Required callback to test if two dhKeys match (except int_keys)
   ItemReplace     replace_item; // Optional callback for replaced entries
   GrowHash        grow_hash;    // Optional callback to notify increase in hash size
 } dhConfig;
@@ -111,6 +121,27 @@ typedef struct dhash {
   size_t          value_size;   // Bytes per entry value
   size_t          max_storage;  // Max bytes to use for bucket array
 
+  // Probe tag arrays. NULL when disabled
+  uint8_t        *probe_tags;   // 8-bit hash fragment for each bucket
+  uint8_t        *probe_dists;  // Saturated probe count for each bucket
+  bool            use_probe_tags;
+
+  // Incremental growth
+  struct dhash   *old;            // Previous bucket array being migrated. NULL when not growing
+  dhBucketIndex   migrate_bucket; // Next bucket in old to migrate
+  dhBucketIndex   migrate_step;   // Buckets to migrate on each update
+
+  // Concurrent readers (NOTE: The uint32_t fields are actually atomic_uint)
+  bool            concurrent;
+  uint32_t        seq;          // Write sequence count. Odd while an update is in progress
+  uint32_t        epoch;        // Reclamation epoch. Low bit selects reader count
+  uint32_t        readers[2];   // Active lock-free readers in each epoch
+  void          **retired[2];   // Memory freed when readers from its epoch are done
+  uint16_t        num_retired[2];
+  uint16_t        max_retired[2];
+
+  bool            int_keys;     // Hash and compare keys inline without callbacks
+
   // Callbacks
   void           *ctx;          // User context for callbacks
   ItemDestructor  destroy_item; // Required callback for evicted entries
@@ -120,6 +151,7 @@ typedef struct dhash {
   GrowHash        grow_hash;    // Optional callback to notify increase in hash size
 
   bool            static_buckets; // Buckets array is from ext_storage
+  bool            frozen;         // Hash is immutable
 
 } dhash;
 
@@ -145,6 +177,10 @@ void dh_free(dhash *hash);
 bool dh_lookup(dhash *hash, dhKey key, void *value);
 #define dh_exists(h, k)  dh_lookup(h, k, NULL)
 bool dh_lookup_in_place(dhash *hash, dhKey key, void **value);
+bool dh_try_lookup(dhash *hash, dhKey key, void *value, bool *found);
+size_t dh_lookup_batch(dhash *hash, const dhKey *keys, void **values, bool *found, size_t num_keys);
+size_t dh_lookup_batch_locked(dhash *hash, const dhKey *keys, void **values, bool *found,
+                              size_t num_keys);
 
 void dh_iter_init(dhash *hash, dhIter *it);
 bool dh_iter_next(dhIter *it, dhKey *key, void **value);
@@ -152,8 +188,14 @@ bool dh_iter_next(dhIter *it, dhKey *key, void **value);
 
 // ******************** Storage ********************
 bool dh_insert(dhash *hash, dhKey key, void *value);
+size_t dh_insert_batch(dhash *hash, const dhKey *keys, void **values, size_t num_keys);
 bool dh_remove(dhash *hash, dhKey key, void *value);
 #define dh_delete(hash, key)  dh_remove(hash, key, NULL)
+void dh_modify_begin(dhash *hash);
+void dh_modify_end(dhash *hash);
+
+bool dh_build(dhash *hash, const dhKey *keys, void **values, size_t num_keys);
+bool dh_freeze(dhash *hash);
 
 // ******************** Resource utilization ********************
 size_t dh_num_items(dhash *hash);
@@ -31,11 +31,63 @@ DEALINGS IN THE SOFTWARE.
 #define USE_MP_COLLECT_STATS
 #define USE_MP_POINTER_CHECK
 
+// Only one in every MP_STATS_SAMPLE_RATE requests is added to the histogram and
+// per-pool request size stats. Free element counts are always exact. Must be a
+// power of 2. Set to 1 to record every request.
+#define MP_STATS_SAMPLE_RATE  16
+
+// Low overhead counters for allocations, elements in use, and their high-water
+// mark in each pool along with pool set lock hold times. These use relaxed
+// atomics and are cheap enough to leave enabled in production.
+#define USE_MP_TELEMETRY
+
 #ifdef USE_MP_COLLECT_STATS
 #  include "util/stats.h"
 #  include "util/histogram.h"
 #endif
 
+// Maximum number of pools covered by the allocation index. Pool sets with more
+// pools than this fall back to a linear search of the pool list.
+#define MP_MAX_INDEXED_POOLS  32
+
+// Number of power-of-2 size classes in the allocation index
+#define MP_SIZE_CLASSES       33
+
+// Per-thread magazine caches of free elements. Each thread keeps a few free
+// elements from every pool so that most allocations and frees don't need the
+// pool set lock. Pthreads platforms use _Thread_local storage. FreeRTOS tasks
+// allocate their cache on first use and keep it in the thread local storage
+// pointer at MP_THREAD_STORE_CACHE.
+#if (defined USE_PTHREAD_LOCK || defined USE_FREERTOS) && !defined USE_MP_THREAD_CACHE
+#  define USE_MP_THREAD_CACHE
+#endif
+
+// FreeRTOS thread local storage index for task caches. configNUM_THREAD_LOCAL_STORAGE_POINTERS
+// must be larger than this. Enable configTHREAD_LOCAL_STORAGE_DELETE_CALLBACKS to
+// flush caches automatically when tasks are deleted.
+#ifndef MP_THREAD_STORE_CACHE
+#  define MP_THREAD_STORE_CACHE  1
+#endif
+
+// Lock-free free lists. Elements are taken and returned with atomic compare
+// and swap so that mp_alloc() and mp_free() don't use the pool set lock. This
+// makes it possible to free elements from an ISR. Adding and releasing pools
+// still takes the lock and must not happen while other threads could be using
+// a pool that is being released. Pools are limited to 65535 elements on 32-bit
+// targets.
+//#define USE_MP_LOCK_FREE
+
+#define MP_CACHE_SIZE   8   // Max elements cached per pool in each thread
+#define MP_CACHE_BATCH  4   // Elements moved on each refill or flush of a cache
+
+#if MP_MAX_INDEXED_POOLS > 32
+typedef uint64_t mpPoolMask;
+#else
+typedef uint32_t mpPoolMask;
+#endif
+
+typedef uint32_t (*mpTimer)(void);
+
 
 typedef struct mpPoolChunk_s mpPoolChunk;
 
@@ -44,14 +96,24 @@ typedef struct mpPool {
   struct mpPool *next;
   void        *pool_begin;
   void        *pool_end;
+#ifdef USE_MP_LOCK_FREE
+  uintptr_t   free_head;  // Tagged index of first free element (NOTE: Actually atomic)
+#else
   mpPoolChunk *free_list;
+#endif
   size_t      element_size;
 #ifdef USE_MP_COLLECT_STATS
   size_t      free_elems;
   size_t      min_free_elems;
   OnlineStats req_size;
+#endif
+#ifdef USE_MP_TELEMETRY
+  uint32_t    allocs;     // Allocations served (NOTE: Actually atomic_uint)
+  uint32_t    in_use;     // Elements held by the application (NOTE: Actually atomic_uint)
+  uint32_t    peak_use;   // High-water mark of in_use (NOTE: Actually atomic_uint)
 #endif
   uint8_t     flags;
+  uint8_t     rank;       // Position in size order for the allocation index
   uint8_t     elements[];
 } mpPool;
 
@@ -60,7 +122,24 @@ typedef struct {
   mpPool *pools;
 #ifdef USE_MP_COLLECT_STATS
   Histogram   *hist;
+  uint32_t    sample_count; // Requests seen for sampling (NOTE: Actually atomic_uint)
 #endif
+#ifdef USE_MP_TELEMETRY
+  uint32_t    alloc_fails;  // Requests no pool could satisfy (NOTE: Actually atomic_uint)
+  uint32_t    lock_count;   // Lock acquisitions
+  uint32_t    lock_max;     // Longest lock hold in lock_timer units
+  uint32_t    lock_start;
+  mpTimer     lock_timer;   // Optional timestamp source for lock hold times
+#endif
+
+  // Allocation index. Rebuilt whenever the pool list changes
+  mpPool     *by_size[MP_MAX_INDEXED_POOLS];  // Pools in order of element size
+  mpPool     *by_addr[MP_MAX_INDEXED_POOLS];  // Pools in order of address
+  uint8_t     class_start[MP_SIZE_CLASSES];   // First pool in by_size able to hold each size class
+  uint8_t     num_indexed;
+  bool        indexed;  // false when there are too many pools to index
+  mpPoolMask  avail;    // Pools in by_size with a non-empty free list
+  uint32_t    index_gen;  // Incremented on each index rebuild (NOTE: Actually atomic_uint)
 
 #if defined USE_PTHREAD_LOCK
   pthread_mutex_t lock;
@@ -70,6 +149,50 @@ typedef struct {
 } mpPoolSet;
 
 
+// Bump allocator for transient objects. Memory comes from a single pool element
+// or a static buffer and is released all at once with mp_arena_reset().
+typedef struct {
+  uint8_t    *buf;
+  size_t      buf_size;
+  size_t      used;
+  mpPoolSet  *pool_set;   // Set that buf was allocated from. NULL for static buffers
+} mpArena;
+
+typedef size_t mpArenaMark;
+
+
+#ifdef USE_MP_COLLECT_STATS
+// Pool layout proposed by mp_analyze_pools()
+typedef struct {
+  size_t    element_size;
+  size_t    elements;
+  uint32_t  requests;     // Sampled requests that fit this pool best
+} mpPoolGeometry;
+
+// Percentage of extra elements added to the observed peak demand
+#  define MP_ANALYZE_HEADROOM   25
+#endif
+
+
+#ifdef USE_MP_TELEMETRY
+// Snapshot of pool counters from mp_get_pool_telemetry()
+typedef struct {
+  size_t    element_size;
+  size_t    elements;
+  uint32_t  allocs;
+  uint32_t  in_use;
+  uint32_t  peak_use;
+} mpPoolTelemetry;
+
+// Snapshot of pool set counters from mp_get_telemetry()
+typedef struct {
+  uint32_t  alloc_fails;
+  uint32_t  lock_count;
+  uint32_t  lock_max;
+} mpSetTelemetry;
+#endif
+
+
 // Extra padding added to static buffers to guarantee a desired number of
 // elements in the pool.
 //   EXAMPLE:  static uint8_t pool_buf[1024*20 + MP_STATIC_PADDING(alignof(uintptr_t)];
@@ -101,15 +224,49 @@ void *mp_realloc(mpPoolSet *pool_set, void *element, size_t size);
 
 void *mp_alloc_with_ref(mpPoolSet *pool_set, size_t size, size_t *alloc_size);
 void mp_inc_ref(void *element);
+bool mp_dec_ref(mpPoolSet *pool_set, void *element);
 uint32_t mp_ref_count(void *element);
 bool mp_is_ref_counted(mpPoolSet *pool_set, void *element);
 
 bool mp_free(mpPoolSet *pool_set, void *element);
 bool mp_free_secure(mpPoolSet *pool_set, void *element);
+void mp_flush_thread_cache(void);
 
 bool mp_from_pool(mpPoolSet *pool_set, void *element);
 size_t mp_get_size(mpPoolSet *pool_set, void *element);
 
+// ******************** Arena allocation ********************
+bool mp_arena_init(mpArena *arena, mpPoolSet *pool_set, size_t size);
+void mp_arena_init_static(mpArena *arena, uint8_t *buf, size_t buf_size);
+void mp_arena_free(mpArena *arena);
+void *mp_arena_alloc(mpArena *arena, size_t size);
+
+/*
+Get a mark for the current arena position
+Args:
+  arena : Arena to mark
+Returns:
+  Mark to pass to :c:func:`mp_arena_reset`
+*/
+static inline mpArenaMark mp_arena_mark(mpArena *arena) {
+  return arena->used;
+}
+
+/*
+Release all arena allocations made after a mark
+Args:
+  arena : Arena to reset
+  mark  : Mark from :c:func:`mp_arena_mark`. Use 0 to release everything
+*/
+static inline void mp_arena_reset(mpArena *arena, mpArenaMark mark) {
+  if(mark < arena->used)
+    arena->used = mark;
+}
+
+static inline size_t mp_arena_available(mpArena *arena) {
+  return arena->buf_size - arena->used;
+}
+
 // ******************** Utility ********************
 void mp_pool_enable(mpPool *pool, bool enable);
 size_t mp_total_elements(mpPool *pool);
@@ -118,6 +275,19 @@ bool mp_pool_in_use(mpPool *pool);
 void mp_summary(mpPoolSet *pool_set);
 void mp_plot_stats(mpPoolSet *pool_set);
 
+#ifdef USE_MP_TELEMETRY
+void mp_set_lock_timer(mpPoolSet *pool_set, mpTimer timer);
+void mp_get_telemetry(mpPoolSet *pool_set, mpSetTelemetry *tm);
+bool mp_get_pool_telemetry(mpPoolSet *pool_set, unsigned pool_ix, mpPoolTelemetry *tm);
+void mp_reset_telemetry(mpPoolSet *pool_set);
+#endif
+
+#ifdef USE_MP_COLLECT_STATS
+size_t mp_analyze_pools(mpPoolSet *pool_set, mpPoolGeometry *geom, size_t max_pools, size_t alignment);
+void mp_print_geometry(mpPoolSet *pool_set, mpPoolGeometry *geom, size_t num_pools);
+size_t mp_apply_geometry(mpPoolSet *pool_set, mpPoolGeometry *geom, size_t num_pools, size_t alignment);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,614 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <limits.h>
+#if defined PLATFORM_HOSTED
+#  include <time.h>
+#endif
+
+#include "FreeRTOS.h"
+#include "semphr.h"
+#include "task.h"
+
+#include "cstone/platform.h"
+#include "cstone/rtos.h"
+#include "cstone/prop_id.h"
+#include "cstone/prop_db.h"
+#include "cstone/umsg.h"
+#include "cstone/debug.h"
+
+#include "util/dhash.h"
+#include "util/mempool.h"
+#include "util/random.h"
+#include "util/num_format.h"
+#include "util/getopt_r.h"
+
+#include "cstone/bench.h"
+
+/*
+Micro-benchmarks for the prop DB and the services beneath it
+
+Each benchmark runs a fixed number of operations on keys drawn from a
+configurable distribution. Operations are timed in groups of BENCH_OPS_PER_SAMPLE
+so that the timer resolution and overhead don't dominate fast operations. The
+per-op time of every group is kept as a sample for the percentile report.
+
+Keys are generated before each group is timed so the RNG cost is excluded.
+*/
+
+#ifndef COUNT_OF
+#  define COUNT_OF(a) (sizeof(a) / sizeof(*(a)))
+#endif
+
+#define BENCH_DEFAULT_TABLE_SIZE  256
+#define BENCH_DEFAULT_ITERATIONS  10000
+#define BENCH_OPS_PER_SAMPLE      16
+#define BENCH_MAX_THREADS         8
+#define BENCH_MAX_ALLOC           128   // Largest request for mp_alloc() benchmark
+
+// Every Nth op of the "prop_mix" benchmark is a set
+#define BENCH_MIX_SET_INTERVAL    10
+
+
+typedef struct BenchState BenchState;
+
+typedef struct {
+  BenchState *state;
+  RandomState rng;
+  size_t      next_key;   // Sequential key position
+  uint32_t   *samples;    // Timer ticks for each group of ops
+  size_t      num_samples;
+  size_t      op_count;
+  SemaphoreHandle_t done;
+} BenchWorker;
+
+typedef struct {
+  const char *name;
+  bool (*setup)(BenchState *state);
+  void (*run_op)(BenchState *state, BenchWorker *worker, size_t key);
+  void (*teardown)(BenchState *state);
+  bool multi_thread;  // Safe to run from concurrent tasks
+} BenchDef;
+
+struct BenchState {
+  BenchConfig     cfg;
+  const BenchDef *def;
+
+  PropDB          db;
+  dhash           hash;
+  UMsgHub         hub;
+  UMsgTarget     *subscribers;
+  TaskHandle_t    hub_task;
+  SemaphoreHandle_t hub_done;
+};
+
+
+static ProfileTimerCount s_get_timer_count = NULL;
+static uint32_t s_timer_clock_hz = 0;
+
+
+#if defined PLATFORM_HOSTED
+// Default nanosecond timer. Truncated to 32-bits but each sample is far shorter than a wrap.
+static uint32_t bench__nanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)((uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec);
+}
+#endif
+
+
+/*
+Set the timer used to measure benchmarks
+
+On hosted builds a nanosecond clock is used when this isn't called.
+Embedded targets should pass a cycle counter since the RTOS performance
+timer is too coarse for single operations.
+
+Args:
+  get_timer_count:  Function returning the current timer count
+  timer_clock_hz:   Frequency of the timer
+*/
+void bench_init(ProfileTimerCount get_timer_count, uint32_t timer_clock_hz) {
+  s_get_timer_count = get_timer_count;
+  s_timer_clock_hz = timer_clock_hz;
+}
+
+
+/*
+Initialize a benchmark config with default settings
+
+Args:
+  cfg:  Config to initialize
+*/
+void bench_default_config(BenchConfig *cfg) {
+  cfg->table_size = BENCH_DEFAULT_TABLE_SIZE;
+  cfg->iterations = BENCH_DEFAULT_ITERATIONS;
+  cfg->key_dist   = BENCH_KEYS_UNIFORM;
+  cfg->threads    = 1;
+}
+
+
+// ******************** Keys ********************
+
+// Map a key index onto a unique valid prop ID
+static uint32_t bench__prop_id(size_t key) {
+  uint32_t p2 = (key / (126*126)) % 126 + 1;
+  uint32_t p3 = (key / 126) % 126 + 1;
+  uint32_t p4 = key % 126 + 1;
+
+  return P1_APP | (p2 << 16) | (p3 << 8) | p4;
+}
+
+
+static size_t bench__next_key(BenchWorker *worker) {
+  size_t table_size = worker->state->cfg.table_size;
+  uint32_t r;
+
+  switch(worker->state->cfg.key_dist) {
+  case BENCH_KEYS_SEQUENTIAL:
+    if(worker->next_key >= table_size)
+      worker->next_key = 0;
+    return worker->next_key++;
+
+  case BENCH_KEYS_SKEWED: // Squaring a uniform fraction favors the low end of the table
+    r = random_next32(&worker->rng);
+    r = ((uint64_t)r * r) >> 32;
+    return ((uint64_t)r * table_size) >> 32;
+
+  default:
+  case BENCH_KEYS_UNIFORM:
+    r = random_next32(&worker->rng);
+    return ((uint64_t)r * table_size) >> 32;
+  }
+}
+
+
+// ******************** Prop DB ********************
+
+static bool bench__prop_setup(BenchState *state) {
+  if(!prop_db_init(&state->db, state->cfg.table_size, 0, mp_sys_pools()))
+    return false;
+
+  for(size_t i = 0; i < state->cfg.table_size; i++) {
+    prop_set_uint(&state->db, bench__prop_id(i), i, 0);
+  }
+
+  return true;
+}
+
+static void bench__prop_teardown(BenchState *state) {
+  prop_db_free(&state->db);
+}
+
+static void bench__prop_set_op(BenchState *state, BenchWorker *worker, size_t key) {
+  prop_set_uint(&state->db, bench__prop_id(key), worker->op_count, 0);
+}
+
+static void bench__prop_get_op(BenchState *state, BenchWorker *worker, size_t key) {
+  PropDBEntry value;
+  prop_get(&state->db, bench__prop_id(key), &value);
+}
+
+static void bench__prop_mix_op(BenchState *state, BenchWorker *worker, size_t key) {
+  if(worker->op_count % BENCH_MIX_SET_INTERVAL == 0)
+    bench__prop_set_op(state, worker, key);
+  else
+    bench__prop_get_op(state, worker, key);
+}
+
+
+// ******************** Hash table ********************
+
+static void bench__hash_destroy(dhKey key, void *value, void *ctx) {
+}
+
+static bool bench__hash_setup(BenchState *state) {
+  dhConfig hash_cfg = {
+    .init_buckets = state->cfg.table_size,
+    .value_size   = sizeof(uintptr_t),
+    .destroy_item = bench__hash_destroy,
+    .int_keys     = true
+  };
+
+  return dh_init(&state->hash, &hash_cfg, NULL);
+}
+
+static void bench__hash_teardown(BenchState *state) {
+  dh_free(&state->hash);
+}
+
+static void bench__dh_insert_op(BenchState *state, BenchWorker *worker, size_t key) {
+  dhKey hkey = {.data = (void *)(uintptr_t)bench__prop_id(key), .length = sizeof(uint32_t)};
+  uintptr_t value = key;
+  dh_insert(&state->hash, hkey, &value);
+}
+
+static void bench__dh_lookup_op(BenchState *state, BenchWorker *worker, size_t key) {
+  dhKey hkey = {.data = (void *)(uintptr_t)bench__prop_id(key), .length = sizeof(uint32_t)};
+  uintptr_t value;
+  dh_lookup(&state->hash, hkey, &value);
+}
+
+static bool bench__dh_lookup_setup(BenchState *state) {
+  if(!bench__hash_setup(state))
+    return false;
+
+  for(size_t i = 0; i < state->cfg.table_size; i++) {
+    bench__dh_insert_op(state, NULL, i);
+  }
+
+  return true;
+}
+
+
+// ******************** Memory pools ********************
+
+static void bench__mp_alloc_op(BenchState *state, BenchWorker *worker, size_t key) {
+  size_t alloc_size;
+  void *element = mp_alloc(mp_sys_pools(), key % BENCH_MAX_ALLOC + 1, &alloc_size);
+  if(element)
+    mp_free(mp_sys_pools(), element);
+}
+
+
+// ******************** Message hub ********************
+
+static void bench__hub_task(void *ctx) {
+  UMsgHub *hub = (UMsgHub *)ctx;
+  umsg_hub_process_inbox(hub, NO_TIMEOUT); // Never returns
+}
+
+static void bench__hub_recv(UMsgTarget *tgt, UMsg *msg) {
+  BenchState *state = (BenchState *)tgt->user_data;
+  xSemaphoreGive(state->hub_done);
+}
+
+
+static void bench__hub_teardown(BenchState *state) {
+  if(state->hub_task) {
+    vTaskDelete(state->hub_task);
+    state->hub_task = NULL;
+  }
+
+  if(state->subscribers) {
+    for(size_t i = 0; i < state->cfg.table_size; i++) {
+      umsg_tgt_free(&state->subscribers[i]);
+    }
+    cs_free(state->subscribers);
+    state->subscribers = NULL;
+  }
+
+  umsg_hub_free(&state->hub);
+
+  if(state->hub_done) {
+    vSemaphoreDelete(state->hub_done);
+    state->hub_done = NULL;
+  }
+}
+
+// Each subscriber matches one prop. Messages are dispatched to the subscriber selected by the key.
+static bool bench__hub_setup(BenchState *state) {
+  umsg_hub_init(&state->hub, 8);
+  if(umsg_sys_hub() == &state->hub) // Keep benchmark hub private
+    umsg_set_sys_hub(NULL);
+
+  state->hub_done = xSemaphoreCreateBinary();
+  state->subscribers = cs_calloc(state->cfg.table_size, sizeof(UMsgTarget));
+  if(!state->hub_done || !state->subscribers) {
+    bench__hub_teardown(state);
+    return false;
+  }
+
+  for(size_t i = 0; i < state->cfg.table_size; i++) {
+    UMsgTarget *tgt = &state->subscribers[i];
+    umsg_tgt_callback_init(tgt, bench__hub_recv);
+    tgt->user_data = (uintptr_t)state;
+    if(!umsg_tgt_add_filter(tgt, bench__prop_id(i))) {
+      bench__hub_teardown(state);
+      return false;
+    }
+    umsg_hub_subscribe(&state->hub, tgt);
+  }
+
+  if(xTaskCreate(bench__hub_task, "BenchHub", STACK_BYTES(1024), &state->hub,
+                  uxTaskPriorityGet(NULL), &state->hub_task) != pdPASS) {
+    state->hub_task = NULL;
+    bench__hub_teardown(state);
+    return false;
+  }
+
+  return true;
+}
+
+
+// Round trip from sending to the hub until the subscriber callback runs
+static void bench__hub_dispatch_op(BenchState *state, BenchWorker *worker, size_t key) {
+  UMsg msg = {
+    .id = bench__prop_id(key),
+    .source = 0,
+    .payload = worker->op_count
+  };
+
+  if(umsg_hub_send(&state->hub, &msg, INFINITE_TIMEOUT))
+    xSemaphoreTake(state->hub_done, portMAX_DELAY);
+}
+
+
+// ******************** Runner ********************
+
+static const BenchDef s_benchmarks[] = {
+  {"prop_set",      bench__prop_setup, bench__prop_set_op, bench__prop_teardown, true},
+  {"prop_get",      bench__prop_setup, bench__prop_get_op, bench__prop_teardown, true},
+  {"prop_mix",      bench__prop_setup, bench__prop_mix_op, bench__prop_teardown, true},
+  {"dh_insert",     bench__hash_setup, bench__dh_insert_op, bench__hash_teardown, false},
+  {"dh_lookup",     bench__dh_lookup_setup, bench__dh_lookup_op, bench__hash_teardown, false},
+  {"mp_alloc",      NULL, bench__mp_alloc_op, NULL, true},
+  {"hub_dispatch",  bench__hub_setup, bench__hub_dispatch_op, bench__hub_teardown, false}
+};
+
+
+static void bench__worker_run(BenchWorker *worker) {
+  BenchState *state = worker->state;
+  size_t keys[BENCH_OPS_PER_SAMPLE];
+
+  for(size_t s = 0; s < worker->num_samples; s++) {
+    for(size_t i = 0; i < COUNT_OF(keys); i++) {
+      keys[i] = bench__next_key(worker);
+    }
+
+    uint32_t start = s_get_timer_count();
+    for(size_t i = 0; i < COUNT_OF(keys); i++) {
+      state->def->run_op(state, worker, keys[i]);
+      worker->op_count++;
+    }
+    worker->samples[s] = s_get_timer_count() - start;
+  }
+}
+
+
+static void bench__worker_task(void *ctx) {
+  BenchWorker *worker = (BenchWorker *)ctx;
+  bench__worker_run(worker);
+  mp_flush_thread_cache();
+  xSemaphoreGive(worker->done);
+  vTaskDelete(NULL);
+}
+
+
+static int bench__cmp_samples(const void *a, const void *b) {
+  uint32_t sa = *(const uint32_t *)a;
+  uint32_t sb = *(const uint32_t *)b;
+  return sa < sb ? -1 : (sa > sb ? 1 : 0);
+}
+
+
+// Convert timer ticks for a group of ops into nanoseconds per op
+static uint64_t bench__ticks_to_ns(uint64_t ticks, size_t ops) {
+  // Split whole seconds from the remainder so the scaling can't overflow
+  uint64_t ns = ticks / s_timer_clock_hz * 1000000000ull +
+                ticks % s_timer_clock_hz * 1000000000ull / s_timer_clock_hz;
+  return ns / ops;
+}
+
+
+static void bench__report(BenchState *state, uint32_t *samples, size_t num_samples, unsigned threads) {
+  uint64_t total_ticks = 0;
+  for(size_t i = 0; i < num_samples; i++) {
+    total_ticks += samples[i];
+  }
+
+  qsort(samples, num_samples, sizeof(*samples), bench__cmp_samples);
+
+  uint64_t tvals[] = {
+    bench__ticks_to_ns(total_ticks, num_samples * BENCH_OPS_PER_SAMPLE),
+    bench__ticks_to_ns(samples[0], BENCH_OPS_PER_SAMPLE),
+    bench__ticks_to_ns(samples[num_samples / 2], BENCH_OPS_PER_SAMPLE),
+    bench__ticks_to_ns(samples[num_samples * 90 / 100], BENCH_OPS_PER_SAMPLE),
+    bench__ticks_to_ns(samples[num_samples * 99 / 100], BENCH_OPS_PER_SAMPLE),
+    bench__ticks_to_ns(samples[num_samples-1], BENCH_OPS_PER_SAMPLE)
+  };
+
+  printf("  %-13s %2u", state->def->name, threads);
+  for(unsigned i = 0; i < COUNT_OF(tvals); i++) {
+    char si_buf[10];
+    long ns = tvals[i] > LONG_MAX ? LONG_MAX : (long)tvals[i];
+    to_si_value(ns, -9, si_buf, sizeof si_buf, /*frac_places*/1, SIF_GREEK_MICRO);
+    printf(" %9ss", si_buf);
+  }
+  puts("");
+}
+
+
+static bool bench__run(const BenchDef *def, BenchConfig *cfg) {
+  BenchState state = {
+    .cfg = *cfg,
+    .def = def
+  };
+
+  unsigned threads = def->multi_thread ? cfg->threads : 1;
+  size_t samples_per_worker = cfg->iterations / BENCH_OPS_PER_SAMPLE;
+  if(samples_per_worker == 0)
+    samples_per_worker = 1;
+
+  BenchWorker workers[BENCH_MAX_THREADS] = {0};
+  uint32_t *samples = cs_malloc(threads * samples_per_worker * sizeof(uint32_t));
+  SemaphoreHandle_t done = xSemaphoreCreateCounting(threads, 0);
+
+  if(!samples || !done || (def->setup && !def->setup(&state))) {
+    if(samples) cs_free(samples);
+    if(done) vSemaphoreDelete(done);
+    printf("  %-13s " A_RED "setup failed" A_NONE "\n", def->name);
+    return false;
+  }
+
+  for(unsigned i = 0; i < threads; i++) {
+    BenchWorker *worker = &workers[i];
+    worker->state = &state;
+    random_init(&worker->rng, i+1);
+    worker->next_key = i * cfg->table_size / threads;  // Threads start in different regions
+    worker->samples = &samples[i * samples_per_worker];
+    worker->num_samples = samples_per_worker;
+    worker->done = done;
+  }
+
+  // Single threaded benchmarks run directly in the caller
+  unsigned started = 0;
+  if(threads == 1) {
+    bench__worker_run(&workers[0]);
+    started = 1;
+
+  } else {
+    for(unsigned i = 0; i < threads; i++) {
+      if(xTaskCreate(bench__worker_task, "Bench", STACK_BYTES(1024), &workers[i],
+                      uxTaskPriorityGet(NULL), NULL) != pdPASS)
+        break;
+      started++;
+    }
+
+    for(unsigned i = 0; i < started; i++) {
+      xSemaphoreTake(done, portMAX_DELAY);
+    }
+  }
+
+  if(def->teardown)
+    def->teardown(&state);
+
+  if(started > 0)
+    bench__report(&state, samples, started * samples_per_worker, started);
+
+  vSemaphoreDelete(done);
+  cs_free(samples);
+
+  return started > 0;
+}
+
+
+static void bench__heading(void) {
+  puts(A_YLW "    Name        Thr  Avg        Min        P50        P90        P99        Max");
+  puts(    u8"  ─────────────────────────────────────────────────────────────────────────────────" A_NONE);
+}
+
+
+static bool bench__timer_ready(void) {
+#if defined PLATFORM_HOSTED
+  if(!s_get_timer_count)
+    bench_init(bench__nanos, 1000000000ul);
+#endif
+
+  return s_get_timer_count && s_timer_clock_hz > 0;
+}
+
+
+/*
+Run a single benchmark
+
+Args:
+  name: Name of the benchmark
+  cfg:  Benchmark settings
+
+Returns:
+  true on success
+*/
+bool bench_run(const char *name, BenchConfig *cfg) {
+  if(!bench__timer_ready())
+    return false;
+
+  for(unsigned i = 0; i < COUNT_OF(s_benchmarks); i++) {
+    if(!strcasecmp(s_benchmarks[i].name, name)) {
+      bench__heading();
+      return bench__run(&s_benchmarks[i], cfg);
+    }
+  }
+
+  return false;
+}
+
+
+/*
+Run all benchmarks
+
+Args:
+  cfg:  Benchmark settings
+*/
+void bench_run_all(BenchConfig *cfg) {
+  if(!bench__timer_ready())
+    return;
+
+  bench__heading();
+  for(unsigned i = 0; i < COUNT_OF(s_benchmarks); i++) {
+    bench__run(&s_benchmarks[i], cfg);
+  }
+}
+
+
+int32_t cmd_bench(uint8_t argc, char *argv[], void *eval_ctx) {
+  GetoptState state = {.report_errors = true};
+  int c;
+
+  BenchConfig cfg;
+  bench_default_config(&cfg);
+
+  while((c = getopt_r(argv, "n:i:d:t:lh", &state)) != -1) {
+    switch(c) {
+    case 'n': cfg.table_size = strtoul(state.optarg, NULL, 0); break;
+    case 'i': cfg.iterations = strtoul(state.optarg, NULL, 0); break;
+    case 't': cfg.threads = strtoul(state.optarg, NULL, 0); break;
+    case 'd':
+      if(!strcasecmp(state.optarg, "seq")) {
+        cfg.key_dist = BENCH_KEYS_SEQUENTIAL;
+      } else if(!strcasecmp(state.optarg, "uniform")) {
+        cfg.key_dist = BENCH_KEYS_UNIFORM;
+      } else if(!strcasecmp(state.optarg, "skew")) {
+        cfg.key_dist = BENCH_KEYS_SKEWED;
+      } else {
+        puts("Invalid key distribution");
+        return -4;
+      }
+      break;
+
+    case 'l':
+      for(unsigned i = 0; i < COUNT_OF(s_benchmarks); i++) {
+        puts(s_benchmarks[i].name);
+      }
+      return 0;
+      break;
+
+    case 'h':
+      puts("BENCH [-n <size>] [-i <iterations>] [-d seq|uniform|skew] [-t <threads>] [-l] [-h] [name]");
+      return 0;
+      break;
+
+    default:
+    case ':':
+    case '?':
+      return -3;
+      break;
+    }
+  }
+
+  if(cfg.table_size == 0 || cfg.threads == 0 || cfg.threads > BENCH_MAX_THREADS) {
+    puts("Invalid settings");
+    return -4;
+  }
+
+  if(!bench__timer_ready()) {
+    puts("No benchmark timer");
+    return -5;
+  }
+
+  printf("Size: %"PRIuz"  Iterations: %"PRIuz"\n", cfg.table_size, cfg.iterations);
+
+  if(state.optind < argc) {
+    if(!bench_run(argv[state.optind], &cfg)) {
+      puts("Benchmark failed");
+      return -5;
+    }
+  } else {
+    bench_run_all(&cfg);
+  }
+
+  return 0;
+}
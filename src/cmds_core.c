@@ -3,6 +3,7 @@
 #include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <ctype.h>
 #include <time.h>
 
@@ -466,13 +467,33 @@ static int32_t cmd_free(uint8_t argc, char *argv[], void *eval_ctx) {
 
   int c;
   bool show_hist = false;
+  bool analyze = false;
+  bool apply = false;
 
-  while((c = getopt_r(argv, "p", &state)) != -1) {
+  while((c = getopt_r(argv, "paAr", &state)) != -1) {
     switch(c) {
     case 'p':
       show_hist = true;
       break;
 
+#ifdef USE_MP_TELEMETRY
+    case 'r': // Restart pool telemetry
+      mp_reset_telemetry(&g_pool_set);
+      return 0;
+      break;
+#endif
+
+    case 'a': // Propose new pool sizes
+      analyze = true;
+      break;
+
+#ifdef PLATFORM_HOSTED
+    case 'A': // Propose and apply new pool sizes
+      analyze = true;
+      apply = true;
+      break;
+#endif
+
     default:
     case ':':
     case '?':
@@ -481,6 +502,28 @@ static int32_t cmd_free(uint8_t argc, char *argv[], void *eval_ctx) {
     }
   }
 
+#ifdef USE_MP_COLLECT_STATS
+  if(analyze) {
+    mpPoolGeometry geom[8];
+    size_t num_pools = mp_analyze_pools(&g_pool_set, geom, COUNT_OF(geom), _Alignof(max_align_t));
+    if(num_pools == 0) {
+      puts("No pool statistics");
+      return 0;
+    }
+
+    puts("Proposed pools:");
+    mp_print_geometry(&g_pool_set, geom, num_pools);
+
+    if(apply && mp_apply_geometry(&g_pool_set, geom, num_pools, _Alignof(max_align_t)) == 0)
+      puts("Failed to create pools");
+
+    return 0;
+  }
+#else
+  (void)analyze;
+  (void)apply;
+#endif
+
   if(!show_hist) {
 
     char buf[8];
@@ -580,6 +623,7 @@ static int32_t cmd_log(uint8_t argc, char *argv[], void *eval_ctx) {
       write_count = (uint32_t)entry.value;
 
     logdb_format(&g_log_db);
+    prop_db_request_checkpoint(&g_prop_db); // Deltas need a new base in the empty log
 
     // Create temporary prop DB to hold write counter
     PropDB *fmt_prop_db = cs_malloc(sizeof(PropDB));
@@ -631,6 +675,7 @@ static int32_t cmd_property(uint8_t argc, char *argv[], void *eval_ctx) {
     case 'h':
       puts("List all properties:  PROPerty");
       puts("List named property:  PROPerty [-d] <name>");
+      puts("List matching props:  PROPerty <name with * fields>");
       puts("Query property:       PROPerty -q <name>");
       puts("Set property:         PROPerty <name>=<value>");
       return 0;
@@ -692,6 +737,20 @@ static int32_t cmd_property(uint8_t argc, char *argv[], void *eval_ctx) {
   // Check if this is an ID string (Pnnnnnnnn) or full name
   prop = prop_parse_any(prop_name);
 
+  if(prop && !prop_value && prop_has_mask(prop)) { // List subtree
+    uint32_t matches[16];
+    uint32_t after = 0;
+    size_t num_matches;
+
+    while((num_matches = prop_db_query(&g_prop_db, prop, after, matches, COUNT_OF(matches))) > 0) {
+      for(size_t i = 0; i < num_matches; i++) {
+        prop_print(&g_prop_db, matches[i], dump_blob);
+      }
+      after = matches[num_matches-1];
+    }
+    return 0;
+  }
+
   if(prop && prop_value) {  // Assign new value to property
     // Confirm we can write this prop
     uint8_t attrs;
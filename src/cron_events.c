@@ -716,7 +716,7 @@ bool cron_load_from_prop_db(PropDB *db) {
   if(!prop_get(db, P_SYS_CRON_LOCAL_VALUE, &entry))
     return false;
 
-  return cron__deserialize((CronSerialData *)entry.value);
+  return cron__deserialize((CronSerialData *)prop_entry_data(&entry));
 }
 
 
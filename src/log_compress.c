@@ -17,6 +17,11 @@
 #define COMPRESS_LOOKAHEAD_SIZE 4
 
 bool logdb_compress_block(LogDBBlock *block, LogDBBlock **compressed_block) {
+  return logdb_compress_block_arena(block, compressed_block, NULL);
+}
+
+
+bool logdb_compress_block_arena(LogDBBlock *block, LogDBBlock **compressed_block, mpArena *arena) {
   /*  Compressed block:
       [header] [uncompressed len][compressed data]
   */
@@ -27,7 +32,9 @@ bool logdb_compress_block(LogDBBlock *block, LogDBBlock **compressed_block) {
   }
 
   // Compress the raw data
-  LogDBBlock *new_block = cs_malloc(sizeof(LogDBBlock) + sizeof(uint16_t) + block->data_len);
+  size_t block_size = sizeof(LogDBBlock) + sizeof(uint16_t) + block->data_len;
+  mpArenaMark mark = arena ? mp_arena_mark(arena) : 0;
+  LogDBBlock *new_block = arena ? mp_arena_alloc(arena, block_size) : cs_malloc(block_size);
 
   if(!new_block) {
     *compressed_block = NULL;
@@ -81,8 +88,12 @@ bool logdb_compress_block(LogDBBlock *block, LogDBBlock **compressed_block) {
 cleanup:
   heatshrink_encoder_free(hse);
 
-  if(!rval)
-    cs_free(new_block);
+  if(!rval) {
+    if(arena)
+      mp_arena_reset(arena, mark);
+    else
+      cs_free(new_block);
+  }
 
   *compressed_block = rval ? new_block : NULL;
   return rval;
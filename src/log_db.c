@@ -177,13 +177,15 @@ bool logdb_mount(LogDB *db) {
 }
 
 
-static bool logdb__prep_for_write(LogDB *db, size_t write_len) {
+// Find where the next block will be written and whether its sector must be erased first
+static size_t logdb__write_offset(LogDB *db, size_t write_len, bool *wrap, bool *erase_sector) {
   // We need enough space for the new block and it cannot cross a sector boundary
   size_t write_offset = db->head_offset;
   size_t write_sector = write_offset / db->storage.sector_size;
   size_t end_offset = write_offset + write_len-1;
   size_t end_sector = end_offset / db->storage.sector_size;
-  bool erase_sector = false;
+  *wrap = false;
+  *erase_sector = false;
 
   if(end_sector != write_sector) { // Move start up to next sector
     write_offset = end_sector * db->storage.sector_size;
@@ -193,15 +195,27 @@ static bool logdb__prep_for_write(LogDB *db, size_t write_len) {
   if(write_sector >= db->storage.num_sectors) { // Wrap around
     write_offset = 0;
     write_sector = 0;
-    erase_sector = true;
-    db->generation = !db->generation;
+    *wrap = true;
+    *erase_sector = true;
   }
 
   if(write_sector == db->tail_sector && db->tail_filled) {
     // We need to overwrite the tail
-    erase_sector = true;
+    *erase_sector = true;
   }
 
+  return write_offset;
+}
+
+
+static bool logdb__prep_for_write(LogDB *db, size_t write_len) {
+  bool wrap, erase_sector;
+  size_t write_offset = logdb__write_offset(db, write_len, &wrap, &erase_sector);
+  size_t write_sector = write_offset / db->storage.sector_size;
+
+  if(wrap)
+    db->generation = !db->generation;
+
   if(erase_sector) {
     db->storage.erase_sector(db->storage.ctx, write_sector * db->storage.sector_size,
                              db->storage.sector_size);
@@ -221,6 +235,15 @@ static bool logdb__prep_for_write(LogDB *db, size_t write_len) {
 }
 
 
+// Check if writing a block with data_len bytes will erase the sector holding block_start
+bool logdb_write_erases(LogDB *db, size_t data_len, size_t block_start) {
+  bool wrap, erase_sector;
+  size_t write_offset = logdb__write_offset(db, data_len + sizeof(LogDBBlock), &wrap, &erase_sector);
+
+  return erase_sector && write_offset / db->storage.sector_size == block_start / db->storage.sector_size;
+}
+
+
 bool logdb_write_block(LogDB *db, LogDBBlock *block) {
   size_t block_size = block->data_len + sizeof(*block);
 
@@ -380,6 +403,10 @@ bool logdb_read_last(LogDB *db, LogDBBlock *block) {
   return logdb__read_block(db, db->latest_offset, block) == BLOCK_VALID;
 }
 
+bool logdb_read_at(LogDB *db, size_t block_start, LogDBBlock *block) {
+  return logdb__read_block(db, block_start, block) == BLOCK_VALID;
+}
+
 bool logdb_at_last_block(LogDB *db) {
   return db->read_offset == db->latest_offset;
 }
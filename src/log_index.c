@@ -5,18 +5,11 @@
 
 #include "cstone/platform.h"
 
-#include "util/dhash.h"
 #include "cstone/log_db.h"
 #include "cstone/log_index.h"
 #include "cstone/debug.h"
 
 
-typedef struct {
-  uint32_t data_len;
-  uint32_t block_start;
-} LogDBIndexItem;
-
-
 bool logdb_index_update(LogDBIndex *index, LogDBBlock *block, size_t block_start) {
   LogDBIndexItem item = {
     .data_len     = block->data_len,
@@ -25,31 +18,12 @@ bool logdb_index_update(LogDBIndex *index, LogDBBlock *block, size_t block_start
 
 //  printf("## Index build key=%u @%lu  len=%u  %016lX\n", block->kind, block_start, block->data_len, *(uint64_t*)&item);
 
-
-  dhKey key = {
-    .data = (void *)(uintptr_t)block->kind,
-    .length = 1
-  };
-  return dh_insert(&index->hash, key, &item);
-}
-
-
-static void block_ix_item_destroy(dhKey key, void *value, void *ctx) {
+  return ihash_insert__LogDBIndexItem(&index->hash, block->kind, &item);
 }
 
 
 bool logdb_index_create(LogDB *db, LogDBIndex *index) {
-  dhConfig hash_cfg = {
-    .init_buckets = 8,
-    .value_size   = sizeof(LogDBIndexItem),
-    .max_storage  = 0,
-    .ext_storage  = NULL,
-    .destroy_item = block_ix_item_destroy,
-    .gen_hash     = dh_gen_hash_int,
-    .is_equal     = dh_equal_hash_keys_int
-  };
-
-  if(!dh_init(&index->hash, &hash_cfg, index))
+  if(!ihash_init__LogDBIndexItem(&index->hash, 8))
     return false;
 
 
@@ -67,19 +41,11 @@ bool logdb_index_create(LogDB *db, LogDBIndex *index) {
 
 
 void logdb_index_free(LogDBIndex *index) {
-  dh_free(&index->hash);
+  ihash_free__LogDBIndexItem(&index->hash);
 }
 
 static inline bool logdb__index_lookup(LogDBIndex *index, uint8_t kind, LogDBIndexItem *item) {
-  dhKey key = {
-    .data = (void *)(uintptr_t)kind,
-    .length = 1
-  };
-
-  if(!dh_lookup(&index->hash, key, item))
-    return false;
-
-  return true;
+  return ihash_lookup__LogDBIndexItem(&index->hash, kind, item);
 }
 
 
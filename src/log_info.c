@@ -42,7 +42,8 @@ void logdb_dump_record(LogDB *db) {
     return;
 
   block->data_len = header.data_len;
-  if(logdb_read_last(db, block) && block->kind == BLOCK_KIND_PROP_DB) {
+  if(logdb_read_last(db, block) &&
+      (block->kind == BLOCK_KIND_PROP_DB || block->kind == BLOCK_KIND_PROP_DELTA)) {
 
     // Create temporary prop DB to hold decoded block data
     PropDB *temp_db = cs_malloc(sizeof(PropDB));
@@ -1,6 +1,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 
 #include "build_config.h"
@@ -18,6 +19,13 @@
 
 #define USE_PROP_COMPRESSION
 
+// Save only changed props between full checkpoints
+#define USE_PROP_DELTA_SAVES
+
+// Delta blocks written before the next full checkpoint. Restores replay at most
+// this many deltas and the log must be large enough to keep them all after a checkpoint.
+#define PROP_LOG_CHECKPOINT_INTERVAL  16
+
 
 /*static inline uint32_t rot_left(uint32_t n, unsigned bits) {*/
 /*  const unsigned mask = 8*sizeof(n) - 1;*/
@@ -51,79 +59,219 @@ void update_prng_seed(PropDB *db) {
 }
 
 
-bool save_props_to_log(PropDB *db, LogDB *log_db, bool compress) {
+#ifdef USE_PROP_DELTA_SAVES
+// Check that the last checkpoint written from db is still in the log
+static bool save_props__have_checkpoint(PropDB *db, LogDB *log_db) {
+  LogDBBlock header;
+
+  if(!logdb_read_raw(log_db, db->checkpoint_offset, (uint8_t *)&header, sizeof(header)))
+    return false;
+
+  // A format or wraparound may have replaced it with a different block
+  return logdb_validate_header(&header) && header.kind == BLOCK_KIND_PROP_DB &&
+         header.data_crc == db->checkpoint_crc;
+}
+#endif
+
+
+// Serialize and write props with transient blocks from an arena or the heap
+static bool save_props__write(PropDB *db, LogDB *log_db, bool compress, mpArena *arena) {
   LogDBBlock *block;
 
-  if(prop_db_serialize(db, &block)) {
+#ifdef USE_PROP_DELTA_SAVES
+  bool checkpoint = db->checkpoint_needed || db->delta_saves >= PROP_LOG_CHECKPOINT_INTERVAL ||
+                    !save_props__have_checkpoint(db, log_db);
+
+  if(!checkpoint) {
+    if(!prop_db_serialize_delta_arena(db, &block, arena))
+      return false;
+
+    if(block->data_len == 0) { // Nothing changed since the last save
+      if(!arena)
+        cs_free(block);
+      return true;
+    }
+
+    // Deltas can't be restored without their checkpoint. Save a new one if
+    // this block would erase it.
+    if(logdb_write_erases(log_db, block->data_len, db->checkpoint_offset)) {
+      prop_db_request_checkpoint(db); // Serialized props were marked as saved
+      if(!arena)
+        cs_free(block);
+      checkpoint = true;
+    }
+  }
+#else
+  bool checkpoint = true;
+#endif
+
+  if(checkpoint) {
+    if(!prop_db_serialize_arena(db, &block, arena))
+      return false;
+  }
+
+  bool status;
+  LogDBBlock *written = block;
+  mpArena *compress_arena = arena;
+
 #ifdef USE_PROP_COMPRESSION
-    // Attempt to compress block
-    LogDBBlock *compressed_block;
+  // Compression needs space for a block as large as the original. Use the heap
+  // when the arena is short so the serialized props don't have to be redone.
+  size_t compress_size = sizeof(LogDBBlock) + sizeof(uint16_t) + block->data_len + _Alignof(max_align_t);
+  if(compress && arena && mp_arena_available(arena) < compress_size)
+    compress_arena = NULL;
+
+  // Attempt to compress block
+  LogDBBlock *compressed_block;
 
-    if(compress && logdb_compress_block(block, &compressed_block)) {
-      DPRINT("Writing compressed block  %u --> %u", block->data_len, compressed_block->data_len);
+  if(compress && logdb_compress_block_arena(block, &compressed_block, compress_arena)) {
+    DPRINT("Writing compressed block  %u --> %u", block->data_len, compressed_block->data_len);
 
-      logdb_write_block(log_db, compressed_block);  // Save compressed
-      cs_free(compressed_block);
+    status = logdb_write_block(log_db, compressed_block);  // Save compressed
+    written = compressed_block;
 
-    } else
+  } else
 #endif
-    {  // Compression less than 1.0x or disabled
-      logdb_write_block(log_db, block); // Save uncompressed
+  {  // Compression less than 1.0x or disabled
+    status = logdb_write_block(log_db, block); // Save uncompressed
+  }
+
+  if(status) {
+    db->delta_saves = checkpoint ? 0 : db->delta_saves + 1;
+    if(checkpoint) {
+      db->checkpoint_offset = log_db->latest_offset;
+      db->checkpoint_crc = written->data_crc;
     }
+  } else {
+    prop_db_request_checkpoint(db);
+  }
 
+  if(written != block && !compress_arena)
+    cs_free(written);
+  if(!arena)
     cs_free(block);
-    return true;
+
+  return true;
+}
+
+
+bool save_props_to_log(PropDB *db, LogDB *log_db, bool compress) {
+  // Try to build the blocks in the largest free pool element so that a save
+  // doesn't fragment the heap. Fall back to the heap if they don't fit.
+  mpArena arena;
+  if(mp_arena_init(&arena, db->pool_set, 0)) {
+    bool status = save_props__write(db, log_db, compress, &arena);
+    mp_arena_free(&arena);
+
+    if(status)
+      return true;
   }
 
-  return false;
+  return save_props__write(db, log_db, compress, NULL);
 }
 
 
-unsigned restore_props_from_log(PropDB *db, LogDB *log_db) {
-  LogDBBlock *block;
+static inline bool is_prop_block(LogDBBlock *block) {
+  return block->kind == BLOCK_KIND_PROP_DB || block->kind == BLOCK_KIND_PROP_DELTA;
+}
+
+
+// Decode a checkpoint or delta block into prop DB
+static unsigned restore_props__block(PropDB *db, LogDBBlock *block) {
   unsigned count = 0;
 
-  // Get block size
+  if(!block->compressed) {
+    DPUTS("Decode normal");
+    count = prop_db_deserialize(db, block->data, block->data_len);
+
+  } else {
+    uint8_t *decompressed;
+    size_t data_len = logdb_decompress_block(block, &decompressed);
+    DPRINT("Decode compressed %u --> %" PRIuz, block->data_len, data_len);
+    if(data_len > 0) {
+      count = prop_db_deserialize(db, decompressed, data_len);
+      cs_free(decompressed);
+    }
+  }
+
+  return count;
+}
+
+
+/*
+Restore persistent props from the log
+
+The newest checkpoint block is decoded followed by any delta blocks
+saved after it. If the log has deltas but no checkpoint they are not applied
+since they only hold part of the props. An error is reported and the DB
+keeps its defaults.
+
+Args:
+  db:     Database to restore into
+  log_db: Log to read from
+
+Returns:
+  Number of props decoded
+*/
+unsigned restore_props_from_log(PropDB *db, LogDB *log_db) {
   LogDBBlock header;
-  header.data_len = 0;
-  logdb_read_last(log_db, &header);
-  if(header.data_len == 0) // No valid blocks in log FS
+  size_t block_start;
+  unsigned count = 0;
+
+  // Find the newest checkpoint and the largest block to replay
+  size_t checkpoint_start = 0;
+  bool have_checkpoint = false;
+  bool have_blocks = false;
+  size_t max_data_len = 0;
+
+  logdb_read_init(log_db);
+  while(logdb_read_next_header(log_db, &header, &block_start)) {
+    if(!is_prop_block(&header))
+      continue;
+
+    if(header.kind == BLOCK_KIND_PROP_DB) { // Older blocks are superseded
+      checkpoint_start = block_start;
+      have_checkpoint = true;
+      max_data_len = 0;
+    }
+
+    if(header.data_len > max_data_len)
+      max_data_len = header.data_len;
+    have_blocks = true;
+  }
+
+  if(!have_blocks) // No valid blocks in log FS
+    return 0;
+
+  if(!have_checkpoint) { // Checkpoint was lost
+    report_error(P1_ERROR | P2_STORAGE | P3_PROP | P4_INVALID, 0);
     return 0;
+  }
 
-  block = (LogDBBlock *)cs_malloc(sizeof(*block) + header.data_len);
+  LogDBBlock *block = (LogDBBlock *)cs_malloc(sizeof(*block) + max_data_len);
   if(!block)
     return 0;
 
-  block->data_len = header.data_len;
-
-  // Get block data
-  if(logdb_read_last(log_db, block)) {
-    // Decode into prop DB
-
-    switch(block->kind) {
-    case BLOCK_KIND_PROP_DB:
-      if(!block->compressed) {
-        DPUTS("Decode normal");
-        count = prop_db_deserialize(db, block->data, block->data_len);
-
-      } else {
-        uint8_t *decompressed;
-        size_t data_len = logdb_decompress_block(block, &decompressed);
-        DPRINT("Decode compressed %u --> %" PRIuz, block->data_len, data_len);
-        if(data_len > 0) {
-          count = prop_db_deserialize(db, decompressed, data_len);
-          cs_free(decompressed);
-        }
-      }
-      break;
-
-    default:
-      break;
+  bool replay = false; // Start at the checkpoint
+
+  prop_db_transact_begin(db);
+
+    logdb_read_init(log_db);
+    while(logdb_read_next_header(log_db, &header, &block_start)) {
+      if(block_start == checkpoint_start)
+        replay = true;
+
+      if(!replay || !is_prop_block(&header))
+        continue;
+
+      block->data_len = max_data_len;
+      if(logdb_read_at(log_db, block_start, block))
+        count += restore_props__block(db, block);
     }
-  }
+
+  prop_db_transact_end(db);
 
   cs_free(block);
 
   return count;
 }
-
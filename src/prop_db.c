@@ -10,6 +10,7 @@
 #include "util/mempool.h"
 #include "util/term_color.h"
 #include "util/hex_dump.h"
+#include "util/list_ops.h"
 
 #include "build_config.h"
 #include "cstone/platform.h"
@@ -22,20 +23,196 @@
 
 #define MAX_PROP_NAME_LEN  48
 
+// Hash buckets migrated on each update when the prop hash grows
+#define PROP_DB_MIGRATE_STEP  8
+
+// Initial number of entries in the ordered index
+#define PROP_DB_INDEX_INIT  16
+
+// Watcher callbacks collected per pass under the watch lock
+#define PROP_DB_NOTIFY_BATCH  8
+
+// Allow prop_get() to read the hash without taking the DB lock.
+// Updates are still serialized by the lock.
+#define USE_PROP_DB_LOCK_FREE_READS
+
 // PropDB.transactions is declared as uint32_t but we will use it
 // here as atomic_uint. This avoids the need for an opaque type.
 _Static_assert(sizeof(uint32_t) >= sizeof(atomic_uint), "PropDB.transactions too small");
+_Static_assert(sizeof(uintptr_t) >= sizeof(atomic_uintptr_t), "PropDB.batch_owner too small");
+
+#define BATCH_OWNER(db)  ((atomic_uintptr_t *)&(db)->batch_owner)
 
 
 #define LOCK()    xSemaphoreTake(db->lock, portMAX_DELAY)
 #define UNLOCK()  xSemaphoreGive(db->lock)
 
+#define WATCH_LOCK()    xSemaphoreTake(db->watch_lock, portMAX_DELAY)
+#define WATCH_UNLOCK()  xSemaphoreGive(db->watch_lock)
+
+
+
+/*
+Release a string or blob value removed from the DB. If an active snapshot
+still references the value it is retired and freed when the snapshot is released.
+Must be called with the DB locked.
+
+Args:
+  db:     Database that owned the value
+  value:  Value to release
+
+Returns:
+  true if the value was freed or retired
+*/
+static bool prop__release_value(PropDB *db, void *value) {
+  for(PropDBSnapshot *snap = db->snapshots; snap; snap = snap->next) {
+    for(size_t i = 0; i < snap->num_values; i++) {
+      if(snap->values[i].value == value && !snap->values[i].retired) {
+        snap->values[i].retired = true;
+        return true;
+      }
+    }
+  }
+
+  return mp_free(db->pool_set, value);
+}
+
+
+// ******************** Ordered index ********************
+
+// The index is a sorted array of prop IDs kept alongside the hash. Prop IDs
+// are hierarchical so any prefix of fields maps to a contiguous range.
+// All index operations must be called with the DB locked.
+
+static size_t prop__index_lower_bound(PropDB *db, uint32_t prop) {
+  size_t lo = 0;
+  size_t hi = db->index_len;
+
+  while(lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if(db->index[mid] < prop)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+
+static int prop__cmp_ids(const void *a, const void *b) {
+  uint32_t a_id = *(const uint32_t *)a;
+  uint32_t b_id = *(const uint32_t *)b;
+
+  return (a_id > b_id) - (a_id < b_id);
+}
+
+
+static bool prop__index_reserve(PropDB *db, size_t index_len) {
+  if(index_len <= db->index_max)
+    return true;
+
+  size_t new_max = db->index_max > 0 ? db->index_max : PROP_DB_INDEX_INIT;
+  while(new_max < index_len) {
+    new_max *= 2;
+  }
+
+  uint32_t *new_index = cs_realloc(db->index, new_max * sizeof(uint32_t));
+  if(!new_index)
+    return false;
+
+  db->index = new_index;
+  db->index_max = new_max;
+  return true;
+}
+
+
+// Regenerate the index from the hash
+static bool prop__index_rebuild(PropDB *db) {
+  if(!prop__index_reserve(db, dh_num_items(&db->hash)))
+    return false;
+
+  dhIter it;
+  dhKey key;
+  void *value;
+
+  db->index_len = 0;
+  dh_iter_init(&db->hash, &it);
+  while(dh_iter_next(&it, &key, &value)) {
+    db->index[db->index_len++] = (uintptr_t)key.data;
+  }
+
+  qsort(db->index, db->index_len, sizeof(uint32_t), prop__cmp_ids);
+  db->index_stale = false;
+  return true;
+}
+
+
+static void prop__index_insert(PropDB *db, uint32_t prop) {
+  if(db->index_stale)
+    return;
+
+  size_t pos = prop__index_lower_bound(db, prop);
+  if(pos < db->index_len && db->index[pos] == prop) // Already present
+    return;
+
+  if(!prop__index_reserve(db, db->index_len + 1)) { // Try again on next query
+    db->index_stale = true;
+    return;
+  }
+
+  memmove(&db->index[pos+1], &db->index[pos], (db->index_len - pos) * sizeof(uint32_t));
+  db->index[pos] = prop;
+  db->index_len++;
+}
+
+
+static void prop__index_remove(PropDB *db, uint32_t prop) {
+  if(db->index_stale)
+    return;
+
+  size_t pos = prop__index_lower_bound(db, prop);
+  if(pos < db->index_len && db->index[pos] == prop) {
+    db->index_len--;
+    memmove(&db->index[pos], &db->index[pos+1], (db->index_len - pos) * sizeof(uint32_t));
+  }
+}
+
+
+/*
+Move a small string or blob into the entry's inline storage
+
+Args:
+  entry:  Entry to convert
+
+Returns:
+  The original data pointer if the value was moved inline. NULL otherwise
+*/
+static void *prop__inline_value(PropDBEntry *entry) {
+  if(entry->is_inline || !entry->value || !prop_entry_fits_inline(entry->kind, entry->size))
+    return NULL;
+
+  void *data = (void *)entry->value;
+  size_t size = entry->size;
+
+  // The source may already be NUL terminated but this avoids depending on it
+  uint8_t buf[PROP_INLINE_SIZE] = {0};
+  memcpy(buf, data, size);
+  memcpy(entry->inline_data, buf, sizeof(buf));
+
+  entry->is_inline = true;
+  entry->inline_size = size;
+  return data;
+}
 
 
 static void prop_item_destroy(dhKey key, void *value, void *ctx) {
   PropDB *db = (PropDB *)ctx;
   PropDBEntry *entry = (PropDBEntry *)value;
 
+  if(entry->is_inline)  // Nothing to free
+    return;
+
   // Free resources based on entry kind
   switch(entry->kind) {
   case P_KIND_UINT:
@@ -44,7 +221,7 @@ static void prop_item_destroy(dhKey key, void *value, void *ctx) {
 
   case P_KIND_STRING:
   case P_KIND_BLOB:
-    if(mp_free(db->pool_set, (void *)entry->value))
+    if(prop__release_value(db, (void *)entry->value))
       entry->value = (uintptr_t)NULL;
     break;
 
@@ -73,8 +250,8 @@ static bool prop_item_replace(dhKey key, void *old_value, void *new_value, void
     new_entry->kind = old_entry->kind;
 
   // Attempt to free string and binary values
-  if(old_entry->kind == P_KIND_STRING || old_entry->kind == P_KIND_BLOB) {
-    if(mp_free(db->pool_set, (void *)old_entry->value))
+  if((old_entry->kind == P_KIND_STRING || old_entry->kind == P_KIND_BLOB) && !old_entry->is_inline) {
+    if(prop__release_value(db, (void *)old_entry->value))
       old_entry->value = (uintptr_t)NULL;
   }
 
@@ -85,20 +262,6 @@ static bool prop_item_replace(dhKey key, void *old_value, void *new_value, void
 }
 
 
-static dhIKey prop_gen_hash(dhKey key) {
-  dhIKey ikey = (uintptr_t)key.data; // Data pointer is a prop ID
-
-  // This will be hashed by dh__hash_int()
-  return ikey;
-}
-
-
-static bool prop_equal_hash_keys(dhKey key1, dhKey key2, void *ctx) {
-  return (uint32_t)(uintptr_t)key1.data == (uint32_t)(uintptr_t)key2.data;
-}
-
-
-
 bool prop_db_init(PropDB *db, size_t init_capacity, size_t max_storage, mpPoolSet *pool_set) {
   memset(db, 0, sizeof(*db));
 
@@ -107,8 +270,13 @@ bool prop_db_init(PropDB *db, size_t init_capacity, size_t max_storage, mpPoolSe
   db->lock = xSemaphoreCreateBinary();
   xSemaphoreGive(db->lock);
 
+  db->watch_lock = xSemaphoreCreateBinary();
+  xSemaphoreGive(db->watch_lock);
+
   atomic_init((atomic_uint *)&db->transactions, 0);
+  atomic_init(BATCH_OWNER(db), 0);
   db->persist_updated = false;
+  db->checkpoint_needed = true; // Start each session with a full save
 
   // Setup hash table for prop:PropDBEntry pairs
   dhConfig hash_cfg = {
@@ -117,40 +285,458 @@ bool prop_db_init(PropDB *db, size_t init_capacity, size_t max_storage, mpPoolSe
     .max_storage  = max_storage,
     .destroy_item = prop_item_destroy,
     .replace_item = prop_item_replace,
-    .gen_hash     = prop_gen_hash,
-    .is_equal     = prop_equal_hash_keys
+    .int_keys     = true,   // Data pointer is a prop ID
+    .migrate_step = PROP_DB_MIGRATE_STEP,
+#ifdef USE_PROP_DB_LOCK_FREE_READS
+    .concurrent   = true
+#endif
   };
 
   return dh_init(&db->hash, &hash_cfg, db);
 }
 
 void prop_db_free(PropDB *db) {
+  if(db->batch)
+    mp_free(mp_sys_pools(), db->batch);
   vSemaphoreDelete(db->lock);
   db->lock = 0;
+  vSemaphoreDelete(db->watch_lock);
+  db->watch_lock = 0;
+  if(db->watch_hash_ready)
+    dh_free(&db->watch_hash);
   dh_free(&db->hash);
+  cs_free(db->index);
+  db->index = NULL;
+}
+
+
+static inline void prop__default_entry(const PropDefaultDef *def, PropDBEntry *value) {
+  *value = (PropDBEntry){
+    .value = def->value,
+    .kind = def->kind,
+    .readonly = (bool)(def->attributes & P_READONLY),
+    .persist  = (bool)(def->attributes & P_PERSIST),
+    .protect  = (bool)(def->attributes & P_PROTECT)
+  };
+
+  if(def->kind == P_KIND_STRING) {
+    value->size = strlen((char *)def->value);
+    prop__inline_value(value);  // Defaults are static so there is nothing to free
+  }
+}
+
+
+// Populate an empty DB with all defaults in one pass
+static bool prop__build_defaults(PropDB *db, const PropDefaultDef *defaults, size_t num_defaults) {
+  dhKey *keys = cs_malloc(num_defaults * (sizeof(dhKey) + sizeof(PropDBEntry) + sizeof(void *)));
+  if(!keys)
+    return false;
+
+  PropDBEntry *entries = (PropDBEntry *)&keys[num_defaults];
+  void **values = (void **)&entries[num_defaults];
+
+  size_t num_valid = 0;
+  for(size_t i = 0; i < num_defaults; i++) {
+    if(!prop_is_valid(defaults[i].prop, /*allow_mask*/ false))
+      continue;
+
+    keys[num_valid].data   = (void *)(uintptr_t)defaults[i].prop;
+    keys[num_valid].length = sizeof(uint32_t);
+
+    prop__default_entry(&defaults[i], &entries[num_valid]);
+    entries[num_valid].dirty = true;
+    if(entries[num_valid].persist)
+      db->persist_updated = true;
+
+    values[num_valid] = &entries[num_valid];
+    num_valid++;
+  }
+
+  LOCK();
+    bool status = dh_num_items(&db->hash) == 0 &&
+                  dh_build(&db->hash, keys, values, num_valid);
+    if(status) {
+      db->version++;
+      if(!prop__index_rebuild(db))
+        db->index_stale = true;
+    }
+  UNLOCK();
+
+  cs_free(keys);
+  return status;
+}
+
+
+// ******************** Watchers ********************
+
+static void prop__watch_item_destroy(dhKey key, void *value, void *ctx) {
+  // Watchers are owned by the caller
+}
+
+
+static bool prop__watch_hash_init(PropDB *db) {
+  dhConfig hash_cfg = {
+    .init_buckets = 8,
+    .value_size   = sizeof(PropWatcher *),
+    .destroy_item = prop__watch_item_destroy,
+    .int_keys     = true
+  };
+
+  db->watch_hash_ready = dh_init(&db->watch_hash, &hash_cfg, db);
+  return db->watch_hash_ready;
+}
+
+
+/*
+Register a callback for changes to a prop
+
+Watchers on exact prop IDs are found with a hash lookup. Masked props
+match any prop in their group and are scanned on every update.
+Callbacks run in the task calling prop_set() after the DB lock is
+released and are called without holding the watch lock. They can read and
+set props and add or remove watchers. A watcher removed while a change is
+being delivered may still receive that change.
+
+Args:
+  db:       Database to watch
+  watcher:  Watcher object owned by the caller
+  prop:     Prop ID or masked prop to watch
+  watch_cb: Callback invoked on changes
+  ctx:      User context passed to watch_cb
+
+Returns:
+  true on success
+*/
+bool prop_db_watch(PropDB *db, PropWatcher *watcher, uint32_t prop, PropWatchCallback watch_cb,
+                   void *ctx) {
+  if(!watch_cb || !prop_is_valid(prop, /*allow_mask*/ true))
+    return false;
+
+  *watcher = (PropWatcher){
+    .prop     = prop,
+    .watch_cb = watch_cb,
+    .ctx      = ctx
+  };
+
+  bool status = true;
+
+  WATCH_LOCK();
+    if(prop_has_mask(prop)) {
+      ll_slist_push(&db->watch_masked, watcher);
+
+    } else {
+      if(!db->watch_hash_ready)
+        status = prop__watch_hash_init(db);
+
+      if(status) { // Add to list for this prop
+        dhKey key = {
+          .data = (void *)(uintptr_t)prop,
+          .length = sizeof(uint32_t)
+        };
+
+        PropWatcher *head = NULL;
+        dh_lookup(&db->watch_hash, key, &head);
+        watcher->next = head;
+        status = dh_insert(&db->watch_hash, key, &watcher);
+      }
+    }
+
+    if(status)
+      db->num_watchers++;
+  WATCH_UNLOCK();
+
+  return status;
+}
+
+
+/*
+Remove a watcher
+
+Args:
+  db:       Database with watcher
+  watcher:  Watcher to remove
+
+Returns:
+  true on success
+*/
+bool prop_db_unwatch(PropDB *db, PropWatcher *watcher) {
+  bool status = false;
+
+  WATCH_LOCK();
+    if(prop_has_mask(watcher->prop)) {
+      status = ll_slist_remove(&db->watch_masked, watcher);
+
+    } else if(db->watch_hash_ready) {
+      dhKey key = {
+        .data = (void *)(uintptr_t)watcher->prop,
+        .length = sizeof(uint32_t)
+      };
+
+      PropWatcher *head = NULL;
+      if(dh_lookup(&db->watch_hash, key, &head)) {
+        status = ll_slist_remove(&head, watcher);
+
+        if(status) {
+          if(head)
+            dh_insert(&db->watch_hash, key, &head);
+          else
+            dh_delete(&db->watch_hash, key);
+        }
+      }
+    }
+
+    if(status)
+      db->num_watchers--;
+  WATCH_UNLOCK();
+
+  return status;
+}
+
+
+typedef struct {
+  PropWatchCallback watch_cb;
+  void             *ctx;
+} PropNotify;
+
+// Copy up to PROP_DB_NOTIFY_BATCH callbacks for prop after skipping the first skip matches
+static size_t prop__collect_watchers(PropDB *db, uint32_t prop, size_t skip, PropNotify *notify) {
+  PropWatcher *cur = NULL;
+  size_t count = 0;
+
+  WATCH_LOCK();
+    if(db->watch_hash_ready) {
+      dhKey key = {
+        .data = (void *)(uintptr_t)prop,
+        .length = sizeof(uint32_t)
+      };
+
+      dh_lookup(&db->watch_hash, key, &cur);
+    }
+
+    // Exact watchers followed by masked watchers
+    PropWatcher *masked = db->watch_masked;
+    while(count < PROP_DB_NOTIFY_BATCH) {
+      if(!cur) {
+        if(!masked)
+          break;
+        cur = masked;
+        masked = NULL;
+      }
+
+      // Exact watchers always match
+      if(cur->prop == prop || prop_match(prop, cur->prop)) {
+        if(skip > 0)
+          skip--;
+        else
+          notify[count++] = (PropNotify){.watch_cb = cur->watch_cb, .ctx = cur->ctx};
+      }
+
+      cur = cur->next;
+    }
+  WATCH_UNLOCK();
+
+  return count;
+}
+
+
+// Invoke callbacks for a changed prop
+static void prop__notify_watchers(PropDB *db, uint32_t prop, PropDBEntry *value) {
+  if(db->num_watchers == 0)
+    return;
+
+  // Callbacks run without the watch lock so they can set props and change watchers
+  PropNotify notify[PROP_DB_NOTIFY_BATCH];
+  size_t delivered = 0;
+  size_t count;
+
+  do {
+    count = prop__collect_watchers(db, prop, delivered, notify);
+    for(size_t i = 0; i < count; i++) {
+      notify[i].watch_cb(prop, value, notify[i].ctx);
+    }
+    delivered += count;
+  } while(count == PROP_DB_NOTIFY_BATCH);
+}
+
+
+// ******************** Change notification ********************
+
+// Send a batch of changed props to the message hub
+static void prop__batch_send(PropDB *db, uint32_t *batch, uint16_t batch_len) {
+  UMsg msg = {
+    .id           = P_EVENT_STORAGE_PROP_BATCH,
+    .source       = 0,
+    .payload      = (uintptr_t)batch,
+    .payload_size = batch_len * sizeof(uint32_t)
+  };
+
+  if(!umsg_hub_send(db->msg_hub, &msg, NO_TIMEOUT))
+    mp_free(mp_sys_pools(), batch); // Release our reference
+}
+
+
+/*
+Add a changed prop to the batch for the current transaction
+
+Repeated changes to a prop are only reported once. A full batch is sent
+immediately and a new one started.
+
+Args:
+  db:   Database with changed prop
+  prop: Prop that was changed
+
+Returns:
+  true if the prop will be reported in a batch. false if a batch couldn't be allocated
+*/
+static bool prop__batch_add(PropDB *db, uint32_t prop) {
+  uint32_t *full_batch = NULL;
+  uint16_t full_len = 0;
+
+  LOCK();
+    if(!db->batch) {
+      size_t alloc_size;
+      db->batch = mp_alloc_with_ref(mp_sys_pools(), PROP_DB_BATCH_SIZE * sizeof(uint32_t), &alloc_size);
+      if(!db->batch) {
+        UNLOCK();
+        return false;
+      }
+
+      size_t batch_max = alloc_size / sizeof(uint32_t);
+      db->batch_max = batch_max > UINT16_MAX ? UINT16_MAX : batch_max;
+      db->batch_len = 0;
+    }
+
+    bool found = false;
+    for(uint16_t i = 0; i < db->batch_len; i++) {
+      if(db->batch[i] == prop) {
+        found = true;
+        break;
+      }
+    }
+
+    if(!found) {
+      db->batch[db->batch_len++] = prop;
+
+      if(db->batch_len == db->batch_max) { // Send when full
+        full_batch = db->batch;
+        full_len = db->batch_len;
+        db->batch = NULL;
+      }
+    }
+  UNLOCK();
+
+  if(full_batch)
+    prop__batch_send(db, full_batch, full_len);
+
+  return true;
+}
+
+
+// Send any changes collected during a transaction
+static void prop__batch_flush(PropDB *db) {
+  if(!db->msg_hub)
+    return;
+
+  LOCK();
+    uint32_t *batch = db->batch;
+    uint16_t batch_len = db->batch_len;
+    db->batch = NULL;
+    db->batch_len = 0;
+  UNLOCK();
+
+  if(batch)
+    prop__batch_send(db, batch, batch_len);
+}
+
+
+/*
+Changes are only batched for the task that opened the outermost transaction.
+Other tasks updating props at the same time report their changes immediately
+so they aren't delayed until an unrelated transaction ends.
+*/
+
+// Check if the current task is collecting a batch
+static inline bool prop__batch_owned(PropDB *db) {
+  return atomic_load(BATCH_OWNER(db)) == (uintptr_t)xTaskGetCurrentTaskHandle();
+}
+
+
+// Take ownership of the batch if no other task has it
+static void prop__batch_begin(PropDB *db) {
+  uintptr_t self = (uintptr_t)xTaskGetCurrentTaskHandle();
+  uintptr_t owner = 0;
+
+  if(atomic_compare_exchange_strong(BATCH_OWNER(db), &owner, self) || owner == self)
+    db->batch_depth++; // Only modified by the owner
+}
+
+
+// Send the batch when the owner's outermost transaction ends
+static void prop__batch_end(PropDB *db) {
+  if(!prop__batch_owned(db))
+    return;
+
+  if(--db->batch_depth == 0) {
+    prop__batch_flush(db);
+    atomic_store(BATCH_OWNER(db), 0);
+  }
 }
 
 
 void prop_db_set_defaults(PropDB *db, const PropDefaultDef *defaults) {
   const PropDefaultDef *cur = defaults;
 
-  while(cur->prop != 0) {
-    PropDBEntry value = {
-      .value = cur->value,
-      .kind = cur->kind,
-      .readonly = (bool)(cur->attributes & P_READONLY),
-      .persist  = (bool)(cur->attributes & P_PERSIST),
-      .protect  = (bool)(cur->attributes & P_PROTECT)
-    };
+  size_t num_defaults = 0;
+  while(defaults[num_defaults].prop != 0) {
+    num_defaults++;
+  }
+
+  prop_db_transact_begin(db);
+
+  if(prop_db_count(db) == 0 && prop__build_defaults(db, defaults, num_defaults)) {
+    if(db->num_watchers > 0) {
+      for(cur = defaults; cur->prop != 0; cur++) {
+        if(!prop_is_valid(cur->prop, /*allow_mask*/ false))
+          continue;
 
-    if(cur->kind == P_KIND_STRING) {
-      value.size = strlen((char *)cur->value);
+        PropDBEntry value;
+        prop__default_entry(cur, &value);
+        prop__notify_watchers(db, cur->prop, &value);
+      }
     }
 
-    prop_set(db, cur->prop, &value, 0);
+    if(db->msg_hub) { // Report the new props
+      for(cur = defaults; cur->prop != 0; cur++) {
+        if(!prop_is_valid(cur->prop, /*allow_mask*/ false))
+          continue;
 
-    cur++;
+        if(prop__batch_owned(db) && prop__batch_add(db, cur->prop))
+          continue;
+
+        UMsg msg = {
+          .id     = cur->prop,
+          .source = 0
+        };
+
+        if(cur->kind == P_KIND_UINT || cur->kind == P_KIND_INT)
+          msg.payload = cur->value;
+
+        umsg_hub_send(db->msg_hub, &msg, NO_TIMEOUT);
+      }
+    }
+
+  } else { // Merge into existing props
+    while(cur->prop != 0) {
+      PropDBEntry value;
+      prop__default_entry(cur, &value);
+
+      prop_set(db, cur->prop, &value, 0);
+
+      cur++;
+    }
   }
+
+  prop_db_transact_end(db);
 }
 
 
@@ -161,10 +747,12 @@ void prop_db_set_msg_hub(PropDB *db, UMsgTarget *msg_hub) {
 
 void prop_db_transact_begin(PropDB *db) {
   atomic_fetch_add((atomic_uint *)&db->transactions, 1);
+  prop__batch_begin(db);
 }
 
 
 void prop_db_transact_end(PropDB *db) {
+  prop__batch_end(db);
   atomic_fetch_sub((atomic_uint *)&db->transactions, 1);
 
   if(atomic_load((atomic_uint *)&db->transactions) == 0 && db->persist_updated) {
@@ -182,6 +770,7 @@ void prop_db_transact_end(PropDB *db) {
 
 
 void prop_db_transact_end_no_update(PropDB *db) {
+  prop__batch_end(db);
   atomic_fetch_sub((atomic_uint *)&db->transactions, 1);
 
   if(atomic_load((atomic_uint *)&db->transactions) == 0)
@@ -203,45 +792,74 @@ bool prop_set(PropDB *db, uint32_t prop, PropDBEntry *value, uint32_t source) {
     .length = sizeof(uint32_t)
   };
 
-  if(value && value->kind == P_KIND_STRING && value->size == 0) { // Missing string length
-    value->size = strlen((char *)value->value);
+  // Work on a copy so the caller's entry is left intact if the set fails.
+  // dh_insert() may also swap a displaced entry into the value it is passed.
+  PropDBEntry entry;
+  if(value) {
+    entry = *value;
+    if(entry.kind == P_KIND_STRING && entry.size == 0 && !entry.is_inline) { // Missing string length
+      entry.size = strlen((char *)entry.value);
+    }
   }
 
+  // Small values are copied into the entry. The DB owns the original so we
+  // release it once the new value is stored.
+  void *inlined_data = value ? prop__inline_value(&entry) : NULL;
+
   LOCK();
     if(value) {
-//      printf("PSET: %08lX = %" PRIu32 "\tprot: %d\n", prop, (uint32_t)value->value, value->protect);
-      value->dirty = true;
-      status = dh_insert(&db->hash, key, value);
-      // replace_item callback ensures that persist and protect attributes remain unchanged
-      // from original call to prop_set(). It changes the value struct to reflect
-      // the current attributes.
-      if(value->persist) {
-//        printf(">> PERSIST P%08lX  %c\n", prop,  old_persist ? 'P' : 'e');
-        db->persist_updated = true;
-      } else {
-//        printf(">> EPHEMERAL P%08lX\n", prop);
+//      printf("PSET: %08lX = %" PRIu32 "\tprot: %d\n", prop, (uint32_t)entry.value, entry.protect);
+      entry.dirty = true;
+      PropDBEntry stored = entry;
+      status = dh_insert(&db->hash, key, &stored);
+      if(status) {
+        prop__index_insert(db, prop);
+        if(inlined_data)
+          mp_free(db->pool_set, inlined_data);
+
+        // replace_item callback ensures that persist and protect attributes remain unchanged
+        // from original call to prop_set(). Fetch the stored entry to get the current attributes.
+        dh_lookup(&db->hash, key, &entry);
+        if(entry.persist) {
+//          printf(">> PERSIST P%08lX\n", prop);
+          db->persist_updated = true;
+        }
       }
 
     } else {  // No value: Remove prop from hash
       PropDBEntry removed;
       status = dh_remove(&db->hash, key, &removed);
       if(status) {
-        if(removed.persist) // Log needs to be updated
+        prop__index_remove(db, prop);
+        if(removed.persist) { // Log needs to be updated
           db->persist_updated = true;
+          db->checkpoint_needed = true; // Deltas can't record removal
+        }
         prop_item_destroy(key, &removed, db);
       }
     }
+
+    if(status)
+      db->version++;
   UNLOCK();
 
-  if(db->msg_hub) { // Report change to this prop
+  if(status)
+    prop__notify_watchers(db, prop, value ? &entry : NULL);
+
+  // prop_set() holds its own transaction. Changes inside an outer transaction
+  // of the same task are coalesced into a batch message sent when it ends.
+  bool batched = db->msg_hub && prop__batch_owned(db) && db->batch_depth > 1 &&
+                 prop__batch_add(db, prop);
+
+  if(db->msg_hub && !batched) { // Report change to this prop
     // Send message
     UMsg msg = {
       .id     = prop,
       .source = source
     };
 
-    if(value && (value->kind == P_KIND_UINT || value->kind == P_KIND_INT)) {
-      msg.payload = value->value;
+    if(value && (entry.kind == P_KIND_UINT || entry.kind == P_KIND_INT)) {
+      msg.payload = entry.value;
     }
 
     umsg_hub_send(db->msg_hub, &msg, NO_TIMEOUT);
@@ -287,6 +905,14 @@ bool prop_get(PropDB *db, uint32_t prop, PropDBEntry *value) {
     .length = sizeof(uint32_t)
   };
 
+#ifdef USE_PROP_DB_LOCK_FREE_READS
+  bool found;
+  if(dh_try_lookup(&db->hash, key, value, &found)) // No interference from a writer
+    return found;
+
+  // Fall back to the lock when a writer is active so we don't spin against it
+#endif
+
   LOCK();
     bool status = dh_lookup(&db->hash, key, value);
   UNLOCK();
@@ -295,6 +921,49 @@ bool prop_get(PropDB *db, uint32_t prop, PropDBEntry *value) {
 }
 
 
+/*
+Retrieve multiple props in one pass
+
+Lookups are batched through :c:func:`dh_lookup_batch_locked` with the DB lock held
+once for all props. Missing props are returned with kind set to P_KIND_NONE.
+
+Args:
+  db:         Prop DB to search
+  props:      Props to retrieve
+  values:     Array of retrieved prop values. Must have num_props entries
+  num_props:  Number of props
+
+Returns:
+  Number of props found
+*/
+size_t prop_get_batch(PropDB *db, const uint32_t *props, PropDBEntry *values, size_t num_props) {
+#define PROP_BATCH_LEN  16
+  dhKey keys[PROP_BATCH_LEN];
+  void *dest[PROP_BATCH_LEN];
+  size_t found = 0;
+
+  memset(values, 0, num_props * sizeof(*values));
+
+  LOCK();
+    for(size_t base = 0; base < num_props; base += PROP_BATCH_LEN) {
+      size_t batch_len = num_props - base;
+      if(batch_len > PROP_BATCH_LEN)
+        batch_len = PROP_BATCH_LEN;
+
+      for(size_t i = 0; i < batch_len; i++) {
+        keys[i].data   = (void *)(uintptr_t)props[base+i];
+        keys[i].length = sizeof(uint32_t);
+        dest[i] = &values[base+i];
+      }
+
+      found += dh_lookup_batch_locked(&db->hash, keys, dest, NULL, batch_len);
+    }
+  UNLOCK();
+
+  return found;
+}
+
+
 bool prop_set_attributes(PropDB *db, uint32_t prop, uint8_t attributes) {
   dhKey key = {
     .data = (void *)(uintptr_t)prop,
@@ -310,9 +979,15 @@ bool prop_set_attributes(PropDB *db, uint32_t prop, uint8_t attributes) {
       if(!entry->persist && (attributes & P_PERSIST))
         db->persist_updated = true;
 
-      entry->persist  = (bool)(attributes & P_PERSIST);
-      entry->readonly = (bool)(attributes & P_READONLY);
-      entry->protect  = (bool)(attributes & P_PROTECT);
+      if(entry->persist != (bool)(attributes & P_PERSIST))
+        db->checkpoint_needed = true;
+
+      dh_modify_begin(&db->hash); // Hide partial update from lock-free readers
+        entry->persist  = (bool)(attributes & P_PERSIST);
+        entry->readonly = (bool)(attributes & P_READONLY);
+        entry->protect  = (bool)(attributes & P_PROTECT);
+      dh_modify_end(&db->hash);
+      db->version++;
     }
   UNLOCK();
 
@@ -338,6 +1013,122 @@ bool prop_get_attributes(PropDB *db, uint32_t prop, uint8_t *attributes) {
 }
 
 
+// ******************** Snapshots ********************
+
+/*
+Capture a consistent view of the DB. The lock is only held while
+copying entries so the snapshot can be read without blocking updates.
+String and blob values are shared with the DB. Any that are removed while
+the snapshot is active stay valid until prop_db_snapshot_release().
+
+Args:
+  db:     Database to capture
+  snap:   Snapshot to initialize
+  flags:  Capture flags P_SNAP_PERSIST, P_SNAP_DIRTY, and P_SNAP_CHECKPOINT.
+          A checkpoint without P_SNAP_DIRTY satisfies any pending checkpoint request.
+  arena:  Arena to allocate from. Use NULL for the heap
+
+Returns:
+  true on success. false if the snapshot couldn't be allocated
+*/
+bool prop_db_snapshot(PropDB *db, PropDBSnapshot *snap, unsigned flags, mpArena *arena) {
+  memset(snap, 0, sizeof(*snap));
+  snap->db = db;
+  snap->heap_alloc = !arena;
+
+  LOCK();
+    size_t max_items = dh_num_items(&db->hash);
+
+    if(max_items > 0) {
+      size_t snap_size = max_items * (sizeof(PropDBSnapItem) + sizeof(PropDBSnapValue));
+      snap->items = arena ? mp_arena_alloc(arena, snap_size) : cs_malloc(snap_size);
+      if(!snap->items) {
+        UNLOCK();
+        return false;
+      }
+      snap->values = (PropDBSnapValue *)&snap->items[max_items];
+    }
+
+    dhIter it;
+    dhKey key;
+    PropDBEntry *entry;
+
+    // Clearing dirty flags changes entries in place
+    if(flags & P_SNAP_CHECKPOINT)
+      dh_modify_begin(&db->hash);
+
+    dh_iter_init(&db->hash, &it);
+    while(dh_iter_next(&it, &key, (void **)&entry)) {
+      if((flags & P_SNAP_PERSIST) && (!entry->persist || entry->readonly))
+        continue;
+
+      if((flags & P_SNAP_DIRTY) && !entry->dirty)
+        continue;
+
+      snap->items[snap->num_items++] = (PropDBSnapItem){
+        .prop  = (uintptr_t)key.data,
+        .entry = *entry
+      };
+
+      if((entry->kind == P_KIND_STRING || entry->kind == P_KIND_BLOB) && !entry->is_inline)
+        snap->values[snap->num_values++] = (PropDBSnapValue){.value = (void *)entry->value};
+
+      if(flags & P_SNAP_CHECKPOINT)
+        entry->dirty = false;
+    }
+
+    if(flags & P_SNAP_CHECKPOINT)
+      dh_modify_end(&db->hash);
+
+    if((flags & P_SNAP_CHECKPOINT) && !(flags & P_SNAP_DIRTY))
+      db->checkpoint_needed = false;
+
+    snap->version = db->version;
+
+    // Register so that shared values aren't freed while we use them
+    snap->next = db->snapshots;
+    db->snapshots = snap;
+  UNLOCK();
+
+  return true;
+}
+
+
+/*
+Release a snapshot and free any values retired while it was active
+
+Args:
+  snap:   Snapshot to release
+*/
+void prop_db_snapshot_release(PropDBSnapshot *snap) {
+  PropDB *db = snap->db;
+
+  LOCK();
+    // Unlink from active snapshots
+    PropDBSnapshot **link = &db->snapshots;
+    while(*link && *link != snap) {
+      link = &(*link)->next;
+    }
+    if(*link)
+      *link = snap->next;
+
+    // Retired values may still be shared with an older snapshot
+    for(size_t i = 0; i < snap->num_values; i++) {
+      if(snap->values[i].retired)
+        prop__release_value(db, snap->values[i].value);
+    }
+  UNLOCK();
+
+  if(snap->heap_alloc)
+    cs_free(snap->items);
+
+  snap->items = NULL;
+  snap->values = NULL;
+  snap->num_items = 0;
+  snap->num_values = 0;
+}
+
+
 // ******************** Utility ********************
 
 
@@ -371,8 +1162,8 @@ static void prop__print_entry(uint32_t prop, PropDBEntry *entry) {
   switch(entry->kind) {
   case P_KIND_UINT:   printf("%" PRIu32 " (%08" PRIX32 ")", (uint32_t)entry->value, (uint32_t)entry->value); break;
   case P_KIND_INT:    printf("%" PRId32, (int32_t)entry->value); break;
-  case P_KIND_STRING: printf("'%s'", (char *)entry->value); break;
-  case P_KIND_BLOB:   printf("Blob %"PRIuz, entry->size); break;
+  case P_KIND_STRING: printf("'%s'", (char *)prop_entry_data(entry)); break;
+  case P_KIND_BLOB:   printf("Blob %"PRIuz, prop_entry_size(entry)); break;
   default:            fputs("?", stdout); break;
   }
 
@@ -392,7 +1183,7 @@ bool prop_print(PropDB *db, uint32_t prop, bool dump_blob) {
     prop__print_entry(prop, &entry);
 
     if(dump_blob && entry.kind == P_KIND_BLOB)
-      dump_array((uint8_t *)entry.value, entry.size);
+      dump_array((uint8_t *)prop_entry_data(&entry), prop_entry_size(&entry));
   }
 
   return exists;
@@ -400,68 +1191,111 @@ bool prop_print(PropDB *db, uint32_t prop, bool dump_blob) {
 
 
 void prop_db_dump(PropDB *db) {
-  printf("Prop DB (%" PRIuz " items):\n", dh_num_items(&db->hash));
-
-  // NOTE: We do not lock the DB to prevent long lockouts while printing.
-  // The iterator may end up invalid if the DB is modified.
-  dhKey key;
-  PropDBEntry *entry;
+  // Print from a snapshot to avoid long lockouts while printing
+  PropDBSnapshot snap;
+  if(!prop_db_snapshot(db, &snap, 0, NULL)) {
+    puts("Prop DB snapshot failed");
+    return;
+  }
 
-  dhIter it;
-  dh_iter_init(&db->hash, &it);
+  printf("Prop DB (%" PRIuz " items):\n", snap.num_items);
 
-  while(dh_iter_next(&it, &key, (void **)&entry)) {
-    uint32_t prop = (uintptr_t)key.data;
-    prop__print_entry(prop, entry);
+  for(size_t i = 0; i < snap.num_items; i++) {
+    prop__print_entry(snap.items[i].prop, &snap.items[i].entry);
   }
 
+  prop_db_snapshot_release(&snap);
 }
 
 
+/*
+Serialize persistent props into a LogDB block
+
+Args:
+  db:     Database to serialize
+  block:  New block allocated from the heap. Free with cs_free()
+
+Returns:
+  true on success
+*/
 bool prop_db_serialize(PropDB *db, LogDBBlock **block) {
-  dhIter it;
-  dhKey key;
-  PropDBEntry *entry;
+  return prop_db_serialize_arena(db, block, NULL);
+}
+
 
+// Serialize props captured with snap_flags into a new block
+static bool prop__serialize(PropDB *db, LogDBBlock **block, mpArena *arena, unsigned snap_flags,
+                            uint8_t kind) {
   /*  Block:
       [header] [data]
   */
 
-  LOCK();
-    // Get size of block
-    dh_iter_init(&db->hash, &it);
-    size_t data_len = 0;
-    while(dh_iter_next(&it, &key, (void **)&entry)) {
-      if(!entry->persist || entry->readonly)
-        continue;
+  // Encode from a snapshot so the DB isn't locked while serializing
+  mpArenaMark mark = arena ? mp_arena_mark(arena) : 0;
+  PropDBSnapshot snap;
+  if(!prop_db_snapshot(db, &snap, snap_flags, arena)) {
+    *block = NULL;
+    return false;
+  }
 
-      data_len += prop_encoded_bytes((uintptr_t)key.data, entry);
-    }
+  // Get size of block
+  size_t data_len = 0;
+  for(size_t i = 0; i < snap.num_items; i++) {
+    data_len += prop_encoded_bytes(snap.items[i].prop, &snap.items[i].entry);
+  }
 
-    LogDBBlock *new_block = cs_malloc(sizeof(LogDBBlock) + data_len);
-    if(!new_block) {
-      *block = NULL;
-      UNLOCK();
-      return false;
-    }
+  // The snapshot has cleared dirty flags so a block that doesn't fit in the arena
+  // next to it is built on the heap and moved into the space the snapshot frees.
+  size_t block_size = sizeof(LogDBBlock) + data_len;
+  LogDBBlock *new_block = arena ? mp_arena_alloc(arena, block_size) : NULL;
+  bool heap_block = !new_block;
+  if(heap_block)
+    new_block = cs_malloc(block_size);
+
+  if(!new_block) {
+    prop_db_snapshot_release(&snap);
+    if(arena)
+      mp_arena_reset(arena, mark);
+    prop_db_request_checkpoint(db); // Captured props were marked as saved
+    *block = NULL;
+    return false;
+  }
 
-    new_block->kind       = BLOCK_KIND_PROP_DB;
-    new_block->compressed = 0;
-    new_block->data_len   = data_len;
+  new_block->kind       = kind;
+  new_block->compressed = 0;
+  new_block->data_len   = data_len;
 
-    // Serialize props
-    uint8_t *pos = new_block->data;
-    uint8_t *end = pos + data_len;
+  // Serialize props
+  uint8_t *pos = new_block->data;
+  uint8_t *end = pos + data_len;
 
-    dh_iter_init(&db->hash, &it);
-    while(dh_iter_next(&it, &key, (void **)&entry)) {
-      if(!entry->persist || entry->readonly)
-        continue;
+  for(size_t i = 0; i < snap.num_items; i++) {
+//    printf("## ENCODE: P%04lX\n", snap.items[i].prop);
+    pos += prop_encode(snap.items[i].prop, &snap.items[i].entry, pos, end - pos);
+  }
+
+  prop_db_snapshot_release(&snap);
+
+  if(arena) { // Reclaim the snapshot by moving the block down over it
+    mp_arena_reset(arena, mark);
+    LogDBBlock *packed_block = mp_arena_alloc(arena, block_size);
+
+    if(heap_block) {
+      if(packed_block)
+        memcpy(packed_block, new_block, block_size);
+      cs_free(new_block);
+
+      if(!packed_block) {
+        prop_db_request_checkpoint(db); // Captured props were marked as saved
+        *block = NULL;
+        return false;
+      }
 
-  //    printf("## ENCODE: P%04lX\n", (uint32_t)key.data);
-      pos += prop_encode((uintptr_t)key.data, entry, pos, end - pos);
+    } else {
+      memmove(packed_block, new_block, block_size);
     }
-  UNLOCK();
+    new_block = packed_block;
+  }
 //  puts("BLOCK W:");
 //  dump_array((uint8_t *)new_block, sizeof(*new_block) + data_len);
 
@@ -470,6 +1304,76 @@ bool prop_db_serialize(PropDB *db, LogDBBlock **block) {
 }
 
 
+/*
+Serialize persistent props into a LogDB block allocated from an arena
+
+This is a checkpoint of all persistent props. Any later delta blocks
+are relative to it.
+
+Args:
+  db:     Database to serialize
+  block:  New block allocated from arena
+  arena:  Arena to allocate from. Use NULL for the heap
+
+Returns:
+  true on success. false if the block couldn't be allocated
+*/
+bool prop_db_serialize_arena(PropDB *db, LogDBBlock **block, mpArena *arena) {
+  return prop__serialize(db, block, arena, P_SNAP_PERSIST | P_SNAP_CHECKPOINT, BLOCK_KIND_PROP_DB);
+}
+
+
+/*
+Serialize persistent props changed since the last save into a LogDB block
+
+Args:
+  db:     Database to serialize
+  block:  New block allocated from the heap. Free with cs_free()
+
+Returns:
+  true on success
+*/
+bool prop_db_serialize_delta(PropDB *db, LogDBBlock **block) {
+  return prop_db_serialize_delta_arena(db, block, NULL);
+}
+
+
+/*
+Serialize persistent props changed since the last save into a LogDB block
+allocated from an arena
+
+The block has an empty data section when nothing has changed.
+
+Args:
+  db:     Database to serialize
+  block:  New block allocated from arena
+  arena:  Arena to allocate from. Use NULL for the heap
+
+Returns:
+  true on success. false if the block couldn't be allocated
+*/
+bool prop_db_serialize_delta_arena(PropDB *db, LogDBBlock **block, mpArena *arena) {
+  return prop__serialize(db, block, arena, P_SNAP_PERSIST | P_SNAP_DIRTY | P_SNAP_CHECKPOINT,
+                         BLOCK_KIND_PROP_DELTA);
+}
+
+
+/*
+Force the next save to be a full checkpoint
+
+Use this when a serialized block couldn't be stored or the log
+holding the last checkpoint was erased.
+
+Args:
+  db:     Database to checkpoint
+*/
+void prop_db_request_checkpoint(PropDB *db) {
+  LOCK();
+    db->checkpoint_needed = true;
+  UNLOCK();
+}
+
+
 unsigned prop_db_deserialize(PropDB *db, uint8_t *data, size_t data_len) {
   unsigned count = 0;
   uint8_t *pos = data;
@@ -492,14 +1396,42 @@ unsigned prop_db_deserialize(PropDB *db, uint8_t *data, size_t data_len) {
 }
 
 
+/*
+Get all prop IDs in a database
+
+Args:
+  db:     Database to get keys from
+  keys:   New array of keys allocated from the heap. Free with cs_free()
+
+Returns:
+  Number of keys in the array
+*/
 size_t prop_db_all_keys(PropDB *db, uint32_t **keys) {
+  return prop_db_all_keys_arena(db, keys, NULL);
+}
+
+
+/*
+Get all prop IDs in a database using an arena
+
+Args:
+  db:     Database to get keys from
+  keys:   New array of keys allocated from arena
+  arena:  Arena to allocate from. Use NULL for the heap
+
+Returns:
+  Number of keys in the array
+*/
+size_t prop_db_all_keys_arena(PropDB *db, uint32_t **keys, mpArena *arena) {
   uint32_t *key_vec = NULL;
 
   LOCK();
     size_t num_keys = dh_num_items(&db->hash);
 
-    if(num_keys > 0)
-      key_vec = cs_malloc(num_keys * sizeof(uint32_t));
+    if(num_keys > 0) {
+      size_t vec_size = num_keys * sizeof(uint32_t);
+      key_vec = arena ? mp_arena_alloc(arena, vec_size) : cs_malloc(vec_size);
+    }
 
     if(!key_vec) {
       *keys = NULL;
@@ -543,6 +1475,59 @@ void prop_db_sort_keys(PropDB *db, uint32_t *keys, size_t keys_len) {
 }
 
 
+/*
+Get props matching a masked prop in ID order
+
+Fields set to all 1's in masked_prop match any value. Leading fields that
+aren't masked select a contiguous range of the ordered index so only that
+subtree is scanned. Large results can be retrieved in chunks by passing the
+last prop returned as after.
+
+Args:
+  db:           Database to search
+  masked_prop:  Prop with mask fields to match against
+  after:        Only return props greater than this. Use 0 to start from the beginning
+  props:        Array for matching props
+  max_props:    Size of props array
+
+Returns:
+  Number of props copied into props
+*/
+size_t prop_db_query(PropDB *db, uint32_t masked_prop, uint32_t after, uint32_t *props, size_t max_props) {
+  uint32_t mask = PROP_GET_MASK(masked_prop);
+
+  // Fixed fields before the first mask determine the range to scan
+  uint32_t prefix_mask = 0;
+  for(int level = 1; level <= 4; level++) {
+    if((masked_prop & PROP_MASK(level)) == PROP_MASK(level))
+      break;
+    prefix_mask |= PROP_MASK(level);
+  }
+
+  uint32_t range_lo = masked_prop & prefix_mask;
+  uint32_t range_hi = range_lo | ~prefix_mask;
+
+  if(after >= range_hi)
+    return 0;
+  if(after >= range_lo)
+    range_lo = after + 1;
+
+  size_t count = 0;
+
+  LOCK();
+    if(!db->index_stale || prop__index_rebuild(db)) {
+      for(size_t i = prop__index_lower_bound(db, range_lo);
+          i < db->index_len && db->index[i] <= range_hi && count < max_props; i++) {
+        if((db->index[i] & mask) == (masked_prop & mask))
+          props[count++] = db->index[i];
+      }
+    }
+  UNLOCK();
+
+  return count;
+}
+
+
 void prop_db_dump_keys(PropDB *db, uint32_t *keys, size_t keys_len) {
   printf("Prop DB (%" PRIuz " items):\n", dh_num_items(&db->hash));
 
@@ -106,9 +106,10 @@ static bool index_equal_hash_keys(dhKey key1, dhKey key2, void *ctx) {
 }
 
 static void prop__index_namespace(PropNamespace *ns) {
+  size_t num_defs = ns->prop_defs_len;
+
   dhConfig hash_cfg = {
-                                          // Extra 10% to avoid hash growing
-    .init_buckets = ns->prop_defs_len + (ns->prop_defs_len / 10),
+    .init_buckets = num_defs, // Sized to fit all names by dh_build()
     .value_size   = sizeof(PropFieldDef *), // Point into prop_defs[]
     .destroy_item = index_item_destroy,
     .gen_hash     = dh_gen_hash_string_no_case,
@@ -117,17 +118,38 @@ static void prop__index_namespace(PropNamespace *ns) {
 
   dh_init(&ns->name_index, &hash_cfg, NULL);
 
-  // Build hash of field names
-  for(unsigned int i = 0; i < ns->prop_defs_len; i++) {
-    dhKey key = {
-      .data = ns->prop_defs[i].name,
-      .length = strlen(ns->prop_defs[i].name)
-    };
+  // Build hash of field names in one pass
+  // Using a pointer as the value since we already have static storage
+  dhKey *keys = cs_malloc(num_defs * (sizeof(dhKey) + sizeof(PropFieldDef *) + sizeof(void *)));
+
+  if(keys) {
+    PropFieldDef **defs = (PropFieldDef **)&keys[num_defs];
+    void **values = (void **)&defs[num_defs];
+
+    for(size_t i = 0; i < num_defs; i++) {
+      keys[i].data   = ns->prop_defs[i].name;
+      keys[i].length = strlen(ns->prop_defs[i].name);
+      defs[i]   = &ns->prop_defs[i];
+      values[i] = &defs[i];
+    }
+
+    dh_build(&ns->name_index, keys, values, num_defs);
+    cs_free(keys);
 
-    // Using a pointer as the value since we already have static storage
-    PropFieldDef *def = &ns->prop_defs[i];
-    dh_insert(&ns->name_index, key, &def);
+  } else { // Insert names individually
+    for(size_t i = 0; i < num_defs; i++) {
+      dhKey key = {
+        .data = ns->prop_defs[i].name,
+        .length = strlen(ns->prop_defs[i].name)
+      };
+
+      PropFieldDef *def = &ns->prop_defs[i];
+      dh_insert(&ns->name_index, key, &def);
+    }
   }
+
+  // Index never changes after this
+  dh_freeze(&ns->name_index);
 }
 
 
@@ -384,6 +406,9 @@ uint32_t prop_parse_name(const char *name) {
       is_array = true;
 //      printf("## ARRAY %d\n", level);
 
+    } else if(range_size(&tok) == 1 && *tok.start == '*') { // Mask field
+      field = 0xFFul << (4-level)*8;
+
     } else if(*tok.start == '<' && *(tok.end-1) == '>') { // Unknown field name
       field = strtoul(tok.start+1, NULL, 10);
       if(field >= 255) // Bad field value
@@ -663,7 +688,7 @@ int main(int argc, char *argv[]) {
   prop_get(&db, prop, &prop_value);
   prop_get_name(prop, p_name, sizeof(p_name));
   printf("P%08X  %s (%c) = %s\n", prop, p_name, prop_value.readonly ? 'R' : 'W',
-    (char *)prop_value.value);
+    (char *)prop_entry_data(&prop_value));
 
 
   prop_print(&db, P_NET_IPV4_DOMAIN_NAME);
@@ -216,8 +216,8 @@ unsigned prop_encoded_bytes(uint32_t prop, PropDBEntry *entry) {
 
   case P_KIND_STRING:
   case P_KIND_BLOB:
-    num_bytes += varint_encoded_bytes(entry->size);
-    num_bytes += entry->size;
+    num_bytes += varint_encoded_bytes(prop_entry_size(entry));
+    num_bytes += prop_entry_size(entry);
     break;
 
   default:
@@ -254,11 +254,11 @@ int prop_encode(uint32_t prop, PropDBEntry *entry, uint8_t *buf, size_t buf_size
     break;
 
   case P_KIND_STRING:
-    string_encode((char *)entry->value, buf, buf_size);
+    string_encode((char *)prop_entry_data(entry), buf, buf_size);
     break;
 
   case P_KIND_BLOB:
-    blob_encode((uint8_t *)entry->value, entry->size, buf, buf_size);
+    blob_encode((uint8_t *)prop_entry_data(entry), prop_entry_size(entry), buf, buf_size);
     break;
 
   default:
@@ -308,6 +308,14 @@ int prop_decode(uint32_t *prop, PropDBEntry *entry, uint8_t *buf) {
     buf += encode_size;
     num_bytes += encode_size + val;
 
+    if(prop_entry_fits_inline(P_KIND_STRING, val)) { // Store in entry
+      memcpy(entry->inline_data, buf, val);
+      entry->inline_data[val] = '\0';
+      entry->inline_size = val;
+      entry->is_inline = true;
+      break;
+    }
+
     char *str = mp_alloc(&g_pool_set, entry->size+1, NULL);
     if(str) {
       strlcpy(str, (char *)buf, entry->size+1);
@@ -327,6 +335,16 @@ int prop_decode(uint32_t *prop, PropDBEntry *entry, uint8_t *buf) {
     buf += encode_size;
     num_bytes += encode_size + val;
 
+    // All blob data is "sytem origin" so we don't want users overwriting it from console
+    entry->protect = true;
+
+    if(prop_entry_fits_inline(P_KIND_BLOB, val)) { // Store in entry
+      memcpy(entry->inline_data, buf, val);
+      entry->inline_size = val;
+      entry->is_inline = true;
+      break;
+    }
+
     char *data = mp_alloc(&g_pool_set, entry->size, NULL);
     if(data) {
       memcpy(data, (char *)buf, entry->size);
@@ -335,9 +353,6 @@ int prop_decode(uint32_t *prop, PropDBEntry *entry, uint8_t *buf) {
     } else {
       entry->value = (uintptr_t)NULL;
     }
-
-    // All blob data is "sytem origin" so we don't want users overwriting it from console
-    entry->protect = true;
     break;
   }
 
@@ -399,7 +414,7 @@ int main(void) {
     printf("## PROP: %08X %d %d\n", prop, entry.kind, (int32_t)entry.value);
     printf("## Prop decode size: %u\n", decode_bytes);
     if(entry.kind == P_KIND_STRING)
-      printf("## STR: '%s'\n", (char *)entry.value);
+      printf("## STR: '%s'\n", (char *)prop_entry_data(&entry));
 
     if((size_t)(pos - buf) >= encoded_len)
       break;
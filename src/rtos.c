@@ -198,6 +198,7 @@ static void periodic_task_wrapper(void *param) {
   if(DEBUG_FEATURE(PF_DEBUG_SYS_LOCAL_REPORTSTACK))
     report_task_stack_usage(pool_set);
 
+  mp_flush_thread_cache();
   vTaskDelete(NULL);
 }
 
@@ -30,6 +30,7 @@
 
 #include "cstone/tasks_core.h"
 #include "util/histogram.h"
+#include "util/mempool.h"
 
 
 
@@ -174,6 +175,47 @@ static void load_monitor_task_cb(TimerHandle_t timer) {
 #endif
 
 
+#if defined USE_MEM_MONITOR && defined USE_MP_TELEMETRY && defined USE_LOG_DB
+// Timestamp for measuring pool lock hold times
+static uint32_t mem_lock_timer(void) {
+  return micros();
+}
+
+// Only update changed props to avoid flooding the message hub
+static void set_mem_prop(uint32_t prop, uint32_t value) {
+  PropDBEntry entry;
+  if(prop_get(&g_prop_db, prop, &entry) && entry.value == value)
+    return;
+
+  prop_set_uint(&g_prop_db, prop, value, 0);
+}
+
+// TASK: Publish memory pool telemetry
+static void mem_monitor_task_cb(TimerHandle_t timer) {
+  mpPoolSet *pool_set = mp_sys_pools();
+  if(!pool_set)
+    return;
+
+  mpSetTelemetry tm;
+  mp_get_telemetry(pool_set, &tm);
+  set_mem_prop(P_STATS_MEM_INFO_FAIL, tm.alloc_fails);
+  set_mem_prop(P_STATS_MEM_LOCK_COUNT, tm.lock_count);
+  set_mem_prop(P_STATS_MEM_LOCK_MAX, tm.lock_max);
+
+  mpPoolTelemetry ptm;
+  unsigned ix;
+  for(ix = 0; ix < 255 && mp_get_pool_telemetry(pool_set, ix, &ptm); ix++) {
+    set_mem_prop(PROP_SET_INDEX(P_STATS_MEM_n_SIZE, 2, ix),  ptm.element_size);
+    set_mem_prop(PROP_SET_INDEX(P_STATS_MEM_n_COUNT, 2, ix), ptm.elements);
+    set_mem_prop(PROP_SET_INDEX(P_STATS_MEM_n_ALLOC, 2, ix), ptm.allocs);
+    set_mem_prop(PROP_SET_INDEX(P_STATS_MEM_n_USED, 2, ix),  ptm.in_use);
+    set_mem_prop(PROP_SET_INDEX(P_STATS_MEM_n_PEAK, 2, ix),  ptm.peak_use);
+  }
+  set_mem_prop(P_STATS_MEM_INFO_COUNT, ix);
+}
+#endif
+
+
 // Use an independent timestamp so multiple LEDs stay synchronized.
 // This will only increment when the blink task runs.
 static unsigned s_blink_timestamp = 0;
@@ -333,6 +375,7 @@ void core_tasks_init(void) {
 
   // Monitor all events and debug messages
   umsg_tgt_queued_init(&s_tgt_event_monitor, 4);
+  umsg_tgt_set_overflow_policy(&s_tgt_event_monitor, UMSG_OVERFLOW_DROP_OLDEST);
   umsg_tgt_add_filter(&s_tgt_event_monitor, (P1_EVENT | P2_MSK | P3_MSK | P4_MSK));
   umsg_tgt_add_filter(&s_tgt_event_monitor, (P1_DEBUG | P2_MSK | P3_MSK | P4_MSK));
   umsg_hub_subscribe(&g_msg_hub, &s_tgt_event_monitor);
@@ -354,6 +397,20 @@ void core_tasks_init(void) {
   xTimerStart(load_timer, 0);
 #endif
 
+#if defined USE_MEM_MONITOR && defined USE_MP_TELEMETRY && defined USE_LOG_DB
+  mp_set_lock_timer(mp_sys_pools(), mem_lock_timer);
+
+  TimerHandle_t mem_timer = xTimerCreate(  // Memory pool telemetry
+    "MEM",
+    MEM_MONITOR_TASK_MS,
+    pdTRUE, // uxAutoReload
+    NULL,   // pvTimerID
+    mem_monitor_task_cb
+  );
+
+  xTimerStart(mem_timer, 0);
+#endif
+
 #ifdef USE_LED_BLINK_PERIODIC_TASK
   // Run BlinkLED as an independent task
   static PeriodicTaskCfg cfg = {  // LED blink handler
@@ -5,14 +5,59 @@
 
 #include "FreeRTOS.h"
 #include "queue.h"
+#include "semphr.h"
+#include "task.h"
 
+#include "cstone/platform.h"
 #include "cstone/prop_id.h"
 #include "cstone/umsg.h"
 #include "util/mempool.h"
 #include "util/list_ops.h"
 
+#ifdef PLATFORM_HAS_ATOMICS
+#  include <stdatomic.h>
+#endif
 
-extern unsigned long millis(void);
+
+// Hubs dispatch through an index of subscriber filters rather than scanning
+// every filter of every subscriber for each message.
+#define USE_UMSG_HUB_INDEX
+
+// Hub task drains up to UMSG_HUB_BATCH_SIZE messages from its inbox on each
+// wakeup and forwards them to subscriber queues together.
+#define USE_UMSG_HUB_BATCH
+
+// Hub inboxes are split into a lane for each priority class. Errors are
+// dispatched ahead of any backlog of debug messages.
+#define USE_UMSG_HUB_PRIORITY_LANES
+
+// Hub inboxes use a lock-free ring in place of a FreeRTOS queue. Producers
+// don't enter a critical section and can send from ISRs with umsg_hub_send().
+//#define USE_UMSG_LOCK_FREE_INBOX
+
+#if defined USE_UMSG_LOCK_FREE_INBOX && !defined PLATFORM_HAS_ATOMICS
+#  error "Lock-free inbox requires C11 atomics"
+#endif
+
+#ifdef PLATFORM_EMBEDDED
+#  define IN_ISR()  xPortIsInsideInterrupt()
+#else
+#  define IN_ISR()  0
+#endif
+
+// Number of combinations of masked fields in a filter
+#define UMSG_FILTER_SHAPES  16
+
+
+// Incremented whenever a filter or subscription changes. Hubs rebuild their
+// index when this no longer matches the generation they were built from.
+static volatile unsigned s_filter_gen = 0;
+
+static inline void umsg__filters_changed(void) {
+  taskENTER_CRITICAL();
+    s_filter_gen++;
+  taskEXIT_CRITICAL();
+}
 
 
 /*
@@ -54,6 +99,15 @@ void umsg_tgt_free(UMsgTarget *tgt) {
     tgt->q = 0;
   }
 
+  if(tgt->ring) {
+    cs_free(tgt->ring->slots);
+    cs_free(tgt->ring);
+    tgt->ring = NULL;
+  }
+
+  if(tgt->filter_chunks)
+    umsg__filters_changed();
+
   while(tgt->filter_chunks) {
     UMsgFilterChunk *cur_chunk = LL_NODE(ll_slist_pop(&tgt->filter_chunks), UMsgFilterChunk, next);
     mp_free(mp_sys_pools(), cur_chunk);
@@ -111,6 +165,7 @@ bool umsg_tgt_add_filter(UMsgTarget *tgt, uint32_t filter_mask) {
 
   if(filter_slot) {
     *filter_slot = filter_mask;
+    umsg__filters_changed();
     return true;
   }
 
@@ -133,6 +188,7 @@ bool umsg_tgt_remove_filter(UMsgTarget *tgt, uint32_t filter_mask) {
 
   if(filter_slot) {
     *filter_slot = 0;
+    umsg__filters_changed();
     return true;
   }
 
@@ -157,12 +213,180 @@ static bool umsg__tgt_match_filter(UMsgTarget *tgt, uint32_t prop_id) {
 }
 
 
+// ******************** Lock-free ring ********************
+
+#ifdef PLATFORM_HAS_ATOMICS
+/*
+Bounded MPSC ring with a sequence number in each slot. A producer claims a
+position by advancing head and publishes the message by setting the slot
+sequence one past its position. The consumer only reads slots that have been
+published. Producers never wait on each other so an ISR can safely interrupt
+a task that is part way through sending.
+*/
+
+#define RING_ATOMIC(field)  ((atomic_uint *)&(field))
+
+
+static bool umsg__ring_push(UMsgRing *ring, UMsg *msg) {
+  uint32_t pos = atomic_load_explicit(RING_ATOMIC(ring->head), memory_order_relaxed);
+  UMsgRingSlot *slot;
+
+  while(1) {
+    slot = &ring->slots[pos & ring->mask];
+    uint32_t seq = atomic_load_explicit(RING_ATOMIC(slot->seq), memory_order_acquire);
+    int32_t diff = (int32_t)(seq - pos);
+
+    if(diff == 0) { // Slot is free
+      if(atomic_compare_exchange_weak_explicit(RING_ATOMIC(ring->head), &pos, pos+1,
+                                               memory_order_relaxed, memory_order_relaxed))
+        break;
+    } else if(diff < 0) { // Full
+      return false;
+    } else { // Another producer claimed this position
+      pos = atomic_load_explicit(RING_ATOMIC(ring->head), memory_order_relaxed);
+    }
+  }
+
+  slot->msg = *msg;
+  atomic_store(RING_ATOMIC(slot->seq), pos+1);
+
+  // Only wake the consumer when it found the ring empty
+  if(atomic_load(RING_ATOMIC(ring->waiting)) && atomic_exchange(RING_ATOMIC(ring->waiting), 0)) {
+    if(IN_ISR()) {
+      BaseType_t woken = pdFALSE;
+      vTaskNotifyGiveFromISR(ring->consumer, &woken);
+      portYIELD_FROM_ISR(woken);
+    } else {
+      xTaskNotifyGive(ring->consumer);
+    }
+  }
+
+  return true;
+}
+
+
+static bool umsg__ring_pop(UMsgRing *ring, UMsg *msg) {
+  UMsgRingSlot *slot = &ring->slots[ring->tail & ring->mask];
+  uint32_t seq = atomic_load(RING_ATOMIC(slot->seq));
+
+  if(seq != ring->tail + 1) // Empty or not yet published
+    return false;
+
+  *msg = slot->msg;
+  // Free slot for the producer one lap ahead
+  atomic_store_explicit(RING_ATOMIC(slot->seq), ring->tail + ring->mask + 1, memory_order_release);
+  ring->tail++;
+  return true;
+}
+
+
+static bool umsg__ring_send(UMsgRing *ring, UMsg *msg, TickType_t timeout_ticks) {
+  if(umsg__ring_push(ring, msg))
+    return true;
+
+  if(timeout_ticks == 0 || IN_ISR())
+    return false;
+
+  // Poll for space when full
+  TickType_t start = xTaskGetTickCount();
+  do {
+    vTaskDelay(1);
+    if(umsg__ring_push(ring, msg))
+      return true;
+  } while(timeout_ticks == portMAX_DELAY || xTaskGetTickCount() - start < timeout_ticks);
+
+  return false;
+}
+
+
+static bool umsg__ring_recv(UMsgRing *ring, UMsg *msg, TickType_t timeout_ticks) {
+  if(umsg__ring_pop(ring, msg))
+    return true;
+
+  if(timeout_ticks == 0)
+    return false;
+
+  ring->consumer = xTaskGetCurrentTaskHandle();
+
+  while(1) {
+    atomic_store(RING_ATOMIC(ring->waiting), 1);
+
+    // Check again in case a producer finished before it could see waiting
+    if(umsg__ring_pop(ring, msg)) {
+      atomic_store(RING_ATOMIC(ring->waiting), 0);
+      return true;
+    }
+
+    if(ulTaskNotifyTake(/*xClearCountOnExit*/ pdTRUE, timeout_ticks) == 0 && timeout_ticks != portMAX_DELAY) {
+      atomic_store(RING_ATOMIC(ring->waiting), 0);
+      return umsg__ring_pop(ring, msg);
+    }
+
+    if(umsg__ring_pop(ring, msg))
+      return true;
+  }
+}
+#endif // PLATFORM_HAS_ATOMICS
+
+
+/*
+Initialize a message target with a lock-free queue
+
+Any number of tasks and ISRs can send to the target but only one task may
+receive from it. Senders don't enter a critical section.
+
+Args:
+  tgt:      Target to init
+  max_msg:  Number of messages in the queue. Rounded up to a power of 2
+
+Returns:
+  true on success
+*/
+bool umsg_tgt_ring_init(UMsgTarget *tgt, size_t max_msg) {
+  memset(tgt, 0, sizeof(*tgt));
+
+#ifdef PLATFORM_HAS_ATOMICS
+  size_t num_slots = 2;
+  while(num_slots < max_msg)
+    num_slots <<= 1;
+
+  UMsgRing *ring = cs_malloc(sizeof(UMsgRing));
+  UMsgRingSlot *slots = cs_malloc(num_slots * sizeof(UMsgRingSlot));
+  if(!ring || !slots) {
+    if(ring) cs_free(ring);
+    if(slots) cs_free(slots);
+    return false;
+  }
+
+  memset(ring, 0, sizeof(*ring));
+  ring->slots = slots;
+  ring->mask  = num_slots - 1;
+  for(size_t i = 0; i < num_slots; i++) {
+    atomic_init(RING_ATOMIC(slots[i].seq), i);
+  }
+
+  tgt->ring = ring;
+  return true;
+
+#else
+  return false;
+#endif
+}
+
+
+#ifdef USE_UMSG_HUB_PRIORITY_LANES
+static bool umsg__hub_lane_put(UMsgHub *hub, UMsg *msg, TickType_t timeout_ticks);
+static bool umsg__hub_lane_send(UMsgHub *hub, UMsg *msg, TickType_t timeout_ticks);
+#endif
+
 /*
 Send a message to a target
 
 The message object will be copied and does not need to be preserved.
 Set timeout param to NO_TIMEOUT to fail immediately when message can't be sent.
 Set it to INFINITE_TIMEOUT to block indefinitely until a message can be sent.
+Targets with a lock-free ring can also be sent to from an ISR. The timeout is
+ignored in that case.
 
 Args:
   tgt:      Target for the message
@@ -178,6 +402,22 @@ bool umsg_tgt_send(UMsgTarget *tgt, UMsg *msg, uint32_t timeout) {
   TickType_t timeout_ticks;
 
   timeout_ticks = (timeout == INFINITE_TIMEOUT) ? portMAX_DELAY : pdMS_TO_TICKS(timeout);
+
+#ifdef USE_UMSG_HUB_PRIORITY_LANES
+  if(tgt->is_hub)
+    return umsg__hub_lane_send((UMsgHub *)tgt, msg, timeout_ticks);
+#endif
+
+#ifdef PLATFORM_HAS_ATOMICS
+  if(tgt->ring) {
+    bool status = umsg__ring_send(tgt->ring, msg, timeout_ticks);
+    if(!status) // Timeout
+      atomic_fetch_add_explicit((atomic_uint *)&tgt->dropped_messages, 1, memory_order_relaxed);
+
+    return status;
+  }
+#endif
+
   bool status = xQueueSend(tgt->q, msg, timeout_ticks) == pdTRUE;
 
   if(!status) { // Timeout
@@ -210,6 +450,12 @@ bool umsg_tgt_recv(UMsgTarget *tgt, UMsg *msg, uint32_t timeout) {
   TickType_t timeout_ticks;
 
   timeout_ticks = (timeout == INFINITE_TIMEOUT) ? portMAX_DELAY : pdMS_TO_TICKS(timeout);
+
+#ifdef PLATFORM_HAS_ATOMICS
+  if(tgt->ring)
+    return umsg__ring_recv(tgt->ring, msg, timeout_ticks);
+#endif
+
   return xQueueReceive(tgt->q, msg, timeout_ticks) == pdTRUE;
 }
 
@@ -229,24 +475,83 @@ void umsg_discard(UMsg *msg) {
 }
 
 
+/*
+Get the priority class of a message
+
+Args:
+  msg_id: Prop ID of the message
+
+Returns:
+  One of the UMSG_PRIO_* classes
+*/
+unsigned umsg_priority(uint32_t msg_id) {
+  switch(msg_id & PROP_ARR_MASK(1)) {
+    case P1_ERROR:
+    case P1_AUX_24: // Query responses
+      return UMSG_PRIO_HIGH;
+
+    case P1_DEBUG:
+      return UMSG_PRIO_LOW;
+
+    default:
+      return UMSG_PRIO_NORMAL;
+  }
+}
+
+
 
 static UMsgHub *s_main_sys_hub = NULL;
 
+#ifdef USE_UMSG_HUB_PRIORITY_LANES
+static void umsg__hub_lanes_init(UMsgHub *hub, size_t max_msg);
+#endif
+
 /*
 Initialize a message hub
 
 A hub is always configured as a target with queued message input.
+Messages are queued in a separate lane for each priority class returned
+by :c:func:`umsg_priority`.
 The first hub initialized will be set as a system wide "main" hub that
 can be retrieved with :c:func:`umsg_sys_hub`.
 
 Args:
   hub:      Message hub to init
-  max_msg:  Number of messages in the queue
+  max_msg:  Number of messages in the queue for each priority lane
 */
 void umsg_hub_init(UMsgHub *hub, size_t max_msg) {
-  umsg_tgt_queued_init(&hub->inbox, max_msg);
+  memset(hub->lanes, 0, sizeof hub->lanes);
+  hub->lanes_ready = NULL;
+
+#ifdef USE_UMSG_HUB_PRIORITY_LANES
+  umsg_tgt_callback_init(&hub->inbox, NULL);
+  umsg__hub_lanes_init(hub, max_msg);
+#else
+#  ifdef USE_UMSG_LOCK_FREE_INBOX
+  if(!umsg_tgt_ring_init(&hub->inbox, max_msg))
+#  endif
+    umsg_tgt_queued_init(&hub->inbox, max_msg);
+#endif
+  hub->inbox.is_hub = true;
   hub->subscribers = NULL;
 
+  hub->index_entries  = NULL;
+  hub->index_matches  = NULL;
+  hub->index_len      = 0;
+  hub->index_gen      = s_filter_gen - 1; // Build index on first message
+  hub->index_shapes   = 0;
+  hub->index_ready    = false;
+
+  hub->plan     = NULL;
+  hub->plan_len = 0;
+  hub->plan_max = 0;
+
+  memset(hub->replies, 0, sizeof hub->replies);
+  hub->pending_replies = 0;
+  for(size_t i = 0; i < UMSG_HUB_MAX_QUERIES; i++) {
+    hub->replies[i].ready = xSemaphoreCreateBinary();
+  }
+
   if(!s_main_sys_hub) // First hub becomes main by default
     s_main_sys_hub = hub;
 }
@@ -258,7 +563,28 @@ Free a hub's resources
 Args:
   hub:  Message hub to free
 */
+static void umsg__hub_free_index(UMsgHub *hub);
+
 void umsg_hub_free(UMsgHub *hub) {
+  umsg__hub_free_index(hub);
+  if(hub->plan) {
+    cs_free(hub->plan);
+    hub->plan = NULL;
+    hub->plan_max = 0;
+  }
+  for(size_t i = 0; i < UMSG_PRIORITIES; i++) {
+    umsg_tgt_free(&hub->lanes[i]);
+  }
+  if(hub->lanes_ready) {
+    vSemaphoreDelete(hub->lanes_ready);
+    hub->lanes_ready = NULL;
+  }
+  for(size_t i = 0; i < UMSG_HUB_MAX_QUERIES; i++) {
+    if(hub->replies[i].ready) {
+      vSemaphoreDelete(hub->replies[i].ready);
+      hub->replies[i].ready = NULL;
+    }
+  }
   umsg_tgt_free(&hub->inbox);
 }
 
@@ -296,6 +622,7 @@ Args:
 void umsg_hub_subscribe(UMsgHub *hub, UMsgTarget *subscriber) {
   taskENTER_CRITICAL();
     ll_slist_push(&hub->subscribers, subscriber);
+    s_filter_gen++;
   taskEXIT_CRITICAL();
 }
 
@@ -313,23 +640,75 @@ Returns:
 bool umsg_hub_unsubscribe(UMsgHub *hub, UMsgTarget *subscriber) {
   taskENTER_CRITICAL();
     bool status = ll_slist_remove(&hub->subscribers, subscriber);
+    s_filter_gen++;
   taskEXIT_CRITICAL();
 
   return status;
 }
 
 
-static void umsg__query_cb(UMsgTarget *tgt, UMsg *msg) {
-  tgt->user_data = msg->payload;
-taskENTER_CRITICAL();
-  tgt->msg_handler_cb = NULL; // Notify busy wait loop
-taskEXIT_CRITICAL();
+// Reserve a reply slot for a query
+static UMsgHubReply *umsg__hub_claim_reply(UMsgHub *hub, uint32_t response_id) {
+  UMsgHubReply *reply = NULL;
+
+  taskENTER_CRITICAL();
+    for(size_t i = 0; i < UMSG_HUB_MAX_QUERIES; i++) {
+      if(hub->replies[i].id == 0 && hub->replies[i].ready) {
+        reply = &hub->replies[i];
+        reply->id       = response_id;
+        reply->payload  = 0;
+        reply->done     = false;
+        hub->pending_replies++;
+        break;
+      }
+    }
+  taskEXIT_CRITICAL();
+
+  return reply;
+}
+
+
+static void umsg__hub_release_reply(UMsgHub *hub, UMsgHubReply *reply) {
+  taskENTER_CRITICAL();
+    reply->id = 0;
+    hub->pending_replies--;
+  taskEXIT_CRITICAL();
+}
+
+
+// Complete a pending query when its response passes through the hub
+static void umsg__hub_match_reply(UMsgHub *hub, UMsg *msg) {
+  if(hub->pending_replies == 0 || (msg->id & PROP_MASK(1)) != P1_AUX_24)
+    return;
+
+  SemaphoreHandle_t ready = NULL;
+
+  taskENTER_CRITICAL();
+    for(size_t i = 0; i < UMSG_HUB_MAX_QUERIES; i++) {
+      UMsgHubReply *reply = &hub->replies[i];
+      if(reply->id == msg->id && !reply->done) {
+        reply->payload = msg->payload;
+        reply->done = true;
+        ready = reply->ready;
+        break;
+      }
+    }
+  taskEXIT_CRITICAL();
+
+  if(ready)
+    xSemaphoreGive(ready);
 }
 
 
 /*
 Send a query message to a target
 
+The query carries a new correlation ID in its source field. The target responds
+by sending a message to the hub with that ID. The calling task blocks on a binary
+semaphore owned by its reply slot until the response passes through the hub inbox.
+Task notifications are left alone since the caller may already use them, as
+periodic tasks do to change their period.
+
 Set timeout param to NO_TIMEOUT to fail immediately when query can't be sent.
 Set it to INFINITE_TIMEOUT to block indefinitely until a response is received.
 
@@ -343,17 +722,18 @@ Returns:
   true on success
 */
 bool umsg_hub_query(UMsgHub *hub, uint32_t query_id, uintptr_t *response, uint32_t timeout) {
-  bool rval = true;
-  // Create temporary target to receive response
-  UMsgTarget *response_tgt = mp_alloc(mp_sys_pools(), sizeof(UMsgTarget), NULL);
-  if(!response_tgt)
-    return false;
+  TickType_t timeout_ticks = (timeout == INFINITE_TIMEOUT) ? portMAX_DELAY : pdMS_TO_TICKS(timeout);
+  TickType_t start = xTaskGetTickCount();
 
   uint32_t response_id = prop_new_global_id();
 
-  umsg_tgt_callback_init(response_tgt, umsg__query_cb);
-  umsg_tgt_add_filter(response_tgt, PROP_AUX_24_MASK);
-  umsg_hub_subscribe(hub, response_tgt);
+  // Wait for a free slot if the table is full
+  UMsgHubReply *reply;
+  while(!(reply = umsg__hub_claim_reply(hub, response_id))) {
+    if(timeout_ticks != portMAX_DELAY && xTaskGetTickCount() - start >= timeout_ticks)
+      return false;
+    vTaskDelay(1);
+  }
 
   // Send query
   UMsg msg = {
@@ -361,29 +741,714 @@ bool umsg_hub_query(UMsgHub *hub, uint32_t query_id, uintptr_t *response, uint32
     .source = response_id
   };
 
-  uint32_t start = millis();
-  if(!umsg_hub_send(hub, &msg, timeout)) {
-    rval = false;
-    goto cleanup;
+  bool rval = umsg_hub_send(hub, &msg, timeout);
+
+  // Wait for response. A give left over from an earlier timed out query on this
+  // slot can wake us early so the done flag is checked after every wakeup.
+  while(rval && !reply->done) {
+    TickType_t wait_ticks = portMAX_DELAY;
+    if(timeout_ticks != portMAX_DELAY) {
+      TickType_t elapsed = xTaskGetTickCount() - start;
+      if(elapsed >= timeout_ticks) {
+        rval = false;
+        break;
+      }
+      wait_ticks = timeout_ticks - elapsed;
+    }
+
+    xSemaphoreTake(reply->ready, wait_ticks);
   }
 
-  // Wait for response
-  while(response_tgt->msg_handler_cb) {  // Callback function will be cleared when response arrives
-    if((timeout != INFINITE_TIMEOUT) && (millis() - start > timeout)) {
-      rval = false;
-      goto cleanup;
+  if(rval)
+    *response = reply->payload;
+
+  umsg__hub_release_reply(hub, reply);
+
+  return rval;
+}
+
+
+// ******************** Dispatch index ********************
+
+/*
+Subscriber filters are grouped by "shape": the set of fields masked with 0xFF.
+A message ID matches a filter when the ID with the masked fields of the filter's
+shape forced to 0xFF equals the filter. Dispatch takes one hash lookup for each
+shape in use rather than testing every filter of every subscriber.
+*/
+
+// Get the shape of a filter as a bitmap of masked fields
+static inline unsigned umsg__filter_shape(uint32_t filter) {
+  unsigned shape = 0;
+  for(unsigned level = 1; level <= 4; level++) {
+    if((filter & PROP_MASK(level)) == PROP_MASK(level))
+      shape |= 1u << (level-1);
+  }
+  return shape;
+}
+
+// Get the masked fields of a shape
+static inline uint32_t umsg__shape_mask(unsigned shape) {
+  uint32_t mask = 0;
+  for(unsigned level = 1; level <= 4; level++) {
+    if(shape & (1u << (level-1)))
+      mask |= PROP_MASK(level);
+  }
+  return mask;
+}
+
+
+static void umsg__hub_free_index(UMsgHub *hub) {
+  if(hub->index_ready)
+    dh_free(&hub->index);
+
+  if(hub->index_entries)
+    cs_free(hub->index_entries);
+  if(hub->index_matches)
+    cs_free(hub->index_matches);
+
+  hub->index_entries  = NULL;
+  hub->index_matches  = NULL;
+  hub->index_len      = 0;
+  hub->index_shapes   = 0;
+  hub->index_ready    = false;
+}
+
+
+static int umsg__index_entry_cmp(const void *a, const void *b) {
+  const UMsgHubIndexEntry *ea = (const UMsgHubIndexEntry *)a;
+  const UMsgHubIndexEntry *eb = (const UMsgHubIndexEntry *)b;
+
+  if(ea->filter != eb->filter)
+    return ea->filter < eb->filter ? -1 : 1;
+
+  return (int)ea->rank - (int)eb->rank;
+}
+
+
+static void umsg__index_destroy_item(dhKey key, void *value, void *ctx) {
+}
+
+
+/*
+Rebuild a hub's dispatch index from the current subscriber filters
+
+If the index can't be allocated the hub falls back to scanning filters
+until the next change.
+
+Args:
+  hub:  Message hub to index
+
+Returns:
+  true on success
+*/
+static bool umsg__hub_build_index(UMsgHub *hub) {
+  // Changes made while building will trigger another rebuild
+  unsigned gen = s_filter_gen;
+
+  umsg__hub_free_index(hub);
+  hub->index_gen = gen;
+
+  size_t num_filters = 0;
+  for(UMsgTarget *cur = hub->subscribers; cur; cur = cur->next) {
+    for(UMsgFilterChunk *chunk = cur->filter_chunks; chunk; chunk = chunk->next) {
+      for(int i = 0; i < UMSG_FILTERS_IN_CHUNK; i++) {
+        if(chunk->filters[i] != 0)
+          num_filters++;
+      }
     }
-    vTaskDelay(1);
   }
 
-  *response = response_tgt->user_data;
+  size_t alloc_filters = num_filters > 0 ? num_filters : 1;
+  hub->index_entries = cs_malloc(alloc_filters * sizeof(UMsgHubIndexEntry));
+  hub->index_matches = cs_malloc(alloc_filters * sizeof(UMsgHubIndexEntry *));
+  dhKey *keys = cs_malloc(alloc_filters * sizeof(dhKey));
+  uintptr_t *starts = cs_malloc(alloc_filters * sizeof(uintptr_t));
+  void **values = cs_malloc(alloc_filters * sizeof(void *));
+
+  bool status = hub->index_entries && hub->index_matches && keys && starts && values;
+  if(!status)
+    goto cleanup;
+
+  // Collect filters in subscriber order
+  unsigned rank = 0;
+  for(UMsgTarget *cur = hub->subscribers; cur && hub->index_len < num_filters; cur = cur->next, rank++) {
+    for(UMsgFilterChunk *chunk = cur->filter_chunks; chunk; chunk = chunk->next) {
+      for(int i = 0; i < UMSG_FILTERS_IN_CHUNK && hub->index_len < num_filters; i++) {
+        uint32_t filter = chunk->filters[i];
+        if(filter == 0)
+          continue;
+
+        UMsgHubIndexEntry *entry = &hub->index_entries[hub->index_len++];
+        entry->filter = filter;
+        entry->rank   = rank;
+        entry->tgt    = cur;
+        hub->index_shapes |= 1u << umsg__filter_shape(filter);
+      }
+    }
+  }
+
+  qsort(hub->index_entries, hub->index_len, sizeof(UMsgHubIndexEntry), umsg__index_entry_cmp);
+
+  // Map each distinct filter to its first entry
+  size_t num_keys = 0;
+  for(size_t i = 0; i < hub->index_len; i++) {
+    if(i > 0 && hub->index_entries[i].filter == hub->index_entries[i-1].filter)
+      continue;
+
+    keys[num_keys].data   = (void *)(uintptr_t)hub->index_entries[i].filter;
+    keys[num_keys].length = sizeof(uint32_t);
+    starts[num_keys] = i;
+    values[num_keys] = &starts[num_keys];
+    num_keys++;
+  }
+
+  dhConfig hash_cfg = {
+    .init_buckets = num_keys,
+    .value_size   = sizeof(uintptr_t),
+    .destroy_item = umsg__index_destroy_item,
+    .int_keys     = true
+  };
+
+  status = dh_init(&hub->index, &hash_cfg, NULL);
+  if(!status)
+    goto cleanup;
+
+  status = dh_build(&hub->index, keys, values, num_keys) && dh_freeze(&hub->index);
+  if(!status)
+    dh_free(&hub->index);
 
 cleanup:
-  umsg_hub_unsubscribe(hub, response_tgt);
-  umsg_tgt_free(response_tgt);
-  mp_free(mp_sys_pools(), response_tgt);
+  hub->index_ready = status;
+  if(!status)
+    umsg__hub_free_index(hub);
 
-  return rval;
+  if(keys)    cs_free(keys);
+  if(starts)  cs_free(starts);
+  if(values)  cs_free(values);
+
+  return status;
+}
+
+
+/*
+Find the subscribers with a filter matching a message
+
+Args:
+  hub:      Message hub with a ready index
+  msg_id:   Message ID to match
+
+Returns:
+  Number of matching entries in hub->index_matches. Each target appears once, in subscriber order.
+*/
+static size_t umsg__hub_match_index(UMsgHub *hub, uint32_t msg_id) {
+  size_t num_matches = 0;
+
+  for(unsigned shape = 0; shape < UMSG_FILTER_SHAPES; shape++) {
+    if(!(hub->index_shapes & (1u << shape)))
+      continue;
+
+    uint32_t filter = msg_id | umsg__shape_mask(shape);
+    dhKey key = {
+      .data = (void *)(uintptr_t)filter,
+      .length = sizeof(uint32_t)
+    };
+
+    uintptr_t start;
+    if(!dh_lookup(&hub->index, key, &start))
+      continue;
+
+    for(size_t i = start; i < hub->index_len && hub->index_entries[i].filter == filter; i++) {
+      // Insert in subscriber order. Match lists are short so this is cheaper than a sort.
+      UMsgHubIndexEntry *entry = &hub->index_entries[i];
+      size_t pos = num_matches;
+      while(pos > 0 && hub->index_matches[pos-1]->rank > entry->rank)
+        pos--;
+
+      // Targets with more than one matching filter only receive the message once
+      if(pos > 0 && hub->index_matches[pos-1]->rank == entry->rank)
+        continue;
+
+      memmove(&hub->index_matches[pos+1], &hub->index_matches[pos],
+              (num_matches - pos) * sizeof(UMsgHubIndexEntry *));
+      hub->index_matches[pos] = entry;
+      num_matches++;
+    }
+  }
+
+  return num_matches;
+}
+
+
+/*
+Make room in a full subscriber queue
+
+With the scheduler suspended the queue is rotated once so that a queued message
+with the same ID can be replaced in place. When coalescing isn't requested or
+there is no match the oldest message is removed instead.
+
+Args:
+  tgt:      Subscriber target with a full queue
+  msg:      New message to queue
+  coalesce: Replace a queued message with the same ID
+
+Returns:
+  true if msg was queued
+*/
+static bool umsg__queue_make_room(UMsgTarget *tgt, UMsg *msg, bool coalesce) {
+  UMsg removed = {0}, lost = {0};
+  bool have_removed = false, have_lost = false;
+  bool sent = false;
+
+  vTaskSuspendAll();
+    if(coalesce) {
+      UBaseType_t waiting = uxQueueMessagesWaiting(tgt->q);
+      UMsg cur;
+
+      for(UBaseType_t i = 0; i < waiting; i++) {
+        if(xQueueReceive(tgt->q, &cur, 0) != pdTRUE) // Subscriber emptied the queue
+          break;
+
+        UMsg *requeue = &cur;
+        if(!have_removed && cur.id == msg->id) { // Put new message in place of the old one
+          removed = cur;
+          have_removed = true;
+          requeue = msg;
+        }
+
+        if(xQueueSend(tgt->q, requeue, 0) != pdTRUE) { // Slot taken by an ISR
+          if(requeue == &cur) {
+            lost = cur;
+            have_lost = true;
+          }
+          break;
+        }
+
+        if(requeue == msg)
+          sent = true;
+      }
+    }
+
+    if(!have_removed) { // Drop oldest
+      sent = xQueueSend(tgt->q, msg, 0) == pdTRUE;
+      if(!sent && xQueueReceive(tgt->q, &removed, 0) == pdTRUE) {
+        have_removed = true;
+        sent = xQueueSend(tgt->q, msg, 0) == pdTRUE;
+      }
+    }
+  xTaskResumeAll();
+
+  // Payloads can't be freed with the scheduler suspended
+  if(have_removed)
+    umsg_discard(&removed);
+  if(have_lost)
+    umsg_discard(&lost);
+
+  return sent;
+}
+
+
+// Queue a message for a subscriber according to its overflow policy
+static bool umsg__hub_queue_send(UMsgTarget *tgt, UMsg *msg, TickType_t send_timeout_ticks) {
+  // Only the consumer can remove messages from a ring or hub lane so there is
+  // no way to make room. Every policy except blocking drops the new message.
+#ifdef USE_UMSG_HUB_PRIORITY_LANES
+  if(tgt->is_hub) {
+    if(tgt->overflow_policy != UMSG_OVERFLOW_BLOCK)
+      send_timeout_ticks = 0;
+    return umsg__hub_lane_send((UMsgHub *)tgt, msg, send_timeout_ticks);
+  }
+#endif
+
+#ifdef PLATFORM_HAS_ATOMICS
+  if(tgt->ring) {
+    if(tgt->overflow_policy != UMSG_OVERFLOW_BLOCK)
+      send_timeout_ticks = 0;
+    return umsg__ring_send(tgt->ring, msg, send_timeout_ticks);
+  }
+#endif
+
+  switch(tgt->overflow_policy) {
+    case UMSG_OVERFLOW_DROP_NEWEST:
+      return xQueueSend(tgt->q, msg, 0) == pdTRUE;
+
+    case UMSG_OVERFLOW_DROP_OLDEST:
+    case UMSG_OVERFLOW_COALESCE:
+      if(xQueueSend(tgt->q, msg, 0) == pdTRUE)
+        return true;
+      return umsg__queue_make_room(tgt, msg, tgt->overflow_policy == UMSG_OVERFLOW_COALESCE);
+
+    default:
+      break;
+  }
+
+  return xQueueSend(tgt->q, msg, send_timeout_ticks) == pdTRUE;
+}
+
+
+// Check if a subscriber receives messages through a queue, ring, or hub lanes
+static inline bool umsg__tgt_is_queued(UMsgTarget *tgt) {
+#ifdef USE_UMSG_HUB_PRIORITY_LANES
+  if(tgt->is_hub)
+    return true;
+#endif
+
+  return tgt->q || tgt->ring;
+}
+
+
+// Queue a message for a subscriber without blocking
+static bool umsg__tgt_try_send(UMsgTarget *tgt, UMsg *msg) {
+#ifdef USE_UMSG_HUB_PRIORITY_LANES
+  if(tgt->is_hub)
+    return umsg__hub_lane_put((UMsgHub *)tgt, msg, 0);
+#endif
+
+#ifdef PLATFORM_HAS_ATOMICS
+  if(tgt->ring)
+    return umsg__ring_push(tgt->ring, msg);
+#endif
+
+  return xQueueSend(tgt->q, msg, 0) == pdTRUE;
+}
+
+
+// Pass a message to a subscriber
+static void umsg__hub_deliver(UMsgTarget *tgt, UMsg *msg, TickType_t send_timeout_ticks) {
+  if(tgt->msg_handler_cb) { // Handle message via callback
+    tgt->msg_handler_cb(tgt, msg);
+
+  } else if(umsg__tgt_is_queued(tgt)) { // Pass message along to subscriber queue
+    if(msg->payload_size > 0 && msg->payload)  // Add reference for subscriber
+      mp_inc_ref((void *)msg->payload);
+
+    if(!umsg__hub_queue_send(tgt, msg, send_timeout_ticks)) {
+#ifdef USE_UMSG_HUB_PRIORITY_LANES
+      if(tgt->is_hub) {
+        // Counted on the lane
+      } else
+#endif
+#ifdef PLATFORM_HAS_ATOMICS
+      if(tgt->ring) {
+        atomic_fetch_add_explicit((atomic_uint *)&tgt->dropped_messages, 1, memory_order_relaxed);
+      } else
+#endif
+      {
+taskENTER_CRITICAL();
+        tgt->dropped_messages++;
+taskEXIT_CRITICAL();
+      }
+
+      if(tgt->overflow_policy == UMSG_OVERFLOW_BLOCK)
+        report_error(P_ERROR_SYS_MESSAGE_TIMEOUT, 0);
+
+      if(msg->payload_size > 0 && msg->payload)  // Remove unused reference
+        mp_dec_ref(mp_sys_pools(), (void *)msg->payload);
+    }
+  }
+}
+
+
+// Pass a message to every matching subscriber
+static void umsg__hub_dispatch(UMsgHub *hub, UMsg *msg, TickType_t send_timeout_ticks) {
+#ifdef USE_UMSG_HUB_INDEX
+  if(hub->index_ready) {
+    size_t num_matches = umsg__hub_match_index(hub, msg->id);
+    for(size_t i = 0; i < num_matches; i++) {
+      umsg__hub_deliver(hub->index_matches[i]->tgt, msg, send_timeout_ticks);
+    }
+    return;
+  }
+#endif
+
+  // Relay message to subscribers with matching mask
+  for(UMsgTarget *cur = hub->subscribers; cur; cur = cur->next) {
+    if(umsg__tgt_match_filter(cur, msg->id))
+      umsg__hub_deliver(cur, msg, send_timeout_ticks);
+  }
+}
+
+
+#ifdef USE_UMSG_HUB_BATCH
+static bool umsg__hub_plan_add(UMsgHub *hub, UMsgTarget *tgt, size_t msg_ix) {
+  if(hub->plan_len >= hub->plan_max) {
+    size_t new_max = hub->plan_max > 0 ? hub->plan_max * 2 : UMSG_HUB_BATCH_SIZE * 2;
+    UMsgHubDelivery *new_plan = cs_realloc(hub->plan, new_max * sizeof(UMsgHubDelivery));
+    if(!new_plan)
+      return false;
+
+    hub->plan = new_plan;
+    hub->plan_max = new_max;
+  }
+
+  UMsgHubDelivery *d = &hub->plan[hub->plan_len++];
+  d->tgt    = tgt;
+  d->msg_ix = msg_ix;
+  d->sent   = false;
+  d->ref_added = false;
+  return true;
+}
+
+
+// Build list of deliveries for a batch in message order
+static bool umsg__hub_plan_batch(UMsgHub *hub, UMsg *batch, size_t batch_len) {
+  hub->plan_len = 0;
+
+  for(size_t m = 0; m < batch_len; m++) {
+#  ifdef USE_UMSG_HUB_INDEX
+    if(hub->index_ready) {
+      size_t num_matches = umsg__hub_match_index(hub, batch[m].id);
+      for(size_t i = 0; i < num_matches; i++) {
+        if(!umsg__hub_plan_add(hub, hub->index_matches[i]->tgt, m))
+          return false;
+      }
+      continue;
+    }
+#  endif
+
+    for(UMsgTarget *cur = hub->subscribers; cur; cur = cur->next) {
+      if(umsg__tgt_match_filter(cur, batch[m].id) && !umsg__hub_plan_add(hub, cur, m))
+        return false;
+    }
+  }
+
+  return true;
+}
+
+
+// Check if an earlier delivery to a target couldn't be sent
+static bool umsg__hub_plan_blocked(UMsgHub *hub, size_t plan_ix) {
+  UMsgTarget *tgt = hub->plan[plan_ix].tgt;
+
+  for(size_t i = 0; i < plan_ix; i++) {
+    if(hub->plan[i].tgt == tgt && !hub->plan[i].sent)
+      return true;
+  }
+
+  return false;
+}
+
+
+/*
+Dispatch a batch of messages from the inbox
+
+Messages for subscriber queues are forwarded with the scheduler suspended so
+that subscribers don't preempt the hub after every message. They wake once
+with the whole batch waiting. Callbacks run afterwards with the scheduler
+active since they may block. Deliveries that can't be queued without blocking
+are retried in order with the normal send timeout.
+
+Args:
+  hub:                Message hub to operate on
+  batch:              Messages received from the inbox
+  batch_len:          Number of messages in batch
+  send_timeout_ticks: Timeout for sending messages to subscribers
+*/
+static void umsg__hub_dispatch_batch(UMsgHub *hub, UMsg *batch, size_t batch_len,
+                                     TickType_t send_timeout_ticks) {
+  if(!umsg__hub_plan_batch(hub, batch, batch_len)) { // No memory for plan
+    for(size_t m = 0; m < batch_len; m++) {
+      umsg__hub_dispatch(hub, &batch[m], send_timeout_ticks);
+    }
+    return;
+  }
+
+  bool blocked = false;
+
+  vTaskSuspendAll();
+    for(size_t i = 0; i < hub->plan_len; i++) {
+      UMsgHubDelivery *d = &hub->plan[i];
+      if(d->tgt->msg_handler_cb || !umsg__tgt_is_queued(d->tgt))
+        continue;
+
+      if(blocked && umsg__hub_plan_blocked(hub, i)) // Preserve message order
+        continue;
+
+      UMsg *msg = &batch[d->msg_ix];
+      bool has_payload = msg->payload_size > 0 && msg->payload;
+      if(has_payload)  // Add reference for subscriber
+        mp_inc_ref((void *)msg->payload);
+
+      if(umsg__tgt_try_send(d->tgt, msg)) {
+        d->sent = true;
+      } else {
+        d->ref_added = has_payload; // Can't free with the scheduler suspended
+        blocked = true;
+      }
+    }
+  xTaskResumeAll();
+
+  // Run callbacks and retry blocked sends
+  for(size_t i = 0; i < hub->plan_len; i++) {
+    UMsgHubDelivery *d = &hub->plan[i];
+    if(d->sent)
+      continue;
+
+    UMsg *msg = &batch[d->msg_ix];
+    if(d->ref_added)  // Remove unused reference
+      mp_dec_ref(mp_sys_pools(), (void *)msg->payload);
+
+    umsg__hub_deliver(d->tgt, msg, send_timeout_ticks);
+  }
+}
+#endif // USE_UMSG_HUB_BATCH
+
+
+#ifdef USE_UMSG_HUB_PRIORITY_LANES
+// ******************** Priority lanes ********************
+
+/*
+Messages sent to a hub are routed to a lane for their priority class. The hub
+task always takes from the highest priority lane with messages waiting. Queued
+lanes share a counting semaphore that is given after every message so the hub
+can block on all lanes at once. Lock-free lanes wake the hub with a task
+notification when it is waiting on them.
+*/
+
+static void umsg__hub_lanes_init(UMsgHub *hub, size_t max_msg) {
+#  ifdef USE_UMSG_LOCK_FREE_INBOX
+  bool have_rings = true;
+  for(size_t i = 0; i < UMSG_PRIORITIES; i++) {
+    if(!umsg_tgt_ring_init(&hub->lanes[i], max_msg))
+      have_rings = false;
+  }
+
+  if(have_rings)
+    return;
+
+  for(size_t i = 0; i < UMSG_PRIORITIES; i++) { // Fall back to queues
+    umsg_tgt_free(&hub->lanes[i]);
+  }
+#  endif
+
+  for(size_t i = 0; i < UMSG_PRIORITIES; i++) {
+    umsg_tgt_queued_init(&hub->lanes[i], max_msg);
+  }
+  hub->lanes_ready = xSemaphoreCreateCounting(UMSG_PRIORITIES * max_msg, 0);
+}
+
+
+// Add a message to its lane without counting failures
+static bool umsg__hub_lane_put(UMsgHub *hub, UMsg *msg, TickType_t timeout_ticks) {
+  UMsgTarget *lane = &hub->lanes[umsg_priority(msg->id)];
+
+#  ifdef PLATFORM_HAS_ATOMICS
+  if(lane->ring)
+    return umsg__ring_send(lane->ring, msg, timeout_ticks);
+#  endif
+
+  if(xQueueSend(lane->q, msg, timeout_ticks) != pdTRUE)
+    return false;
+
+  xSemaphoreGive(hub->lanes_ready);
+  return true;
+}
+
+
+static bool umsg__hub_lane_send(UMsgHub *hub, UMsg *msg, TickType_t timeout_ticks) {
+  bool status = umsg__hub_lane_put(hub, msg, timeout_ticks);
+
+  if(!status) { // Timeout
+    UMsgTarget *lane = &hub->lanes[umsg_priority(msg->id)];
+
+#  ifdef PLATFORM_HAS_ATOMICS
+    if(lane->ring) {
+      atomic_fetch_add_explicit((atomic_uint *)&lane->dropped_messages, 1, memory_order_relaxed);
+      return false;
+    }
+#  endif
+
+taskENTER_CRITICAL();
+    lane->dropped_messages++;
+taskEXIT_CRITICAL();
+  }
+
+  return status;
+}
+
+
+#  ifdef PLATFORM_HAS_ATOMICS
+static bool umsg__hub_ring_lanes_pop(UMsgHub *hub, UMsg *msg) {
+  for(size_t i = 0; i < UMSG_PRIORITIES; i++) {
+    if(umsg__ring_pop(hub->lanes[i].ring, msg))
+      return true;
+  }
+
+  return false;
+}
+
+
+static void umsg__hub_ring_lanes_wait(UMsgHub *hub, unsigned waiting) {
+  for(size_t i = 0; i < UMSG_PRIORITIES; i++) {
+    atomic_store(RING_ATOMIC(hub->lanes[i].ring->waiting), waiting);
+  }
+}
+#  endif
+
+
+static bool umsg__hub_lane_recv(UMsgHub *hub, UMsg *msg, TickType_t timeout_ticks) {
+#  ifdef PLATFORM_HAS_ATOMICS
+  if(hub->lanes[0].ring) {
+    if(umsg__hub_ring_lanes_pop(hub, msg))
+      return true;
+
+    if(timeout_ticks == 0)
+      return false;
+
+    TaskHandle_t consumer = xTaskGetCurrentTaskHandle();
+    for(size_t i = 0; i < UMSG_PRIORITIES; i++) {
+      hub->lanes[i].ring->consumer = consumer;
+    }
+
+    while(1) {
+      umsg__hub_ring_lanes_wait(hub, 1);
+
+      // Check again in case a producer finished before it could see waiting
+      if(umsg__hub_ring_lanes_pop(hub, msg)) {
+        umsg__hub_ring_lanes_wait(hub, 0);
+        return true;
+      }
+
+      if(ulTaskNotifyTake(/*xClearCountOnExit*/ pdTRUE, timeout_ticks) == 0 && timeout_ticks != portMAX_DELAY) {
+        umsg__hub_ring_lanes_wait(hub, 0);
+        return umsg__hub_ring_lanes_pop(hub, msg);
+      }
+
+      if(umsg__hub_ring_lanes_pop(hub, msg)) {
+        umsg__hub_ring_lanes_wait(hub, 0);
+        return true;
+      }
+    }
+  }
+#  endif
+
+  // Every count on the semaphore has a message in a lane
+  if(xSemaphoreTake(hub->lanes_ready, timeout_ticks) != pdTRUE)
+    return false;
+
+  for(size_t i = 0; i < UMSG_PRIORITIES; i++) {
+    if(xQueueReceive(hub->lanes[i].q, msg, 0) == pdTRUE)
+      return true;
+  }
+
+  return false;
+}
+#endif // USE_UMSG_HUB_PRIORITY_LANES
+
+
+// Take the next message from a hub inbox
+static inline bool umsg__hub_recv(UMsgHub *hub, UMsg *msg, TickType_t timeout_ticks) {
+#ifdef USE_UMSG_HUB_PRIORITY_LANES
+  return umsg__hub_lane_recv(hub, msg, timeout_ticks);
+
+#else
+#  ifdef PLATFORM_HAS_ATOMICS
+  if(hub->inbox.ring)
+    return umsg__ring_recv(hub->inbox.ring, msg, timeout_ticks);
+#  endif
+
+  return xQueueReceive(hub->inbox.q, msg, timeout_ticks) == pdTRUE;
+#endif
 }
 
 
@@ -397,38 +1462,52 @@ Args:
   send_timeout: Timeout in milliseconds for sending messages to subscribers
 */
 void umsg_hub_process_inbox(UMsgHub *hub, uint32_t send_timeout) {
-  UMsgTarget *cur;
-  UMsg msg;
   TickType_t send_timeout_ticks;
 
   send_timeout_ticks = (send_timeout == INFINITE_TIMEOUT) ? portMAX_DELAY : pdMS_TO_TICKS(send_timeout);
 
-  while(xQueueReceive(hub->inbox.q, &msg, portMAX_DELAY) == pdTRUE) {
-    // Relay message to subscribers with matching mask
-    for(cur = hub->subscribers; cur; cur = cur->next) {
-      if(umsg__tgt_match_filter(cur, msg.id)) {
+#ifdef USE_UMSG_HUB_BATCH
+  UMsg batch[UMSG_HUB_BATCH_SIZE];
 
-        if(cur->msg_handler_cb) { // Handle message via callback
-          cur->msg_handler_cb(cur, &msg);
+  while(umsg__hub_recv(hub, &batch[0], portMAX_DELAY)) {
+    // Drain whatever else is waiting without blocking
+    size_t batch_len = 1;
+    while(batch_len < UMSG_HUB_BATCH_SIZE && umsg__hub_recv(hub, &batch[batch_len], 0))
+      batch_len++;
 
-        } else if(cur->q) { // Pass message along to subscriber queue
-          if(msg.payload_size > 0 && msg.payload)  // Add reference for subscriber
-            mp_inc_ref((void *)msg.payload);
+#  ifdef USE_UMSG_HUB_INDEX
+    if(hub->index_gen != s_filter_gen)
+      umsg__hub_build_index(hub);
+#  endif
 
-          if(xQueueSend(cur->q, &msg, send_timeout_ticks) != pdTRUE) {
-            report_error(P_ERROR_SYS_MESSAGE_TIMEOUT, 0);
+    for(size_t m = 0; m < batch_len; m++) {
+      umsg__hub_match_reply(hub, &batch[m]);
+    }
 
-            if(msg.payload_size > 0 && msg.payload)  // Remove unused reference
-              mp_free(mp_sys_pools(), (void *)msg.payload);
-          }
-        }
-      }
+    umsg__hub_dispatch_batch(hub, batch, batch_len, send_timeout_ticks);
 
+    for(size_t m = 0; m < batch_len; m++) {
+      if(batch[m].payload_size > 0 && batch[m].payload)  // Remove our reference
+        mp_dec_ref(mp_sys_pools(), (void *)batch[m].payload);
     }
+  }
+
+#else
+  UMsg msg;
+
+  while(umsg__hub_recv(hub, &msg, portMAX_DELAY)) {
+#  ifdef USE_UMSG_HUB_INDEX
+    if(hub->index_gen != s_filter_gen)
+      umsg__hub_build_index(hub);
+#  endif
+
+    umsg__hub_match_reply(hub, &msg);
+    umsg__hub_dispatch(hub, &msg, send_timeout_ticks);
 
     if(msg.payload_size > 0 && msg.payload)  // Remove our reference
-      mp_free(mp_sys_pools(), (void *)msg.payload);
+      mp_dec_ref(mp_sys_pools(), (void *)msg.payload);
   }
+#endif
 }
 
 
@@ -38,6 +38,14 @@ The maximum load factor is set to 93% to minimize wasted space. It can be
 customized by changing the MAX_LOAD_FACTOR() macro to suit application
 specific needs.
 
+A hash configured as concurrent permits lookups without any lock while a
+single writer updates it. Writers are serialized by the caller. Readers use a
+sequence count to detect overlapping updates and retry. Bucket arrays replaced
+by growth are retired until all readers that could still reference them have
+finished. Lock-free readers may call the is_equal() callback on keys that are
+being replaced so keys must be safe to compare at any time. Integer keys
+satisfy this.
+
 
 Reference:
   https://www.sebastiansylvan.com/post/robin-hood-hashing-should-be-your-default-hash-table-implementation/
@@ -55,6 +63,7 @@ Reference:
 #include <stdlib.h>
 #include <stddef.h>
 #include <ctype.h>
+#include <stdatomic.h>
 
 #include "util/dhash.h"
 #include "util/prime_modulus.h"
@@ -86,6 +95,63 @@ Reference:
 #define MAX_LOAD_FACTOR(b) ((b) * 15UL / 16UL)
 
 
+// Number of keys kept in flight by the batch operations. Each group is hashed
+// and prefetched together so the bucket fetches overlap.
+#define DH_BATCH_GROUP  8
+
+
+// Number of attempts made by dh_try_lookup() before giving up on a concurrent
+// hash that is being updated.
+#define DH_READ_TRIES   4
+
+// Let a writer run when dh_lookup() keeps colliding with it. Yielding alone won't
+// help if the writer was preempted by a higher priority reader so FreeRTOS delays.
+#ifndef DH_READ_BACKOFF
+#  if defined USE_FREERTOS
+#    include "FreeRTOS.h"
+#    include "task.h"
+#    define DH_READ_BACKOFF()  vTaskDelay(1)
+#  elif defined __unix__ || defined __MACH__
+#    include <sched.h>
+#    define DH_READ_BACKOFF()  sched_yield()
+#  else
+#    define DH_READ_BACKOFF()
+#  endif
+#endif
+
+// The dhash sequence and reader counts are declared as uint32_t but we use them
+// here as atomic_uint. This avoids the need for stdatomic.h in the public header.
+_Static_assert(sizeof(uint32_t) >= sizeof(atomic_uint), "dhash.seq too small");
+#define DH_ATOMIC(field)  ((atomic_uint *)&(field))
+
+#if defined __GNUC__ || defined __clang__
+#  define dh__prefetch(p)   __builtin_prefetch((p))
+#  define dh__ctz(x)        __builtin_ctz(x)
+#else
+#  define dh__prefetch(p)   ((void)(p))
+static inline int dh__ctz(unsigned x) {
+  int n = 0;
+  while(!(x & 1)) { x >>= 1; n++; }
+  return n;
+}
+#endif
+
+
+// Probe tags are scanned in groups with SIMD instructions when available.
+// Other targets use a portable scalar scan of each group.
+#if defined __SSE2__
+#  include <emmintrin.h>
+#  define DH_TAGS_SSE2
+#elif defined __ARM_NEON && defined __aarch64__
+#  include <arm_neon.h>
+#  define DH_TAGS_NEON
+#endif
+
+#define DH_TAG_GROUP      16  // Number of tags scanned in one step
+#define DH_TAG_DIST_MAX   255 // Probe counts saturate at this value in probe_dists[]
+
+// Live buckets have the upper bit set in their tag. Empty buckets and tombstones are 0.
+#define DH_PROBE_TAG(ikey)  ((uint8_t)(0x80 | ((dhIKey)(ikey) >> 25)))
 
 
 #define PROBE_COUNT_BITS    15
@@ -295,6 +361,237 @@ static inline dhBucketIndex next_bucket(dhash *hash, dhBucketIndex b) {
 
 
 
+// ******************** Probe tags ********************
+
+// When enabled, each bucket has an 8-bit tag taken from its hashed key and a
+// saturated copy of its probe count kept in two dense arrays. Lookups scan these
+// DH_TAG_GROUP buckets at a time and only visit bucket entries with a matching tag.
+// The bucket entries remain authoritative. The tags are a cache of their state.
+//
+// Each array is extended with a mirror of its first DH_TAG_GROUP-1 elements so
+// that a group starting near the end can be loaded without wrapping.
+
+#define PROBE_TAGS_SIZE(n)  (2 * ((size_t)(n) + DH_TAG_GROUP-1))
+
+typedef uint32_t dhTagMask; // One bit per bucket in a tag group
+
+
+static inline void dh__set_probe_tag(dhash *hash, dhBucketIndex b, uint8_t tag, unsigned probes) {
+  if(!hash->probe_tags)
+    return;
+
+  uint8_t dist = probes < DH_TAG_DIST_MAX ? probes : DH_TAG_DIST_MAX;
+
+  // Update the primary element and any mirrors of it past the end
+  for(dhBucketIndex m = b; m < hash->num_buckets + DH_TAG_GROUP-1; m += hash->num_buckets) {
+    hash->probe_tags[m]  = tag;
+    hash->probe_dists[m] = dist;
+  }
+}
+
+
+#if defined DH_TAGS_SSE2 || defined DH_TAGS_NEON
+static const uint8_t s_tag_lane_offsets[DH_TAG_GROUP] = {
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15
+};
+#endif
+
+// Scan a group of tags for a probe sequence starting with "probes" in the first lane.
+// match has bits set for buckets with the same tag and expected probe count.
+// stop has bits set for buckets that end the probe sequence.
+// probes must be at least 1 and no more than DH_TAG_DIST_MAX - DH_TAG_GROUP.
+static inline void dh__match_tag_group(const uint8_t *tags, const uint8_t *dists, uint8_t tag,
+                                        unsigned probes, dhTagMask *match, dhTagMask *stop) {
+#if defined DH_TAGS_SSE2
+  __m128i t = _mm_loadu_si128((const __m128i *)tags);
+  __m128i d = _mm_loadu_si128((const __m128i *)dists);
+  __m128i offsets = _mm_loadu_si128((const __m128i *)s_tag_lane_offsets);
+  __m128i expect = _mm_add_epi8(_mm_set1_epi8((char)probes), offsets);
+  __m128i expect_m1 = _mm_add_epi8(_mm_set1_epi8((char)(probes-1)), offsets);
+
+  __m128i hit = _mm_and_si128(_mm_cmpeq_epi8(t, _mm_set1_epi8((char)tag)),
+                              _mm_cmpeq_epi8(d, expect));
+  // Unsigned d < expect  ==>  max(d, expect-1) == expect-1
+  __m128i lt = _mm_cmpeq_epi8(_mm_max_epu8(d, expect_m1), expect_m1);
+
+  *match = (dhTagMask)_mm_movemask_epi8(hit);
+  *stop  = (dhTagMask)_mm_movemask_epi8(lt);
+
+#elif defined DH_TAGS_NEON
+  static const uint8_t s_lane_bits[DH_TAG_GROUP] = {
+    1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128
+  };
+  uint8x16_t t = vld1q_u8(tags);
+  uint8x16_t d = vld1q_u8(dists);
+  uint8x16_t expect = vaddq_u8(vdupq_n_u8(probes), vld1q_u8(s_tag_lane_offsets));
+  uint8x16_t bits = vld1q_u8(s_lane_bits);
+
+  uint8x16_t hit = vandq_u8(vceqq_u8(t, vdupq_n_u8(tag)), vceqq_u8(d, expect));
+  uint8x16_t lt  = vcltq_u8(d, expect);
+
+  // Emulate movemask by summing lane weights in each half
+  hit = vandq_u8(hit, bits);
+  lt  = vandq_u8(lt, bits);
+  *match = vaddv_u8(vget_low_u8(hit)) | ((dhTagMask)vaddv_u8(vget_high_u8(hit)) << 8);
+  *stop  = vaddv_u8(vget_low_u8(lt))  | ((dhTagMask)vaddv_u8(vget_high_u8(lt)) << 8);
+
+#else
+  dhTagMask m = 0;
+  dhTagMask s = 0;
+
+  for(unsigned i = 0; i < DH_TAG_GROUP; i++) {
+    unsigned expect = probes + i;
+    if(dists[i] < expect)
+      s |= 1ul << i;
+    else if(dists[i] == expect && tags[i] == tag)
+      m |= 1ul << i;
+  }
+
+  *match = m;
+  *stop  = s;
+#endif
+}
+
+
+// ******************** Concurrent access ********************
+
+
+// Start an update to the hash
+static inline void dh__write_begin(dhash *hash) {
+  if(!hash->concurrent)
+    return;
+
+  // Make sequence odd before any bucket data changes
+  atomic_fetch_add_explicit(DH_ATOMIC(hash->seq), 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+}
+
+
+// Free retired memory that is no longer visible to any reader
+static void dh__reclaim(dhash *hash) {
+  // Order prior unlinking of retired memory with the reader counts
+  atomic_thread_fence(memory_order_seq_cst);
+
+  unsigned cur  = atomic_load_explicit(DH_ATOMIC(hash->epoch), memory_order_relaxed) & 1;
+  unsigned prev = cur ^ 1;
+
+  if(atomic_load(DH_ATOMIC(hash->readers[prev])) != 0) // Older readers still active
+    return;
+
+  for(unsigned i = 0; i < hash->num_retired[prev]; i++) {
+    dh__free(hash->retired[prev][i]);
+  }
+  hash->num_retired[prev] = 0;
+
+  // Start a new epoch so the current retired list can drain
+  if(hash->num_retired[cur] > 0)
+    atomic_fetch_add(DH_ATOMIC(hash->epoch), 1);
+}
+
+
+// Finish an update to the hash
+static inline void dh__write_end(dhash *hash) {
+  if(!hash->concurrent)
+    return;
+
+  atomic_fetch_add_explicit(DH_ATOMIC(hash->seq), 1, memory_order_release);
+
+  if(hash->num_retired[0] > 0 || hash->num_retired[1] > 0)
+    dh__reclaim(hash);
+}
+
+
+// Make room for more entries in a retired list
+static bool dh__retired_expand(dhash *hash, unsigned epoch, size_t min_size) {
+  if(hash->max_retired[epoch] >= min_size)
+    return true;
+
+  size_t new_max = hash->max_retired[epoch] > 0 ? hash->max_retired[epoch] * 2 : DH_INIT_RETIRED;
+  while(new_max < min_size)
+    new_max *= 2;
+
+  if(new_max > UINT16_MAX)
+    return false;
+
+  void **new_list = dh__realloc(hash->retired[epoch], new_max * sizeof(void *));
+  if(!new_list)
+    return false;
+
+  hash->retired[epoch] = new_list;
+  hash->max_retired[epoch] = new_max;
+  return true;
+}
+
+
+/*
+Reserve space to retire allocations without failing
+
+The epoch can advance before a pending migration finishes so both lists are
+expanded. The current list keeps growing while older readers are active.
+*/
+static bool dh__retire_reserve(dhash *hash, unsigned num_objs) {
+  if(!hash->concurrent)
+    return true;
+
+  unsigned cur = atomic_load_explicit(DH_ATOMIC(hash->epoch), memory_order_relaxed) & 1;
+
+  return dh__retired_expand(hash, cur, hash->num_retired[cur] + num_objs) &&
+         dh__retired_expand(hash, cur ^ 1, num_objs);
+}
+
+
+// Release memory that lock-free readers may still be accessing
+static void dh__retire(dhash *hash, void *obj) {
+  if(!obj)
+    return;
+
+  if(!hash->concurrent) {
+    dh__free(obj);
+    return;
+  }
+
+  unsigned cur = atomic_load_explicit(DH_ATOMIC(hash->epoch), memory_order_relaxed) & 1;
+
+  // Writers never wait on readers. Space is normally reserved before anything
+  // is unlinked so this only expands the list as a fallback.
+  if(hash->num_retired[cur] >= hash->max_retired[cur] &&
+     !dh__retired_expand(hash, cur, hash->num_retired[cur] + 1)) {
+    // No memory to track it. Leaking is safer than freeing under a reader.
+    return;
+  }
+
+  hash->retired[cur][hash->num_retired[cur]++] = obj;
+}
+
+
+// Register a lock-free reader
+static inline unsigned dh__reader_enter(dhash *hash) {
+  unsigned epoch = atomic_load(DH_ATOMIC(hash->epoch)) & 1;
+  atomic_fetch_add(DH_ATOMIC(hash->readers[epoch]), 1);
+
+  // Counter must be visible before we load any bucket array pointers
+  atomic_thread_fence(memory_order_seq_cst);
+  return epoch;
+}
+
+
+static inline void dh__reader_exit(dhash *hash, unsigned epoch) {
+  atomic_fetch_sub_explicit(DH_ATOMIC(hash->readers[epoch]), 1, memory_order_release);
+}
+
+
+static inline uint32_t dh__read_begin(dhash *hash) {
+  return atomic_load_explicit(DH_ATOMIC(hash->seq), memory_order_acquire);
+}
+
+
+// Check if a writer has changed the hash since dh__read_begin()
+static inline bool dh__read_retry(dhash *hash, uint32_t seq) {
+  atomic_thread_fence(memory_order_acquire);
+  return atomic_load_explicit(DH_ATOMIC(hash->seq), memory_order_relaxed) != seq;
+}
+
+
 // ******************** Resource management ********************
 
 
@@ -331,16 +628,26 @@ static bool dh__alloc_buckets(dhash *hash, size_t new_num_buckets) {
     return false;
 
   void *new_buckets = dh__malloc(new_size); // calloc() wrapper so already zeroed
+  if(!new_buckets)
+    return false;
+
+  uint8_t *new_tags = NULL;
+  if(hash->use_probe_tags) {
+    new_tags = dh__malloc(PROBE_TAGS_SIZE(new_num_buckets));
+    if(!new_tags) {
+      dh__free(new_buckets);
+      return false;
+    }
+  }
 
-  if(new_buckets) {
 //    printf("## ALLOC BKT:  %u  sz:%u\n", new_num_buckets, bucket_size);
-    hash->num_buckets = new_num_buckets;
-    hash->buckets = new_buckets;
+  hash->num_buckets = new_num_buckets;
+  hash->buckets = new_buckets;
 
-    return true;
-  }
+  hash->probe_tags  = new_tags;
+  hash->probe_dists = new_tags ? new_tags + new_num_buckets + DH_TAG_GROUP-1 : NULL;
 
-  return false;
+  return true;
 }
 
 
@@ -362,7 +669,8 @@ static inline bool dh__init(dhash *hash, dhConfig *config, void *ctx, bool new_h
 
   // Restrict memory usage
   if(config->max_storage > 0 && !config->ext_storage) {
-    size_t max_buckets = config->max_storage / (sizeof(dhBucketEntry) + value_size);
+    size_t max_buckets = config->max_storage / (sizeof(dhBucketEntry) + value_size +
+                                                (config->probe_tags ? 2 : 0));
 
     if((size_t)num_buckets > max_buckets)
       return false;
@@ -392,6 +700,10 @@ static inline bool dh__init(dhash *hash, dhConfig *config, void *ctx, bool new_h
 #endif
       .value_size   = value_size,
       .max_storage  = config->max_storage,
+      .use_probe_tags = config->probe_tags,
+      .migrate_step = config->migrate_step,
+      .concurrent   = config->concurrent,
+      .int_keys     = config->int_keys,
       .ctx          = ctx,
       .destroy_item = config->destroy_item,
       .gen_hash     = config->gen_hash,
@@ -406,7 +718,16 @@ static inline bool dh__init(dhash *hash, dhConfig *config, void *ctx, bool new_h
       hash->buckets = config->ext_storage;
 
       size_t bucket_size = sizeof(dhBucketEntry) + value_size;
-      size_t ext_buckets = config->max_storage / bucket_size;
+      size_t ext_size = config->max_storage;
+
+      if(hash->use_probe_tags) { // Tag arrays are placed after the buckets
+        if(ext_size < PROBE_TAGS_SIZE(0) + bucket_size + 2)
+          return false;
+        ext_size -= PROBE_TAGS_SIZE(0);
+        bucket_size += 2;
+      }
+
+      size_t ext_buckets = ext_size / bucket_size;
 
       // Set largest bucket count for our growth scheme
 #ifndef DH_USE_2X_GROWTH
@@ -417,6 +738,12 @@ static inline bool dh__init(dhash *hash, dhConfig *config, void *ctx, bool new_h
 #endif
       hash->static_buckets = true;
 
+      if(hash->use_probe_tags) {
+        hash->probe_tags  = (uint8_t *)config->ext_storage +
+                            hash->num_buckets * (sizeof(dhBucketEntry) + value_size);
+        hash->probe_dists = hash->probe_tags + hash->num_buckets + DH_TAG_GROUP-1;
+      }
+
       //printf("## EXT SIZE: %d  bsz: %d  num: %d\n", config->max_storage, bucket_size, ext_buckets);
       //printf("## EXT HASH STORE: %d  %ld\n", hash->num_buckets, get_prime(hash->prime_ix));
 
@@ -454,7 +781,10 @@ Returns:
   true on success
 */
 bool dh_init(dhash *hash, dhConfig *config, void *ctx) {
-  if(!hash || !config || !config->destroy_item || !config->gen_hash || !config->is_equal)
+  if(!hash || !config || !config->destroy_item)
+    return false;
+
+  if(!config->int_keys && (!config->gen_hash || !config->is_equal))
     return false;
 
   return dh__init(hash, config, ctx, /*new_hash*/true);
@@ -472,6 +802,12 @@ Args:
 void dh_free(dhash *hash) {
   dhBucketEntry *entry;
 
+  if(hash->old) { // Release unmigrated entries
+    dh_free(hash->old);
+    dh__free(hash->old);
+    hash->old = NULL;
+  }
+
   if(!hash->buckets)
     return;
 
@@ -488,11 +824,28 @@ void dh_free(dhash *hash) {
     hash->destroy_item(entry->key, &entry->value_obj, hash->ctx);
   }
 
-  if(!hash->static_buckets)
+  if(!hash->static_buckets) {
     dh__free(hash->buckets);
+    dh__free(hash->probe_tags);
+  }
 
   hash->buckets = NULL;
+  hash->probe_tags = NULL;
+  hash->probe_dists = NULL;
   hash->num_buckets = 0;
+
+  // No readers can be active at this point
+  for(unsigned e = 0; e < 2; e++) {
+    for(unsigned i = 0; i < hash->num_retired[e]; i++) {
+      dh__free(hash->retired[e][i]);
+    }
+    hash->num_retired[e] = 0;
+
+    if(hash->retired[e])
+      dh__free(hash->retired[e]);
+    hash->retired[e] = NULL;
+    hash->max_retired[e] = 0;
+  }
 }
 
 
@@ -519,10 +872,22 @@ static inline dhIKey dh__hash_int(dhIKey ikey) {
 
 // Combine hashes
 static inline dhIKey dh__hash(dhash *hash, dhKey key) {
+  if(hash->int_keys) // Skip callback for integer keys
+    return dh__hash_int((uintptr_t)key.data);
+
   return dh__hash_int(hash->gen_hash(key));
 }
 
 
+// Test keys for equality
+static inline bool dh__keys_equal(dhash *hash, dhKey key1, dhKey key2) {
+  if(hash->int_keys)
+    return (uintptr_t)key1.data == (uintptr_t)key2.data;
+
+  return hash->is_equal(key1, key2, hash->ctx);
+}
+
+
 /*
 Hash a string into an integer key
 
@@ -639,15 +1004,25 @@ bool dh_equal_hash_keys_int(dhKey key1, dhKey key2, void *ctx) {
 
 // ******************** Retrieval ********************
 
+// Test if an occupied bucket holds a key
+static inline bool dh__entry_matches(dhash *hash, dhBucketEntry *entry, dhKey key, dhIKey ikey) {
+  (void)ikey;
+  return !WAS_DELETED(entry) &&
+#ifdef DH_USE_MEMOIZED_HASH
+          entry->ikey == ikey &&
+#endif
+          dh__keys_equal(hash, entry->key, key);
+}
 
-// Search for a bucket with a given key
+
+// Search for a bucket with a given key beginning at bucket b in its probe sequence
 // Returns DH_ERR_KEY_NOT_FOUND if the key was not found
 //         DH_ERR_TOO_MANY_PROBES if probe count exceeded
-static inline dhBucketIndex dh__find_bucket(dhash *hash, dhKey key, dhBucketEntry **found_entry) {
-  dhIKey ikey = dh__hash(hash, key);
-  dhBucketIndex b = dh__initial_probe(hash, ikey);
+static inline dhBucketIndex dh__find_bucket_from(dhash *hash, dhKey key, dhIKey ikey,
+                                                 dhBucketIndex b, uint16_t probes,
+                                                 dhBucketEntry **found_entry) {
   dhBucketEntry *entry = dh__get_entry_unsafe(hash, b);
-  uint16_t probes = 1;
+  (void)ikey;
 
   *found_entry = NULL;
 
@@ -659,7 +1034,7 @@ static inline dhBucketIndex dh__find_bucket(dhash *hash, dhKey key, dhBucketEntr
 #ifdef DH_USE_MEMOIZED_HASH
               entry->ikey == ikey && 
 #endif
-                                     hash->is_equal(entry->key, key, hash->ctx)) {
+                                     dh__keys_equal(hash, entry->key, key)) {
       // Key match found
       *found_entry = entry;
       return b;
@@ -678,6 +1053,123 @@ static inline dhBucketIndex dh__find_bucket(dhash *hash, dhKey key, dhBucketEntr
 }
 
 
+// Search for a bucket by scanning groups of probe tags
+static inline dhBucketIndex dh__find_bucket_tagged(dhash *hash, dhKey key, dhIKey ikey,
+                                                   dhBucketEntry **found_entry) {
+  dhBucketIndex num_buckets = hash->num_buckets;
+  dhBucketIndex b = dh__initial_probe(hash, ikey);
+  uint8_t tag = DH_PROBE_TAG(ikey);
+  unsigned probes = 1;
+
+  *found_entry = NULL;
+
+  // Group scans are exact until expected probe counts reach the saturation limit
+  while(probes + DH_TAG_GROUP-1 < DH_TAG_DIST_MAX) {
+    dhTagMask match, stop;
+    dh__match_tag_group(&hash->probe_tags[b], &hash->probe_dists[b], tag, probes, &match, &stop);
+
+    if(stop) // Ignore candidates past the end of the probe sequence
+      match &= (stop & (~stop + 1)) - 1;
+
+    while(match) {
+      dhBucketIndex mb = b + dh__ctz(match);
+      while(mb >= num_buckets)
+        mb -= num_buckets;
+
+      dhBucketEntry *entry = dh__get_entry_unsafe(hash, mb);
+      if(dh__entry_matches(hash, entry, key, ikey)) {
+        *found_entry = entry;
+        return mb;
+      }
+
+      match &= match - 1;
+    }
+
+    if(stop)
+      return DH_ERR_KEY_NOT_FOUND;
+
+    b += DH_TAG_GROUP;
+    while(b >= num_buckets)
+      b -= num_buckets;
+    probes += DH_TAG_GROUP;
+  }
+
+  // Finish long probe sequences on the bucket entries
+  return dh__find_bucket_from(hash, key, ikey, b, probes, found_entry);
+}
+
+
+// Search for a bucket with a given key and its hash
+static inline dhBucketIndex dh__find_bucket_ex(dhash *hash, dhKey key, dhIKey ikey,
+                                               dhBucketEntry **found_entry) {
+  if(hash->probe_tags)
+    return dh__find_bucket_tagged(hash, key, ikey, found_entry);
+
+  return dh__find_bucket_from(hash, key, ikey, dh__initial_probe(hash, ikey), 1, found_entry);
+}
+
+
+// Search for a bucket with a given key
+// During incremental growth this only searches the current bucket array.
+static inline dhBucketIndex dh__find_bucket(dhash *hash, dhKey key, dhBucketEntry **found_entry) {
+  return dh__find_bucket_ex(hash, key, dh__hash(hash, key), found_entry);
+}
+
+
+// Search for a key in the current and any old bucket array
+static inline dhBucketEntry *dh__find_entry(dhash *hash, dhKey key) {
+  dhBucketEntry *entry;
+  dhIKey ikey = dh__hash(hash, key);
+
+  dh__find_bucket_ex(hash, key, ikey, &entry);
+
+  if(!entry && hash->old) // Not migrated yet
+    dh__find_bucket_ex(hash->old, key, ikey, &entry);
+
+  return entry;
+}
+
+
+// Search a concurrent hash without locking
+// Returns true when the result in found and value is consistent
+static bool dh__lookup_concurrent(dhash *hash, dhKey key, void *value, unsigned max_tries,
+                                  bool *found) {
+  dhash snap;
+
+  for(unsigned tries = 0; tries < max_tries; tries++) {
+    // Readers are only registered while accessing buckets
+    unsigned epoch = dh__reader_enter(hash);
+
+    uint32_t seq = dh__read_begin(hash);
+    if(seq & 1) { // Update in progress
+      dh__reader_exit(hash, epoch);
+      continue;
+    }
+
+    // Take a copy of the bucket array parameters and verify that they weren't
+    // changed by a writer while copying.
+    memcpy(&snap, hash, sizeof(snap));
+    if(dh__read_retry(hash, seq)) {
+      dh__reader_exit(hash, epoch);
+      continue;
+    }
+
+    dhBucketEntry *entry = dh__find_entry(&snap, key);
+    *found = entry && !WAS_DELETED(entry);
+    if(*found && value)
+      memcpy(value, &entry->value_obj, snap.value_size);
+
+    bool valid = !dh__read_retry(hash, seq);
+    dh__reader_exit(hash, epoch);
+
+    if(valid)
+      return true;
+  }
+
+  return false;
+}
+
+
 /*
 Search for a hash entry
 
@@ -693,11 +1185,17 @@ Returns:
   true if item exists and non-NULL in value
 */
 bool dh_lookup(dhash *hash, dhKey key, void *value) {
+  if(hash->concurrent) { // No lock required
+    bool found;
+    // Back off between rounds in case we preempted the writer
+    while(!dh__lookup_concurrent(hash, key, value, DH_READ_TRIES, &found)) {
+      DH_READ_BACKOFF();
+    }
+    return found;
+  }
 
-  dhBucketEntry *entry = NULL;
-  dh__find_bucket(hash, key, &entry);
-  //dhBucketIndex b = dh__find_bucket(hash, key, &entry);
-  //printf("## GOT BUCKET: %d\n", b);
+  dhBucketEntry *entry = dh__find_entry(hash, key);
+  //printf("## GOT ENTRY: %p\n", entry);
 
   if(entry && !WAS_DELETED(entry)) { // Found match
     if(value)
@@ -716,6 +1214,11 @@ This version of dh_lookup() returns a direct pointer to the bucket value data
 rather than a copy. Never save the pointer returned for the value since it
 will become invalid when the dhash grows or the entry is removed.
 
+This is not lock-free on concurrent hashes. The caller must exclude writers.
+Changes made through the value pointer on a concurrent hash must be wrapped
+in :c:func:`dh_modify_begin` and :c:func:`dh_modify_end` so that lock-free
+readers don't copy a partially updated value.
+
 Args:
   hash:   Hash to search
   key:    Key to search
@@ -726,9 +1229,7 @@ Returns:
 */
 bool dh_lookup_in_place(dhash *hash, dhKey key, void **value) {
 
-  dhBucketEntry *entry = NULL;
-  dh__find_bucket(hash, key, &entry);
-  //printf("## GOT BUCKET: %d\n", b);
+  dhBucketEntry *entry = dh__find_entry(hash, key);
 
   if(entry && !WAS_DELETED(entry)) { // Found match
     if(value)
@@ -743,6 +1244,182 @@ bool dh_lookup_in_place(dhash *hash, dhKey key, void **value) {
 }
 
 
+/*
+Search for a hash entry without waiting on writers
+
+On a hash configured as concurrent, a lookup made while a writer is active will spin
+until the update finishes. That can stall a reader indefinitely if it preempts the
+writer on a single core system. This version gives up after a few attempts so that
+the caller can fall back to taking the lock that serializes writers.
+
+For hashes that aren't concurrent this is equivalent to dh_lookup().
+
+Args:
+  hash:   Hash to search
+  key:    Key to search
+  value:  Optional found value matching the key on success
+  found:  true if item exists
+
+Returns:
+  true if the lookup completed without interference from a writer
+*/
+bool dh_try_lookup(dhash *hash, dhKey key, void *value, bool *found) {
+  if(hash->concurrent)
+    return dh__lookup_concurrent(hash, key, value, DH_READ_TRIES, found);
+
+  *found = dh_lookup(hash, key, value);
+  return true;
+}
+
+
+// Interleaved batch lookup. Writers must be excluded on concurrent hashes.
+static size_t dh__lookup_batch(dhash *hash, const dhKey *keys, void **values, bool *found,
+                               size_t num_keys) {
+  dhIKey          ikeys[DH_BATCH_GROUP];
+  dhBucketIndex   buckets[DH_BATCH_GROUP];
+  uint16_t        probes[DH_BATCH_GROUP]; // 0 when probe sequence is finished
+  dhBucketEntry  *hits[DH_BATCH_GROUP];
+  size_t total_found = 0;
+
+  for(size_t base = 0; base < num_keys; base += DH_BATCH_GROUP) {
+    size_t group_len = num_keys - base;
+    if(group_len > DH_BATCH_GROUP)
+      group_len = DH_BATCH_GROUP;
+
+    // Hash all keys and start fetching their initial buckets
+    for(size_t i = 0; i < group_len; i++) {
+      ikeys[i]   = dh__hash(hash, keys[base+i]);
+      buckets[i] = dh__initial_probe(hash, ikeys[i]);
+      probes[i]  = 1;
+      hits[i]    = NULL;
+
+      if(hash->probe_tags) {
+        dh__prefetch(&hash->probe_tags[buckets[i]]);
+        dh__prefetch(&hash->probe_dists[buckets[i]]);
+      } else {
+        dh__prefetch(dh__get_entry_unsafe(hash, buckets[i]));
+      }
+    }
+
+    if(hash->probe_tags) { // Tag scans resolve each key in a few steps
+      for(size_t i = 0; i < group_len; i++)
+        dh__find_bucket_tagged(hash, keys[base+i], ikeys[i], &hits[i]);
+
+    } else {
+      // Advance each probe sequence by one bucket per pass
+      size_t active = group_len;
+      while(active > 0) {
+        for(size_t i = 0; i < group_len; i++) {
+          if(probes[i] == 0)
+            continue;
+
+          dhBucketEntry *entry = dh__get_entry_unsafe(hash, buckets[i]);
+
+          if(!IN_USE(entry) || (probes[i] > PROBE_COUNT(entry))) { // Key not found
+            probes[i] = 0;
+            active--;
+
+          } else if(dh__entry_matches(hash, entry, keys[base+i], ikeys[i])) { // Key match found
+            hits[i] = entry;
+            probes[i] = 0;
+            active--;
+
+          } else if(probes[i] >= MAX_PROBE_COUNT) { // Too many probes
+            probes[i] = 0;
+            active--;
+
+          } else { // Continue linear probe
+            buckets[i] = next_bucket(hash, buckets[i]);
+            probes[i]++;
+            dh__prefetch(dh__get_entry_unsafe(hash, buckets[i]));
+          }
+        }
+      }
+    }
+
+    // Collect results
+    for(size_t i = 0; i < group_len; i++) {
+      if(!hits[i] && hash->old) // Not migrated yet
+        dh__find_bucket_ex(hash->old, keys[base+i], ikeys[i], &hits[i]);
+
+      if(hits[i]) {
+        if(values && values[base+i])
+          memcpy(values[base+i], &hits[i]->value_obj, hash->value_size);
+        total_found++;
+      }
+
+      if(found)
+        found[base+i] = hits[i] != NULL;
+    }
+  }
+
+  return total_found;
+}
+
+
+/*
+Search for multiple hash entries
+
+Keys are processed in groups. All keys in a group are hashed first and their
+initial buckets prefetched. The probe sequences are then advanced one bucket
+at a time in round-robin order so that cache misses on one key overlap with
+work on the others.
+
+On a concurrent hash each key is looked up and validated individually without
+locking. Use :c:func:`dh_lookup_batch_locked` to get the interleaved search when
+writers are already excluded.
+
+Args:
+  hash:     Hash to search
+  keys:     Keys to search
+  values:   Optional array of destinations for found values. Individual entries can be NULL
+  found:    Optional array of flags set true for each key that exists
+  num_keys: Number of keys
+
+Returns:
+  Number of keys found
+*/
+size_t dh_lookup_batch(dhash *hash, const dhKey *keys, void **values, bool *found, size_t num_keys) {
+  if(!hash->concurrent)
+    return dh__lookup_batch(hash, keys, values, found, num_keys);
+
+  // Lock-free lookups are validated individually
+  size_t total_found = 0;
+  for(size_t i = 0; i < num_keys; i++) {
+    bool key_found;
+    dh__lookup_concurrent(hash, keys[i], values ? values[i] : NULL, 0, &key_found);
+    if(found)
+      found[i] = key_found;
+    if(key_found)
+      total_found++;
+  }
+
+  return total_found;
+}
+
+
+/*
+Search for multiple hash entries with writers excluded
+
+This is the same as :c:func:`dh_lookup_batch` but always uses the interleaved
+search. It is not lock-free on concurrent hashes. The caller must hold the
+lock that serializes updates.
+
+Args:
+  hash:     Hash to search
+  keys:     Keys to search
+  values:   Optional array of destinations for found values. Individual entries can be NULL
+  found:    Optional array of flags set true for each key that exists
+  num_keys: Number of keys
+
+Returns:
+  Number of keys found
+*/
+size_t dh_lookup_batch_locked(dhash *hash, const dhKey *keys, void **values, bool *found,
+                              size_t num_keys) {
+  return dh__lookup_batch(hash, keys, values, found, num_keys);
+}
+
 
 // ******************** Storage ********************
 
@@ -784,6 +1461,7 @@ static inline bool dh__insert_ex(dhash *hash, dhKey key, void *value, dhIKey ike
       memcpy(&entry->value_obj, value, hash->value_size);
 
       SET_PROBE_COUNT(entry, probes);
+      dh__set_probe_tag(hash, b, DH_PROBE_TAG(ikey), probes);
       hash->used_buckets++;
       return true;
     }
@@ -792,7 +1470,7 @@ static inline bool dh__insert_ex(dhash *hash, dhKey key, void *value, dhIKey ike
 #ifdef DH_USE_MEMOIZED_HASH
         entry->ikey == ikey &&
 #endif
-                                hash->is_equal(entry->key, key, hash->ctx)) {
+                                dh__keys_equal(hash, entry->key, key)) {
        // Match to existing key: Replace value
       bool replace_ok = true;
       if(hash->replace_item)
@@ -818,6 +1496,7 @@ static inline bool dh__insert_ex(dhash *hash, dhKey key, void *value, dhIKey ike
 
         CLEAR_DELETED(entry); // Clear tombstone
         SET_PROBE_COUNT(entry, probes);
+        dh__set_probe_tag(hash, b, DH_PROBE_TAG(ikey), probes);
         hash->used_buckets++;
         return true;
       }
@@ -832,6 +1511,7 @@ static inline bool dh__insert_ex(dhash *hash, dhKey key, void *value, dhIKey ike
 #endif
       entry->key         = key;
       SET_PROBE_COUNT(entry, probes);
+      dh__set_probe_tag(hash, b, DH_PROBE_TAG(ikey), probes);
 
 #ifdef DH_USE_MEMOIZED_HASH
       ikey   = titem.ikey;
@@ -861,12 +1541,94 @@ static inline bool dh__insert(dhash *hash, dhKey key, void *value) {
 }
 
 
+// ******************** Incremental growth ********************
+
+// When migrate_step is non-zero, growing the hash allocates a new bucket array
+// and moves the current one into hash->old. Every insert and remove then migrates
+// up to migrate_step buckets from the old array to the new one. Lookups search
+// the new array first and fall back to the old one. They never migrate entries
+// so that they remain read-only operations.
+//
+// Migrated entries are left behind as tombstones so the probe sequences for
+// unmigrated entries stay intact. The old array is released once every bucket
+// has been visited.
+
+
+// Move an entry from the old bucket array into the current one
+static void dh__migrate_entry(dhash *hash, dhBucketIndex b) {
+  dhash *old = hash->old;
+  dhBucketEntry *entry = dh__get_entry_unsafe(old, b);
+
+#ifdef DH_USE_MEMOIZED_HASH
+  dh__insert_ex(hash, entry->key, &entry->value_obj, entry->ikey); // Skip rehash of key
+  entry->ikey = 0;
+#else
+  dh__insert(hash, entry->key, &entry->value_obj);
+#endif
+
+  entry->key.data = NULL;
+  entry->key.length = 0;
+
+  SET_DELETED(entry);
+  dh__set_probe_tag(old, b, 0, PROBE_COUNT(entry));
+  old->used_buckets--;
+}
+
+
+// Migrate a number of buckets from the old bucket array
+static void dh__migrate(dhash *hash, dhBucketIndex num_buckets) {
+  dhash *old = hash->old;
+
+  if(!old)
+    return;
+
+  while(num_buckets-- > 0 && hash->migrate_bucket < old->num_buckets) {
+    dhBucketEntry *entry = dh__get_entry_unsafe(old, hash->migrate_bucket);
+
+    if(IN_USE(entry) && !WAS_DELETED(entry))
+      dh__migrate_entry(hash, hash->migrate_bucket);
+
+    hash->migrate_bucket++;
+  }
+
+  if(hash->migrate_bucket >= old->num_buckets || old->used_buckets == 0) { // Finished
+    hash->old = NULL;
+    dh__retire(hash, old->buckets);
+    dh__retire(hash, old->probe_tags);
+    dh__retire(hash, old);
+  }
+}
+
+
+// Finish migrating all entries from the old bucket array
+static inline void dh__migrate_all(dhash *hash) {
+  if(hash->old)
+    dh__migrate(hash, hash->old->num_buckets);
+}
+
+
+// Move a key into the current bucket array if it hasn't been migrated yet
+static inline void dh__migrate_key(dhash *hash, dhKey key, dhIKey ikey) {
+  dhBucketEntry *entry;
+  dhBucketIndex b = dh__find_bucket_ex(hash->old, key, ikey, &entry);
+
+  if(entry)
+    dh__migrate_entry(hash, b);
+}
+
+
 
 // Expand size of hash bucket array
 static inline bool dh__grow(dhash *hash, dhBucketIndex new_buckets) {
   if(hash->static_buckets)
     return false;
 
+  dh__migrate_all(hash); // Only one old bucket array is kept
+
+  // Old buckets, tags, and migration view are retired later
+  if(!dh__retire_reserve(hash, 3))
+    return false;
+
   dhBucketIndex num_old_buckets = hash->num_buckets;
 
   if(new_buckets <= num_old_buckets)
@@ -874,8 +1636,27 @@ static inline bool dh__grow(dhash *hash, dhBucketIndex new_buckets) {
 
   //printf("## GROW HASH: %lu\n", new_buckets);
 
+  dhash *old = NULL;
+  if(hash->migrate_step > 0) { // Keep a view of the current buckets for incremental migration
+    old = dh__malloc(sizeof(*old));
+    if(!old)
+      return false;
+
+    *old = *hash;
+
+    // The old buckets are only accessed through this hash
+    old->concurrent = false;
+    for(unsigned e = 0; e < 2; e++) { // Retired lists stay with the live hash
+      old->retired[e] = NULL;
+      old->num_retired[e] = 0;
+      old->max_retired[e] = 0;
+    }
+  }
+
   // Disconnect bucket array so we can restore it if grow fails
   dhBucketEntry *old_buckets = hash->buckets;
+  uint8_t *old_tags = hash->probe_tags;
+  uint8_t *old_dists = hash->probe_dists;
   hash->buckets = NULL;
 
   dhConfig cfg = {
@@ -892,10 +1673,20 @@ static inline bool dh__grow(dhash *hash, dhBucketIndex new_buckets) {
   // Grow to next prime size
   if(!dh__init(hash, &cfg, hash->ctx, /*new_hash*/false)) {
     hash->buckets = old_buckets; // Restore and abort attempt to grow
+    hash->probe_tags = old_tags;
+    hash->probe_dists = old_dists;
+    dh__free(old);
     printf("\t Hash grow failed\n");
     return false;
   }
 
+  if(old) { // Entries will be moved as the hash is updated
+    hash->old = old;
+    hash->migrate_bucket = 0;
+    dh__migrate(hash, hash->migrate_step);
+    return true;
+  }
+
 //  printf("## GROW: %lu %u + %u -> %u\n", hash->num_buckets, hash->value_size, 
 //    sizeof(dhBucketEntry), sizeof(dhBucketEntry) + hash->value_size);
 
@@ -917,7 +1708,8 @@ static inline bool dh__grow(dhash *hash, dhBucketIndex new_buckets) {
     bkt_off += sizeof(dhBucketEntry) + hash->value_size;
   }
 
-  dh__free(old_buckets);
+  dh__retire(hash, old_buckets);
+  dh__retire(hash, old_tags);
   return true;
 }
 
@@ -937,38 +1729,103 @@ Args:
 Returns:
   true on success
 */
-bool dh_insert(dhash *hash, dhKey key, void *value) {
+
+// Insert with growth of the bucket array as needed
+static bool dh__insert_checked(dhash *hash, dhKey key, void *value, dhIKey ikey) {
+  if(hash->old)
+    dh__migrate(hash, hash->migrate_step);
+
   // Check if we have too much load
-  dhBucketIndex max_buckets = MAX_LOAD_FACTOR(hash->num_buckets); // ~ 90%
+  size_t max_buckets = MAX_LOAD_FACTOR(hash->num_buckets); // ~ 90%
 
-  if(hash->used_buckets >= max_buckets) { // Load is too high
+  if(dh_num_items(hash) >= max_buckets) { // Load is too high
     //printf("#### REHASH %d\n", hash->used_buckets);
     //dh_dump(hash);
+    dh__migrate_all(hash); // Growth outpaced migration
     if(!dh__grow(hash, 0)) return false;
   }
 
-  return dh__insert(hash, key, value);
+  if(hash->old) // Existing key must be replaced in the current bucket array
+    dh__migrate_key(hash, key, ikey);
+
+  return dh__insert_ex(hash, key, value, ikey);
 }
 
 
+bool dh_insert(dhash *hash, dhKey key, void *value) {
+  if(hash->frozen)
+    return false;
+
+  dh__write_begin(hash);
+    bool status = dh__insert_checked(hash, key, value, dh__hash(hash, key));
+  dh__write_end(hash);
+
+  return status;
+}
+
 
 /*
-Remove a hash entry
+Add multiple hash entries
 
-If the value parameter is provided the removed entry is returned.
-Otherwise it is destroyed via the destroy_item() callback.
+Keys are hashed in groups and their initial buckets prefetched before the
+entries are inserted. Insertion proceeds in key order so the result is the
+same as calling :c:func:`dh_insert` on each key. Use :c:func:`dh_reserve_capacity`
+beforehand when most keys are new to avoid repeated growth of the hash.
 
 Args:
-  hash:   Hash to remove from
-  key:    Key for item to remove
-  value:  Optional found value matching the key on success
+  hash:     Hash to insert into
+  keys:     Keys for new values
+  values:   Value objects to associate with each key
+  num_keys: Number of keys
 
 Returns:
-  true on success
+  Number of entries successfully inserted
 */
-bool dh_remove(dhash *hash, dhKey key, void *value) {
+size_t dh_insert_batch(dhash *hash, const dhKey *keys, void **values, size_t num_keys) {
+  dhIKey ikeys[DH_BATCH_GROUP];
+  size_t inserted = 0;
+
+  if(hash->frozen)
+    return 0;
+
+  for(size_t base = 0; base < num_keys; base += DH_BATCH_GROUP) {
+    size_t group_len = num_keys - base;
+    if(group_len > DH_BATCH_GROUP)
+      group_len = DH_BATCH_GROUP;
+
+    // Hash all keys and start fetching their initial buckets
+    for(size_t i = 0; i < group_len; i++) {
+      ikeys[i] = dh__hash(hash, keys[base+i]);
+      dhBucketIndex b = dh__initial_probe(hash, ikeys[i]);
+      dh__prefetch(dh__get_entry_unsafe(hash, b));
+      if(hash->probe_tags)
+        dh__prefetch(&hash->probe_dists[b]);
+    }
+
+    for(size_t i = 0; i < group_len; i++) {
+      // Concurrent readers are only blocked for one insert at a time
+      dh__write_begin(hash);
+        if(dh__insert_checked(hash, keys[base+i], values[base+i], ikeys[i]))
+          inserted++;
+      dh__write_end(hash);
+    }
+  }
+
+  return inserted;
+}
+
+
+
+static bool dh__remove(dhash *hash, dhKey key, void *value) {
+  if(hash->old) {
+    dh__migrate(hash, hash->migrate_step);
+
+    if(hash->old && dh__remove(hash->old, key, value)) // Not migrated yet
+      return true;
+  }
+
   dhBucketEntry *entry = NULL;
-  dh__find_bucket(hash, key, &entry);
+  dhBucketIndex b = dh__find_bucket(hash, key, &entry);
 
   if(entry) { // Bucket found with matching key
     // Return removed value if caller wants to manage it, otherwise destroy it
@@ -984,6 +1841,7 @@ bool dh_remove(dhash *hash, dhKey key, void *value) {
 
     // We need to preserve the probe count so turn this into a tombstone
     SET_DELETED(entry);
+    dh__set_probe_tag(hash, b, 0, PROBE_COUNT(entry));
     hash->used_buckets--;
 
     if(!value)
@@ -998,6 +1856,312 @@ bool dh_remove(dhash *hash, dhKey key, void *value) {
 }
 
 
+/*
+Remove a hash entry
+
+If the value parameter is provided the removed entry is returned.
+Otherwise it is destroyed via the destroy_item() callback.
+
+Args:
+  hash:   Hash to remove from
+  key:    Key for item to remove
+  value:  Optional found value matching the key on success
+
+Returns:
+  true on success
+*/
+bool dh_remove(dhash *hash, dhKey key, void *value) {
+  if(hash->frozen)
+    return false;
+
+  dh__write_begin(hash);
+    bool status = dh__remove(hash, key, value);
+  dh__write_end(hash);
+
+  return status;
+}
+
+
+/*
+Start changing values in place
+
+Values modified through :c:func:`dh_lookup_in_place` or :c:func:`dh_iter_next`
+on a concurrent hash must be bracketed by this and :c:func:`dh_modify_end`.
+Lock-free readers retry until the changes are finished. The caller must
+exclude other writers. This does nothing on hashes that aren't concurrent.
+
+Args:
+  hash:   Hash to modify
+*/
+void dh_modify_begin(dhash *hash) {
+  dh__write_begin(hash);
+}
+
+
+/*
+Finish changing values in place
+
+Args:
+  hash:   Hash being modified
+*/
+void dh_modify_end(dhash *hash) {
+  dh__write_end(hash);
+}
+
+
+// ******************** Bulk construction ********************
+
+// Entry queued for placement by dh__layout()
+typedef struct {
+  dhIKey          ikey;
+  dhBucketIndex   home;     // Initial bucket
+  dhKey           key;
+  void           *value;
+  size_t          order;    // Position in the caller's list
+  bool            deferred; // Insert normally after layout
+} dhLayoutItem;
+
+
+static int dh__layout_cmp(const void *a, const void *b) {
+  const dhLayoutItem *aa = (const dhLayoutItem *)a;
+  const dhLayoutItem *bb = (const dhLayoutItem *)b;
+
+  if(aa->home != bb->home)
+    return aa->home < bb->home ? -1 : 1;
+
+  // Group identical hashes so that duplicate keys are adjacent
+  if(aa->ikey != bb->ikey)
+    return aa->ikey < bb->ikey ? -1 : 1;
+
+  // Keep duplicates in their original order since qsort() isn't stable
+  return aa->order < bb->order ? -1 : (aa->order > bb->order ? 1 : 0);
+}
+
+
+static int dh__layout_order_cmp(const void *a, const void *b) {
+  const dhLayoutItem *aa = (const dhLayoutItem *)a;
+  const dhLayoutItem *bb = (const dhLayoutItem *)b;
+
+  return aa->order < bb->order ? -1 : (aa->order > bb->order ? 1 : 0);
+}
+
+
+// Place items into an empty bucket array in a single pass
+// Entries are sorted by their initial bucket and then assigned to the next free
+// bucket. This produces the same layout as Robin Hood insertion without any
+// displacement. Only the first copy of a duplicate key is placed. Later copies
+// and entries that would wrap past the end of the array are inserted normally
+// afterward in their original order so the last copy wins as with dh_insert().
+static void dh__layout(dhash *hash, dhLayoutItem *items, size_t num_items) {
+  for(size_t i = 0; i < num_items; i++) {
+    items[i].home = dh__initial_probe(hash, items[i].ikey);
+    items[i].order = i;
+    items[i].deferred = false;
+  }
+
+  qsort(items, num_items, sizeof(*items), dh__layout_cmp);
+
+  dhBucketIndex next_free = 0;
+  for(size_t i = 0; i < num_items; i++) {
+    dhLayoutItem *item = &items[i];
+
+    // Check for an earlier copy of this key
+    for(size_t j = i; j-- > 0 && items[j].home == item->home && items[j].ikey == item->ikey; ) {
+      if(dh__keys_equal(hash, items[j].key, item->key)) {
+        item->deferred = true;
+        break;
+      }
+    }
+
+    dhBucketIndex b = MAX(next_free, item->home);
+    unsigned probes = b - item->home + 1;
+
+    if(item->deferred || b >= hash->num_buckets || probes > MAX_PROBE_COUNT) {
+      item->deferred = true;
+      continue;
+    }
+
+    dhBucketEntry *entry = dh__get_entry_unsafe(hash, b);
+#ifdef DH_USE_MEMOIZED_HASH
+    entry->ikey = item->ikey;
+#endif
+    entry->key = item->key;
+    memcpy(&entry->value_obj, item->value, hash->value_size);
+
+    SET_PROBE_COUNT(entry, probes);
+    dh__set_probe_tag(hash, b, DH_PROBE_TAG(item->ikey), probes);
+    hash->used_buckets++;
+
+    next_free = b + 1;
+  }
+
+  // Restore the original order of the remaining items
+  size_t num_deferred = 0;
+  for(size_t i = 0; i < num_items; i++) {
+    if(items[i].deferred)
+      items[num_deferred++] = items[i];
+  }
+
+  qsort(items, num_deferred, sizeof(*items), dh__layout_order_cmp);
+
+  for(size_t i = 0; i < num_deferred; i++) {
+    dh__insert_ex(hash, items[i].key, items[i].value, items[i].ikey);
+  }
+}
+
+
+/*
+Build a hash from a set of entries
+
+This is an alternative to :c:func:`dh_insert_batch` for populating a new hash.
+The bucket array is sized once for all entries and they are placed directly into
+their final buckets without the displacement incurred by individual insertions.
+If the hash isn't empty the entries are inserted normally.
+
+Duplicate keys are handled as with :c:func:`dh_insert`.
+
+Args:
+  hash:     Hash to build
+  keys:     Keys for new values
+  values:   Value objects to associate with each key
+  num_keys: Number of keys
+
+Returns:
+  true on success
+*/
+bool dh_build(dhash *hash, const dhKey *keys, void **values, size_t num_keys) {
+  if(hash->frozen)
+    return false;
+
+  if(dh_num_items(hash) > 0) // Can't lay out around existing entries
+    return dh_insert_batch(hash, keys, values, num_keys) == num_keys;
+
+  if(!dh_reserve_capacity(hash, num_keys))
+    return false;
+
+  dhLayoutItem *items = dh__malloc(num_keys * sizeof(*items));
+  if(!items) // Fall back to one at a time
+    return dh_insert_batch(hash, keys, values, num_keys) == num_keys;
+
+  for(size_t i = 0; i < num_keys; i++) {
+    items[i].ikey  = dh__hash(hash, keys[i]);
+    items[i].key   = keys[i];
+    items[i].value = values[i];
+  }
+
+  dh__write_begin(hash);
+    dh__layout(hash, items, num_keys);
+  dh__write_end(hash);
+
+  dh__free(items);
+  return true;
+}
+
+
+/*
+Make a hash immutable
+
+A frozen hash can only be searched. All subsequent insertions and removals
+will fail. Unless the hash uses external storage, its bucket array is rebuilt
+at the smallest size that holds the current entries with tombstones removed and
+with minimal displacement of each entry.
+
+Args:
+  hash: Hash to freeze
+
+Returns:
+  true on success
+*/
+bool dh_freeze(dhash *hash) {
+  if(hash->frozen)
+    return true;
+
+  dh__write_begin(hash);
+  dh__migrate_all(hash);
+
+  size_t num_items = dh_num_items(hash);
+  dhLayoutItem *items = NULL;
+  if(!hash->static_buckets && num_items > 0 && dh__retire_reserve(hash, 2))
+    items = dh__malloc(num_items * sizeof(*items));
+
+  if(items) { // Compact the bucket array
+    dhBucketEntry *old_buckets = hash->buckets;
+    uint8_t *old_tags = hash->probe_tags;
+    uint8_t *old_dists = hash->probe_dists;
+    dhBucketIndex num_old_buckets = hash->num_buckets;
+#ifndef DH_USE_2X_GROWTH
+    dhBucketIndex old_prime_ix = hash->prime_ix;
+#endif
+
+    dhConfig cfg = {
+      .init_buckets = num_items * 16 / 15 + 1,
+      .value_size   = hash->value_size,
+      .max_storage  = hash->max_storage,
+      .probe_tags   = hash->use_probe_tags,
+      .destroy_item = hash->destroy_item,
+      .gen_hash     = hash->gen_hash,
+      .is_equal     = hash->is_equal,
+      .replace_item = hash->replace_item
+    };
+
+    if(dh__init(hash, &cfg, hash->ctx, /*new_hash*/false)) {
+      if(MAX_LOAD_FACTOR(hash->num_buckets) >= num_items && hash->num_buckets <= num_old_buckets) {
+        size_t n = 0;
+        size_t bkt_off = 0;
+        for(dhBucketIndex b = 0; b < num_old_buckets; b++) {
+          dhBucketEntry *entry = (dhBucketEntry *)((uint8_t *)old_buckets + bkt_off);
+
+          if(IN_USE(entry) && !WAS_DELETED(entry)) {
+#ifdef DH_USE_MEMOIZED_HASH
+            items[n].ikey = entry->ikey;
+#else
+            items[n].ikey = dh__hash(hash, entry->key);
+#endif
+            items[n].key   = entry->key;
+            items[n].value = &entry->value_obj;
+            n++;
+          }
+
+          bkt_off += sizeof(dhBucketEntry) + hash->value_size;
+        }
+
+        dh__layout(hash, items, n);
+        dh__retire(hash, old_buckets);
+        dh__retire(hash, old_tags);
+
+      } else { // No savings. Keep the original array
+        dh__free(hash->buckets);
+        dh__free(hash->probe_tags);
+        hash->buckets = old_buckets;
+        hash->probe_tags = old_tags;
+        hash->probe_dists = old_dists;
+        hash->num_buckets = num_old_buckets;
+        hash->used_buckets = num_items;
+#ifndef DH_USE_2X_GROWTH
+        hash->prime_ix = old_prime_ix;
+#endif
+      }
+
+    } else { // Allocation failed
+      hash->buckets = old_buckets;
+      hash->probe_tags = old_tags;
+      hash->probe_dists = old_dists;
+      hash->num_buckets = num_old_buckets;
+#ifndef DH_USE_2X_GROWTH
+      hash->prime_ix = old_prime_ix;
+#endif
+    }
+
+    dh__free(items);
+  }
+
+  hash->frozen = true;
+  dh__write_end(hash);
+
+  return true;
+}
+
+
 // ******************** Resource utilization ********************
 
 /*
@@ -1010,7 +2174,7 @@ Returns:
   Number of key/value entrys in the hash
 */
 size_t dh_num_items(dhash *hash) {
-  return hash->used_buckets;
+  return hash->used_buckets + (hash->old ? hash->old->used_buckets : 0);
 }
 
 
@@ -1041,7 +2205,7 @@ int dh_load_factor(dhash *hash) {
   if(hash->num_buckets == 0)
     return 0;
 
-  return (hash->used_buckets * 100 + 50) / hash->num_buckets;
+  return (dh_num_items(hash) * 100 + 50) / hash->num_buckets;
 }
 
 
@@ -1070,7 +2234,7 @@ bool dh_reserve_capacity(dhash *hash, size_t add_capacity) {
   if(add_capacity <= free_buckets) // Enough buckets exist
     return true;
 
-  if(hash->static_buckets) // Can't grow
+  if(hash->static_buckets || hash->frozen) // Can't grow
     return false;
 
   add_capacity -= free_buckets;
@@ -1079,7 +2243,11 @@ bool dh_reserve_capacity(dhash *hash, size_t add_capacity) {
   const size_t lfactor = MAX_LOAD_FACTOR(128UL); // Get the numerator
   size_t new_buckets = (hash_capacity + add_capacity) * 128UL / lfactor;
 
-  return dh__grow(hash, new_buckets);
+  dh__write_begin(hash);
+    bool status = dh__grow(hash, new_buckets);
+  dh__write_end(hash);
+
+  return status;
 }
 
 
@@ -1099,20 +2267,23 @@ Returns:
 int dh_mean_probe_count(dhash *hash) {
   int total = 0;
 
-  dhBucketIndex num_buckets = hash->num_buckets;
-  dhBucketEntry *entry;
+  for(dhash *h = hash; h; h = h->old) { // Include unmigrated entries
+    dhBucketIndex num_buckets = h->num_buckets;
+    dhBucketEntry *entry;
 
-  for(dhBucketIndex b = 0; b < num_buckets; b++ ) {
-    entry = dh__get_entry_unsafe(hash, b);
-    if(!IN_USE(entry) || WAS_DELETED(entry)) continue; // Skip unused and tombstones
+    for(dhBucketIndex b = 0; b < num_buckets; b++ ) {
+      entry = dh__get_entry_unsafe(h, b);
+      if(!IN_USE(entry) || WAS_DELETED(entry)) continue; // Skip unused and tombstones
 
-    total += PROBE_COUNT(entry);
+      total += PROBE_COUNT(entry);
+    }
   }
 
   // Scale by 100 to avoid floats on embedded
   int mean = 0;
-  if(hash->used_buckets > 0)
-    mean = ((long)total * 100 + 50) / hash->used_buckets;
+  size_t num_items = dh_num_items(hash);
+  if(num_items > 0)
+    mean = ((long)total * 100 + 50) / num_items;
 
   return mean;
 }
@@ -1129,14 +2300,17 @@ Returns:
 */
 int dh_max_probe_count(dhash *hash) {
   int max_probes = 0;
-  dhBucketIndex num_buckets = hash->num_buckets;
-  dhBucketEntry *entry;
 
-  for(dhBucketIndex b = 0; b < num_buckets; b++ ) {
-    entry = dh__get_entry_unsafe(hash, b);
-    if(!IN_USE(entry) || WAS_DELETED(entry)) continue; // Skip unused and tombstones
+  for(dhash *h = hash; h; h = h->old) { // Include unmigrated entries
+    dhBucketIndex num_buckets = h->num_buckets;
+    dhBucketEntry *entry;
+
+    for(dhBucketIndex b = 0; b < num_buckets; b++ ) {
+      entry = dh__get_entry_unsafe(h, b);
+      if(!IN_USE(entry) || WAS_DELETED(entry)) continue; // Skip unused and tombstones
 
-    max_probes = MAX(max_probes, PROBE_COUNT(entry));
+      max_probes = MAX(max_probes, PROBE_COUNT(entry));
+    }
   }
 
   return max_probes;
@@ -1188,6 +2362,20 @@ void dh_dump(dhash *hash, HashVisitor print_item, void *ctx) {
       print_item(entry->key, &entry->value_obj, ctx);
   }
 
+  if(hash->old) {
+    printf("\nOld buckets (%" PRIBkt "), migrated to %" PRIBkt ":\n", hash->old->num_buckets,
+            hash->migrate_bucket);
+    for(dhBucketIndex b = 0; b < hash->old->num_buckets; b++) {
+      entry = dh__get_entry_unsafe(hash->old, b);
+      if(!IN_USE(entry)) continue;
+
+      dh__dump_entry(hash->old, entry, b);
+
+      if(print_item && !WAS_DELETED(entry))
+        print_item(entry->key, &entry->value_obj, ctx);
+    }
+  }
+
   int mean = dh_mean_probe_count(hash);
   printf("\nMean probes: %d.%d\n", mean / 100, mean % 100);
 }
@@ -1203,15 +2391,17 @@ Args:
   ctx:      Optional user data for the callback
 */
 void dh_foreach(dhash *hash, HashVisitor visitor, void *ctx) {
-  dhBucketIndex num_buckets = hash->num_buckets;
-  dhBucketEntry *entry;
-  for(dhBucketIndex b = 0; b < num_buckets; b++) {
-    entry = dh__get_entry_unsafe(hash, b);
-    if(!IN_USE(entry) || WAS_DELETED(entry))  // Skip unused and tombstones
-      continue;
-
-    if(!visitor(entry->key, &entry->value_obj, ctx))
-      break;
+  for(dhash *h = hash; h; h = h->old) { // Include unmigrated entries
+    dhBucketIndex num_buckets = h->num_buckets;
+    dhBucketEntry *entry;
+    for(dhBucketIndex b = 0; b < num_buckets; b++) {
+      entry = dh__get_entry_unsafe(h, b);
+      if(!IN_USE(entry) || WAS_DELETED(entry))  // Skip unused and tombstones
+        continue;
+
+      if(!visitor(entry->key, &entry->value_obj, ctx))
+        return;
+    }
   }
 }
 
@@ -1239,6 +2429,9 @@ Advance iterator to next entry
 WARNING: Do not hold onto the value pointer in long term storage. It points directly into the
 hash bucket array and will become invalid when the hash grows.
 
+When an incremental migration is in progress the buckets of the old array are
+visited after those of the current array.
+
 Args:
   it:     Iterator to advance
   key:    Key of current item
@@ -1247,19 +2440,25 @@ Returns:
   true when iterator key and value are valid
 */
 bool dh_iter_next(dhIter *it, dhKey *key, void **value) {
-  dhBucketIndex num_buckets = it->hash->num_buckets;
+  dhash *hash = it->hash;
+  dhBucketIndex num_buckets = hash->num_buckets;
+  dhBucketIndex total_buckets = num_buckets + (hash->old ? hash->old->num_buckets : 0);
   dhBucketEntry *entry;
 
   it->bucket++; // Unconditional inc to force rollover from -1 to 0
 
-  if(it->bucket >= num_buckets) { // Exhausted
-    it->bucket = num_buckets;
+  if(it->bucket >= total_buckets) { // Exhausted
+    it->bucket = total_buckets;
     return false;
   }
 
   // Search for next used bucket
-  while(it->bucket < num_buckets) {
-    entry = dh__get_entry_unsafe(it->hash, it->bucket);
+  while(it->bucket < total_buckets) {
+    if(it->bucket < num_buckets)
+      entry = dh__get_entry_unsafe(hash, it->bucket);
+    else // Unmigrated entries
+      entry = dh__get_entry_unsafe(hash->old, it->bucket - num_buckets);
+
     if(IN_USE(entry) && !WAS_DELETED(entry)) {
       *key = entry->key;
       *value = &entry->value_obj;
@@ -23,6 +23,7 @@ DEALINGS IN THE SOFTWARE.
 */
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <stdbool.h>
@@ -49,6 +50,11 @@ DEALINGS IN THE SOFTWARE.
 
 #define SENTINEL_VALUE(chunk) ((uintptr_t)(chunk)->next ^ 0xa5a5a5a5)
 
+// Counters noted as atomic in the public header are declared as uint32_t and
+// accessed here as atomic_uint.
+_Static_assert(sizeof(uint32_t) >= sizeof(atomic_uint), "uint32_t too small for atomic_uint");
+#define MP_ATOMIC(field)  ((atomic_uint *)&(field))
+
 
 // Newlib doesn't support printf() %zu specifier
 #ifdef linux  // x64
@@ -80,14 +86,37 @@ static inline bool is_power_of_2(size_t n) {
 
 #if defined USE_PTHREAD_LOCK || defined USE_ATOMIC_SPINLOCK
 #  define POOLSET_LOCK_INIT(pset) LOCK_INIT(&pset->lock)
-#  define LOCK_POOLS(pset)        LOCK_TAKE(&pset->lock)
-#  define UNLOCK_POOLS(pset)      LOCK_RELEASE(&pset->lock)
+#  define POOLSET_LOCK(pset)      LOCK_TAKE(&pset->lock)
+#  define POOLSET_UNLOCK(pset)    LOCK_RELEASE(&pset->lock)
 
 #else
 // No lock object
 #  define POOLSET_LOCK_INIT(pset)
-#  define LOCK_POOLS(pset)        LOCK_TAKE(0)
-#  define UNLOCK_POOLS(pset)      LOCK_RELEASE(0)
+#  define POOLSET_LOCK(pset)      LOCK_TAKE(0)
+#  define POOLSET_UNLOCK(pset)    LOCK_RELEASE(0)
+#endif
+
+#ifdef USE_MP_TELEMETRY
+// Count lock acquisitions and track the longest hold time. Lock must be held.
+static inline void mp__lock_taken(mpPoolSet *pool_set) {
+  pool_set->lock_count++;
+  if(pool_set->lock_timer)
+    pool_set->lock_start = pool_set->lock_timer();
+}
+
+static inline void mp__lock_releasing(mpPoolSet *pool_set) {
+  if(pool_set->lock_timer) {
+    uint32_t held = pool_set->lock_timer() - pool_set->lock_start;
+    if(held > pool_set->lock_max)
+      pool_set->lock_max = held;
+  }
+}
+
+#  define LOCK_POOLS(pset)    do { POOLSET_LOCK(pset); mp__lock_taken(pset); } while(0)
+#  define UNLOCK_POOLS(pset)  do { mp__lock_releasing(pset); POOLSET_UNLOCK(pset); } while(0)
+#else
+#  define LOCK_POOLS(pset)    POOLSET_LOCK(pset)
+#  define UNLOCK_POOLS(pset)  POOLSET_UNLOCK(pset)
 #endif
 
 
@@ -123,6 +152,719 @@ static inline void mp__unlink_from_prev(mpPool *prev) {
 
 
 
+// ******************** Free list heads ********************
+
+#ifdef USE_MP_LOCK_FREE
+// Lock-free free lists are Treiber stacks. To avoid the ABA problem without a
+// double word CAS the head is a single word holding the element index + 1 in
+// the lower half and a modification tag in the upper half. An index of 0 is an
+// empty list.
+
+#  define MP_TAG_SHIFT    (sizeof(uintptr_t) * 4)
+#  define MP_INDEX_MASK   (((uintptr_t)1 << MP_TAG_SHIFT) - 1)
+
+#  define MP_ATOMIC_HEAD(pool)    ((atomic_uintptr_t *)&(pool)->free_head)
+#  define MP_ATOMIC_NEXT(chunk)   ((_Atomic(mpPoolChunk *) *)&(chunk)->next)
+#  define MP_ATOMIC_MASK(pset)    ((_Atomic mpPoolMask *)&(pset)->avail)
+#  define MP_ATOMIC_SIZE(field)   ((atomic_size_t *)&(field))
+
+// Decode a free list head
+static inline mpPoolChunk *mp__head_chunk(mpPool *pool, uintptr_t head) {
+  uintptr_t index = head & MP_INDEX_MASK;
+  if(index == 0)
+    return NULL;
+
+  return (mpPoolChunk *)((uint8_t *)pool->pool_begin + (index-1) * pool->element_size);
+}
+
+// Encode a new free list head
+static inline uintptr_t mp__head_make(mpPool *pool, mpPoolChunk *chunk, uintptr_t prev_head) {
+  uintptr_t index = 0;
+  if(chunk)
+    index = ((uintptr_t)chunk - (uintptr_t)pool->pool_begin) / pool->element_size + 1;
+
+  uintptr_t tag = (prev_head >> MP_TAG_SHIFT) + 1;
+  return (tag << MP_TAG_SHIFT) | index;
+}
+#endif
+
+
+// Get first element on a pool's free list
+static inline mpPoolChunk *mp__free_head(mpPool *pool) {
+#ifdef USE_MP_LOCK_FREE
+  return mp__head_chunk(pool, atomic_load_explicit(MP_ATOMIC_HEAD(pool), memory_order_acquire));
+#else
+  return pool->free_list;
+#endif
+}
+
+
+// Get next element on a free list
+static inline mpPoolChunk *mp__chunk_next(mpPoolChunk *chunk) {
+#ifdef USE_MP_LOCK_FREE
+  return atomic_load_explicit(MP_ATOMIC_NEXT(chunk), memory_order_relaxed);
+#else
+  return chunk->next;
+#endif
+}
+
+
+
+// ******************** Allocation index ********************
+
+// Pools are indexed in two ways. The by_size array mirrors the sorted pool list
+// so that a bit mask can track which pools have free elements. Each power-of-2
+// size class records the first pool that could satisfy a request in that class
+// so allocation only has to examine pools of nearly the same size. The by_addr
+// array is sorted by address so the pool owning an element can be found with a
+// binary search.
+//
+// The index_gen count is odd while the pool list and index are being modified.
+// With USE_MP_LOCK_FREE the index is read without the lock and index_gen is
+// checked afterward to detect a concurrent rebuild.
+
+// Get the power-of-2 size class for a request
+static inline unsigned mp__size_class(size_t size) {
+  if(size <= 1)
+    return 0;
+  if(size > (1ul << (MP_SIZE_CLASSES-2)))
+    return MP_SIZE_CLASSES-1;
+
+  return 32 - __builtin_clz((uint32_t)(size - 1));  // ceil(log2(size))
+}
+
+
+// Get mask of pools with free elements
+static inline mpPoolMask mp__avail(mpPoolSet *pool_set) {
+#ifdef USE_MP_LOCK_FREE
+  return atomic_load_explicit(MP_ATOMIC_MASK(pool_set), memory_order_relaxed);
+#else
+  return pool_set->avail;
+#endif
+}
+
+
+// Mark a pool as having free elements
+static inline void mp__set_avail(mpPoolSet *pool_set, mpPool *pool) {
+  if(!pool_set->indexed)
+    return;
+
+  mpPoolMask bit = (mpPoolMask)1 << pool->rank;
+#ifdef USE_MP_LOCK_FREE
+  if(!(mp__avail(pool_set) & bit))
+    atomic_fetch_or_explicit(MP_ATOMIC_MASK(pool_set), bit, memory_order_relaxed);
+#else
+  pool_set->avail |= bit;
+#endif
+}
+
+// Mark a pool as empty
+static inline void mp__clear_avail(mpPoolSet *pool_set, mpPool *pool) {
+  if(!pool_set->indexed)
+    return;
+
+  mpPoolMask bit = (mpPoolMask)1 << pool->rank;
+#ifdef USE_MP_LOCK_FREE
+  atomic_fetch_and_explicit(MP_ATOMIC_MASK(pool_set), ~bit, memory_order_relaxed);
+  // An element may have been freed before the bit was cleared
+  if(mp__free_head(pool))
+    atomic_fetch_or_explicit(MP_ATOMIC_MASK(pool_set), bit, memory_order_relaxed);
+#else
+  pool_set->avail &= ~bit;
+#endif
+}
+
+
+// Begin a modification of the pool list. Lock must be held.
+static inline void mp__index_invalidate(mpPoolSet *pool_set) {
+  atomic_fetch_add_explicit(MP_ATOMIC(pool_set->index_gen), 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+}
+
+
+// Rebuild the allocation index after the pool list changes. Lock must be held.
+static void mp__index_pools(mpPoolSet *pool_set) {
+  mpPool *cur;
+  unsigned count = 0;
+  mpPoolMask avail = 0;
+
+  for(cur = pool_set->pools; cur; cur = mp__next(cur)) {
+    if(count >= MP_MAX_INDEXED_POOLS) { // Too many pools
+      pool_set->indexed = false;
+      pool_set->num_indexed = 0;
+      goto done;
+    }
+
+    cur->rank = count;
+    pool_set->by_size[count] = cur;
+    if(mp__free_head(cur))
+      avail |= (mpPoolMask)1 << count;
+    count++;
+  }
+
+  pool_set->indexed = true;
+  pool_set->num_indexed = count;
+
+  // Find first pool that can hold the smallest size in each class
+  unsigned p = 0;
+  for(unsigned c = 0; c < MP_SIZE_CLASSES; c++) {
+    size_t min_size = (c == 0) ? 0 : (1ul << (c-1)) + 1;
+    while(p < count && pool_set->by_size[p]->element_size < min_size) {
+      p++;
+    }
+    pool_set->class_start[c] = p;
+  }
+
+  // Insertion sort by address
+  for(unsigned i = 0; i < count; i++) {
+    cur = pool_set->by_size[i];
+    unsigned j = i;
+    for(; j > 0 && pool_set->by_addr[j-1]->pool_begin > cur->pool_begin; j--) {
+      pool_set->by_addr[j] = pool_set->by_addr[j-1];
+    }
+    pool_set->by_addr[j] = cur;
+  }
+
+done:
+#ifdef USE_MP_LOCK_FREE
+  atomic_store_explicit(MP_ATOMIC_MASK(pool_set), avail, memory_order_relaxed);
+#else
+  pool_set->avail = avail;
+#endif
+
+  // End of modification. Thread caches must refresh their copy of the index.
+  atomic_fetch_add_explicit(MP_ATOMIC(pool_set->index_gen), 1, memory_order_release);
+}
+
+
+#ifdef USE_MP_LOCK_FREE
+// Start a lock-free read of the index. Returns false if it is being modified.
+static inline bool mp__index_read_begin(mpPoolSet *pool_set, uint32_t *gen) {
+  *gen = atomic_load_explicit(MP_ATOMIC(pool_set->index_gen), memory_order_acquire);
+  return (*gen & 1) == 0;
+}
+
+// Check if the index was unchanged during a lock-free read
+static inline bool mp__index_read_valid(mpPoolSet *pool_set, uint32_t gen) {
+  atomic_thread_fence(memory_order_acquire);
+  return atomic_load_explicit(MP_ATOMIC(pool_set->index_gen), memory_order_relaxed) == gen;
+}
+#endif
+
+
+
+// ******************** Element free lists ********************
+
+// Lock must be held when modifying free lists unless USE_MP_LOCK_FREE is enabled
+#ifdef USE_MP_LOCK_FREE
+#  define LOCK_FREE_LISTS(pset)
+#  define UNLOCK_FREE_LISTS(pset)
+#else
+#  define LOCK_FREE_LISTS(pset)   LOCK_POOLS(pset)
+#  define UNLOCK_FREE_LISTS(pset) UNLOCK_POOLS(pset)
+#endif
+
+
+// Allocate an element from a pool. Returns NULL if the pool is empty.
+static inline mpPoolChunk *mp__take_pool_element(mpPoolSet *pool_set, mpPool *pool,
+                                                 size_t *alloc_size) {
+#ifdef USE_MP_LOCK_FREE
+  uintptr_t head = atomic_load_explicit(MP_ATOMIC_HEAD(pool), memory_order_acquire);
+  mpPoolChunk *elem, *next;
+
+  do {
+    elem = mp__head_chunk(pool, head);
+    if(!elem)
+      return NULL;
+    // next is stale if elem was taken by another thread. The tag will then cause the CAS to fail.
+    next = mp__chunk_next(elem);
+  } while(!atomic_compare_exchange_weak_explicit(MP_ATOMIC_HEAD(pool), &head,
+            mp__head_make(pool, next, head), memory_order_acquire, memory_order_acquire));
+
+  if(!next)
+    mp__clear_avail(pool_set, pool);
+
+#  ifdef USE_MP_COLLECT_STATS
+  size_t free_elems = atomic_fetch_sub_explicit(MP_ATOMIC_SIZE(pool->free_elems), 1,
+                                                memory_order_relaxed) - 1;
+  if(free_elems < atomic_load_explicit(MP_ATOMIC_SIZE(pool->min_free_elems), memory_order_relaxed))
+    atomic_store_explicit(MP_ATOMIC_SIZE(pool->min_free_elems), free_elems, memory_order_relaxed);
+#  endif
+
+#else
+  mpPoolChunk *elem = pool->free_list;
+  if(!elem)
+    return NULL;
+
+  pool->free_list = elem->next;
+  if(!pool->free_list)
+    mp__clear_avail(pool_set, pool);
+#  ifdef USE_MP_COLLECT_STATS
+  pool->free_elems--;
+  if(pool->free_elems < pool->min_free_elems)
+    pool->min_free_elems = pool->free_elems;
+#  endif
+#endif
+
+  if(alloc_size)
+    *alloc_size = pool->element_size;
+
+  return elem;
+}
+
+
+// Return an element to its pool
+static inline void mp__put_pool_element(mpPoolSet *pool_set, mpPool *pool, mpPoolChunk *chunk) {
+#ifdef USE_MP_LOCK_FREE
+  uintptr_t head = atomic_load_explicit(MP_ATOMIC_HEAD(pool), memory_order_relaxed);
+  do {
+    mpPoolChunk *next = mp__head_chunk(pool, head);
+    atomic_store_explicit(MP_ATOMIC_NEXT(chunk), next, memory_order_relaxed);
+#  ifdef USE_MP_POINTER_CHECK
+    chunk->sentinel = SENTINEL_VALUE(chunk);
+#  endif
+  } while(!atomic_compare_exchange_weak_explicit(MP_ATOMIC_HEAD(pool), &head,
+            mp__head_make(pool, chunk, head), memory_order_release, memory_order_relaxed));
+
+  mp__set_avail(pool_set, pool);
+#  ifdef USE_MP_COLLECT_STATS
+  atomic_fetch_add_explicit(MP_ATOMIC_SIZE(pool->free_elems), 1, memory_order_relaxed);
+#  endif
+
+#else
+  chunk->next = pool->free_list;
+  pool->free_list = chunk;
+  mp__set_avail(pool_set, pool);
+#  ifdef USE_MP_COLLECT_STATS
+  pool->free_elems++;
+#  endif
+
+#  ifdef USE_MP_POINTER_CHECK
+  chunk->sentinel = SENTINEL_VALUE(chunk);
+#  endif
+#endif
+}
+
+
+// Check if a pool can hold an element. Alignment of 0 is unconstrained.
+static inline bool mp__pool_fits(mpPool *pool, size_t size, size_t alignment) {
+  if(pool->element_size < size || (pool->flags & MP_FLAG_DISABLED))
+    return false;
+
+  mpPoolChunk *head = mp__free_head(pool);
+  if(!head)
+    return false;
+
+  return alignment == 0 || (void *)head == ALIGN_PTR(head, alignment);
+}
+
+
+// Try to take an element from a pool that passed mp__pool_fits()
+static inline mpPoolChunk *mp__take_fitting_element(mpPoolSet *pool_set, mpPool *pool,
+                                                    size_t alignment, size_t *alloc_size) {
+  mpPoolChunk *elem = mp__take_pool_element(pool_set, pool, alloc_size);
+
+#ifdef USE_MP_LOCK_FREE
+  // Free list may have changed after checking alignment
+  if(elem && alignment > 0 && (void *)elem != ALIGN_PTR(elem, alignment)) {
+    mp__put_pool_element(pool_set, pool, elem);
+    elem = NULL;
+  }
+#else
+  (void)alignment;
+#endif
+
+  return elem;
+}
+
+
+/*
+Take an element from the smallest pool with a free element that can hold size
+
+The lock must be held unless USE_MP_LOCK_FREE is enabled.
+
+Args:
+  pool_set    : Set to allocate from
+  size        : Size of the desired element
+  alignment   : Required alignment of the element or 0
+  best_effort : Use the largest available pool if none can hold size
+  alloc_size  : Size of the allocated element
+  alloc_pool  : Pool the element came from
+
+Returns:
+  An allocated element or NULL on failure
+*/
+static mpPoolChunk *mp__take_free_element(mpPoolSet *pool_set, size_t size, size_t alignment,
+                                          bool best_effort, size_t *alloc_size, mpPool **alloc_pool) {
+  mpPoolChunk *elem;
+  mpPool *cur;
+
+  if(pool_set->indexed) {
+    unsigned start = pool_set->class_start[mp__size_class(size)];
+    mpPoolMask avail = mp__avail(pool_set);
+
+    mpPoolMask candidates = start >= MP_MAX_INDEXED_POOLS ? 0 : avail & ~(((mpPoolMask)1 << start) - 1);
+    while(candidates) {
+      cur = pool_set->by_size[__builtin_ctzll(candidates)];
+      if(mp__pool_fits(cur, size, alignment)) {
+        elem = mp__take_fitting_element(pool_set, cur, alignment, alloc_size);
+        if(elem) {
+          *alloc_pool = cur;
+          return elem;
+        }
+      }
+      candidates &= candidates - 1; // Clear lowest bit
+    }
+
+    if(best_effort) { // Fall back to the largest pool with available elements
+      for(candidates = avail; candidates; ) {
+        unsigned rank = 63 - __builtin_clzll(candidates);
+        cur = pool_set->by_size[rank];
+        if(mp__pool_fits(cur, 0, 0)) {
+          elem = mp__take_pool_element(pool_set, cur, alloc_size);
+          if(elem) {
+            *alloc_pool = cur;
+            return elem;
+          }
+        }
+        candidates &= ~((mpPoolMask)1 << rank);
+      }
+    }
+
+    return NULL;
+  }
+
+
+  // Search for non-empty pool with elements >= size
+  mpPool *largest = NULL;
+  for(cur = pool_set->pools; cur; cur = mp__next(cur)) {
+    if(mp__pool_fits(cur, size, alignment)) {
+      elem = mp__take_fitting_element(pool_set, cur, alignment, alloc_size);
+      if(elem) {
+        *alloc_pool = cur;
+        return elem;
+      }
+    } else if(best_effort && mp__pool_fits(cur, 0, 0)) {
+      largest = cur; // Keep track of the most recent pool with available elements
+    }
+  }
+
+  if(largest) {
+    elem = mp__take_pool_element(pool_set, largest, alloc_size);
+    if(elem) {
+      *alloc_pool = largest;
+      return elem;
+    }
+  }
+
+  return NULL;
+}
+
+
+// Take an element from the pool set with the lock held or with a lock-free index lookup
+static mpPoolChunk *mp__alloc_from_pools(mpPoolSet *pool_set, size_t size, size_t alignment,
+                                         bool best_effort, size_t *alloc_size, mpPool **alloc_pool) {
+  mpPoolChunk *alloc;
+  *alloc_pool = NULL;
+
+#ifdef USE_MP_LOCK_FREE
+  uint32_t gen;
+  if(mp__index_read_begin(pool_set, &gen)) {
+    alloc = mp__take_free_element(pool_set, size, alignment, best_effort, alloc_size, alloc_pool);
+    if(alloc || mp__index_read_valid(pool_set, gen))
+      return alloc;
+  }
+  // Pool list changed during the search. Retry with the lock.
+#endif
+
+  LOCK_POOLS(pool_set);
+    alloc = mp__take_free_element(pool_set, size, alignment, best_effort, alloc_size, alloc_pool);
+  UNLOCK_POOLS(pool_set);
+
+  return alloc;
+}
+
+
+
+// ******************** Thread caches ********************
+
+typedef struct mpCacheSlot mpCacheSlot;
+
+#ifdef USE_MP_THREAD_CACHE
+// Each thread has a cache bound to the first pool set it allocates from or frees
+// to. Other pool sets bypass the cache. The cache keeps a private copy of the
+// pool set's index so that it can select a pool for allocation and locate the
+// pool for a freed element without taking the lock. The copy is refreshed when
+// index_gen changes.
+//
+// Elements held in a cache are counted as in use by their pool. Threads should
+// call mp_flush_thread_cache() before exiting or before pools are released.
+// FreeRTOS tasks are flushed by a deletion callback when it is available.
+// Interrupts and code running before the scheduler starts bypass the cache.
+
+struct mpCacheSlot {
+  mpPool       *pool;
+  mpPoolChunk  *chunks;
+  uint8_t       count;
+};
+
+typedef struct {
+  mpPoolSet    *pool_set;   // Set this cache is bound to
+  uint32_t      index_gen;  // Generation of the index copy
+  uint8_t       num_pools;  // 0 when the pool set isn't indexed
+  uint8_t       class_start[MP_SIZE_CLASSES];
+  mpPool       *by_addr[MP_MAX_INDEXED_POOLS];
+  uint8_t       addr_rank[MP_MAX_INDEXED_POOLS]; // Slot for each pool in by_addr
+  mpCacheSlot   slots[MP_MAX_INDEXED_POOLS];     // Cached elements in pool size order
+} mpThreadCache;
+
+#ifdef USE_FREERTOS
+static void mp__cache_sync(mpThreadCache *cache);
+
+#  if configTHREAD_LOCAL_STORAGE_DELETE_CALLBACKS
+// Return a deleted task's cached elements
+static void mp__cache_task_deleted(int index, void *cache) {
+  (void)index;
+  if(((mpThreadCache *)cache)->pool_set)
+    mp__cache_sync(cache);
+  free(cache);
+}
+#  endif
+
+
+// Get the calling task's cache, allocating it when create is set
+static mpThreadCache *mp__thread_cache(bool create) {
+  if(xTaskGetSchedulerState() == taskSCHEDULER_NOT_STARTED || xPortIsInsideInterrupt())
+    return NULL;
+
+  mpThreadCache *cache = pvTaskGetThreadLocalStoragePointer(NULL, MP_THREAD_STORE_CACHE);
+  if(!cache && create) {
+    cache = calloc(1, sizeof *cache);
+    if(!cache)
+      return NULL;
+
+#  if configTHREAD_LOCAL_STORAGE_DELETE_CALLBACKS
+    vTaskSetThreadLocalStoragePointerAndDelCallback(NULL, MP_THREAD_STORE_CACHE, cache,
+                                                    mp__cache_task_deleted);
+#  else
+    vTaskSetThreadLocalStoragePointer(NULL, MP_THREAD_STORE_CACHE, cache);
+#  endif
+  }
+
+  return cache;
+}
+
+
+// Free the calling task's cache. Cached elements must have been returned.
+static void mp__thread_cache_free(mpThreadCache *cache) {
+#  if configTHREAD_LOCAL_STORAGE_DELETE_CALLBACKS
+  vTaskSetThreadLocalStoragePointerAndDelCallback(NULL, MP_THREAD_STORE_CACHE, NULL, NULL);
+#  else
+  vTaskSetThreadLocalStoragePointer(NULL, MP_THREAD_STORE_CACHE, NULL);
+#  endif
+  free(cache);
+}
+
+#else // Pthreads
+static _Thread_local mpThreadCache s_thread_cache;
+
+static inline mpThreadCache *mp__thread_cache(bool create) {
+  (void)create;
+  return &s_thread_cache;
+}
+
+static inline void mp__thread_cache_free(mpThreadCache *cache) {
+  memset(cache, 0, sizeof *cache);
+}
+#endif
+
+
+// Return cached elements to a pool. Lock must be held.
+static void mp__cache_flush_slot(mpPoolSet *pool_set, mpCacheSlot *slot, unsigned count) {
+  while(count-- > 0 && slot->chunks) {
+    mpPoolChunk *chunk = slot->chunks;
+    slot->chunks = chunk->next;
+    slot->count--;
+    mp__put_pool_element(pool_set, slot->pool, chunk);
+  }
+}
+
+
+// Return all cached elements and copy the current pool set index
+static void mp__cache_sync(mpThreadCache *cache) {
+  mpPoolSet *pool_set = cache->pool_set;
+
+  LOCK_POOLS(pool_set);
+    for(unsigned r = 0; r < cache->num_pools; r++) {
+      mpCacheSlot *slot = &cache->slots[r];
+      if(slot->count == 0)
+        continue;
+
+      // Skip pools that have been released from the set
+      bool in_set = false;
+      for(mpPool *cur = pool_set->pools; cur; cur = mp__next(cur)) {
+        if(cur == slot->pool) {
+          in_set = true;
+          break;
+        }
+      }
+
+      if(in_set)
+        mp__cache_flush_slot(pool_set, slot, slot->count);
+    }
+
+    memset(cache->slots, 0, sizeof cache->slots);
+    cache->num_pools = pool_set->indexed ? pool_set->num_indexed : 0;
+    memcpy(cache->class_start, pool_set->class_start, sizeof cache->class_start);
+    for(unsigned i = 0; i < cache->num_pools; i++) {
+      mpPool *pool = pool_set->by_addr[i];
+      cache->by_addr[i] = pool;
+      cache->addr_rank[i] = pool->rank;
+      cache->slots[pool->rank].pool = pool;
+    }
+    cache->index_gen = atomic_load_explicit(MP_ATOMIC(pool_set->index_gen), memory_order_relaxed);
+  UNLOCK_POOLS(pool_set);
+}
+
+
+// Get the calling thread's cache for a pool set
+static inline mpThreadCache *mp__cache_get(mpPoolSet *pool_set) {
+  mpThreadCache *cache = mp__thread_cache(/*create*/true);
+  if(!cache)
+    return NULL;
+
+  if(cache->pool_set != pool_set) {
+    if(cache->pool_set) // Bound to another set
+      return NULL;
+    cache->pool_set = pool_set;
+    cache->index_gen = atomic_load(MP_ATOMIC(pool_set->index_gen)) - 1; // Force sync
+  }
+
+  if(atomic_load_explicit(MP_ATOMIC(pool_set->index_gen), memory_order_acquire) != cache->index_gen)
+    mp__cache_sync(cache);
+
+  return cache->num_pools > 0 ? cache : NULL;
+}
+
+
+// Allocate from a thread cache, refilling from the shared free lists as needed
+static mpPoolChunk *mp__cache_alloc(mpThreadCache *cache, size_t size, size_t *alloc_size,
+                                    mpPool **alloc_pool) {
+  mpPoolSet *pool_set = cache->pool_set;
+
+  for(unsigned r = cache->class_start[mp__size_class(size)]; r < cache->num_pools; r++) {
+    mpCacheSlot *slot = &cache->slots[r];
+    mpPool *pool = slot->pool;
+
+    if(pool->element_size < size || (pool->flags & MP_FLAG_DISABLED))
+      continue;
+
+    if(slot->count == 0) { // Refill
+      LOCK_FREE_LISTS(pool_set);
+        while(slot->count < MP_CACHE_BATCH) {
+          mpPoolChunk *chunk = mp__take_pool_element(pool_set, pool, NULL);
+          if(!chunk)
+            break;
+          chunk->next = slot->chunks;
+          slot->chunks = chunk;
+          slot->count++;
+        }
+      UNLOCK_FREE_LISTS(pool_set);
+
+      if(slot->count == 0) // Pool is exhausted
+        continue;
+    }
+
+    mpPoolChunk *chunk = slot->chunks;
+    slot->chunks = chunk->next;
+    slot->count--;
+
+    if(alloc_size)
+      *alloc_size = pool->element_size;
+    *alloc_pool = pool;
+    return chunk;
+  }
+
+  return NULL;
+}
+
+
+// Find the cache slot for the pool containing an element
+static inline mpCacheSlot *mp__cache_find_slot(mpThreadCache *cache, void *element) {
+  unsigned low = 0;
+  unsigned high = cache->num_pools;
+  while(low < high) {
+    unsigned mid = (low + high) / 2;
+    if(cache->by_addr[mid]->pool_begin <= element)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  if(low > 0 && element < cache->by_addr[low-1]->pool_end)
+    return &cache->slots[cache->addr_rank[low-1]];
+
+  return NULL;
+}
+
+
+// Add a freed element to a thread cache, flushing a batch back to the pool when full
+static void mp__cache_free(mpPoolSet *pool_set, mpCacheSlot *slot, mpPoolChunk *chunk) {
+  chunk->next = slot->chunks;
+  slot->chunks = chunk;
+  slot->count++;
+
+  if(slot->count > MP_CACHE_SIZE) {
+    LOCK_FREE_LISTS(pool_set);
+      mp__cache_flush_slot(pool_set, slot, MP_CACHE_BATCH);
+    UNLOCK_FREE_LISTS(pool_set);
+  }
+}
+#endif // USE_MP_THREAD_CACHE
+
+
+// Return the calling thread's cached elements before pools are released
+static void mp__cache_release(mpPoolSet *pool_set, bool unbind) {
+#ifdef USE_MP_THREAD_CACHE
+  mpThreadCache *cache = mp__thread_cache(/*create*/false);
+
+  if(!cache || cache->pool_set != pool_set)
+    return;
+
+  mp__cache_sync(cache);
+  if(unbind)
+    mp__thread_cache_free(cache);
+#else
+  (void)pool_set;
+  (void)unbind;
+#endif
+}
+
+
+/*
+Return all elements held in the calling thread's cache to their pools
+
+This should be called before a thread exits and before releasing pools
+that the thread has allocated from. FreeRTOS tasks also free their cache
+which is allocated again on the next use.
+*/
+void mp_flush_thread_cache(void) {
+#ifdef USE_MP_THREAD_CACHE
+  mpThreadCache *cache = mp__thread_cache(/*create*/false);
+
+  if(!cache)
+    return;
+
+  if(cache->pool_set)
+    mp__cache_sync(cache);
+#  ifdef USE_FREERTOS
+  mp__thread_cache_free(cache);
+#  endif
+#endif
+}
+
+
+
 static mpPoolSet *s_sys_pool_set = NULL;
 
 // ******************** Resource management ********************
@@ -137,6 +879,22 @@ Returns:
 void mp_init_pool_set(mpPoolSet *pool_set) {
   if(!pool_set) return;
   pool_set->pools = NULL;
+  pool_set->num_indexed = 0;
+  pool_set->indexed = true;
+  pool_set->avail = 0;
+  memset(pool_set->class_start, 0, sizeof pool_set->class_start);
+  atomic_init(MP_ATOMIC(pool_set->index_gen), 0);
+#ifdef USE_MP_COLLECT_STATS
+  pool_set->hist = NULL;
+  atomic_init(MP_ATOMIC(pool_set->sample_count), 0);
+#endif
+#ifdef USE_MP_TELEMETRY
+  atomic_init(MP_ATOMIC(pool_set->alloc_fails), 0);
+  pool_set->lock_count = 0;
+  pool_set->lock_max = 0;
+  pool_set->lock_start = 0;
+  pool_set->lock_timer = NULL;
+#endif
 
   if(!s_sys_pool_set)
     s_sys_pool_set = pool_set;
@@ -181,11 +939,15 @@ Returns:
   true if the pool was released
 */
 bool mp_release_pool(mpPoolSet *pool_set, mpPool *pool, bool release_in_use) {
+  mp__cache_release(pool_set, /*unbind*/false);
+
   LOCK_POOLS(pool_set);
   bool release = release_in_use || !mp_pool_in_use(pool);
 
   if(release) {
+    mp__index_invalidate(pool_set);
     mp__unlink(pool_set, pool);
+    mp__index_pools(pool_set);
 
     if(!(pool->flags & MP_FLAG_STATIC)) // Deallocate dynamic pools
       free(pool);
@@ -211,10 +973,13 @@ bool mp_release_pool_set(mpPoolSet *pool_set, bool release_in_use) {
 
   if(!pool_set) return false;
 
+  mp__cache_release(pool_set, /*unbind*/true);
+
   prev = NULL;
   cur = pool_set->pools;
 
   LOCK_POOLS(pool_set);
+    mp__index_invalidate(pool_set);
     while(cur) {
       release = release_in_use || !mp_pool_in_use(cur);
 
@@ -238,6 +1003,7 @@ bool mp_release_pool_set(mpPoolSet *pool_set, bool release_in_use) {
         release_all = false;
       }
     };
+    mp__index_pools(pool_set);
   UNLOCK_POOLS(pool_set);
 #ifdef USE_MP_COLLECT_STATS
   if(pool_set->hist) {
@@ -289,7 +1055,12 @@ static inline void mp__init_pool(mpPool *pool, size_t elements, size_t element_s
     }
     cur = cur->next;
   }
+#ifdef USE_MP_LOCK_FREE
+  assert(elements <= MP_INDEX_MASK);
+  atomic_init(MP_ATOMIC_HEAD(pool), mp__head_make(pool, (mpPoolChunk *)pool->pool_begin, 0));
+#else
   pool->free_list = (mpPoolChunk *)pool->pool_begin;
+#endif
 }
 
 
@@ -400,6 +1171,7 @@ void mp_add_pool(mpPoolSet *pool_set, mpPool *new_pool) {
 
 
   LOCK_POOLS(pool_set);
+    mp__index_invalidate(pool_set);
     if(!pool_set->pools) { // Empty pool set
       pool_set->pools = new_pool;
 
@@ -412,6 +1184,7 @@ void mp_add_pool(mpPoolSet *pool_set, mpPool *new_pool) {
           } else { // Start of list
             mp__link_head(pool_set, new_pool);
           }
+          mp__index_pools(pool_set);
           UNLOCK_POOLS(pool_set);
           return;
         }
@@ -421,25 +1194,84 @@ void mp_add_pool(mpPoolSet *pool_set, mpPool *new_pool) {
       // Reached end without inserting pool
       mp__link(prev, new_pool);
     }
+    mp__index_pools(pool_set);
   UNLOCK_POOLS(pool_set);
 }
 
 
 // ******************** Object allocation ********************
 
-// Allocate an element from a pool
-static inline mpPoolChunk *mp__take_pool_element(mpPool *pool, size_t *alloc_size) {
-  mpPoolChunk *elem = pool->free_list;
-  pool->free_list = elem->next;
 #ifdef USE_MP_COLLECT_STATS
-  pool->free_elems--;
-  if(pool->free_elems < pool->min_free_elems)
-    pool->min_free_elems = pool->free_elems;
+// Select requests to record in the statistics
+static inline bool mp__sample_request(mpPoolSet *pool_set) {
+#  if MP_STATS_SAMPLE_RATE > 1
+  _Static_assert((MP_STATS_SAMPLE_RATE & (MP_STATS_SAMPLE_RATE-1)) == 0,
+                  "MP_STATS_SAMPLE_RATE must be a power of 2");
+  unsigned count = atomic_fetch_add_explicit(MP_ATOMIC(pool_set->sample_count), 1,
+                                             memory_order_relaxed);
+  return (count & (MP_STATS_SAMPLE_RATE-1)) == 0;
+#  else
+  return true;
+#  endif
+}
 #endif
-  if(alloc_size)
-    *alloc_size = pool->element_size;
 
-  return elem;
+
+/*
+Update statistics for an allocation request
+Args:
+  pool_set    : Set the request was made to
+  pool        : Pool that served the request. NULL on failure
+  size        : Requested size
+  sample_size : Size to record in the pool's request stats
+Returns:
+  Nothing
+*/
+static void mp__record_request(mpPoolSet *pool_set, mpPool *pool, size_t size, size_t sample_size) {
+#ifdef USE_MP_TELEMETRY
+  if(pool) {
+    atomic_fetch_add_explicit(MP_ATOMIC(pool->allocs), 1, memory_order_relaxed);
+    uint32_t in_use = atomic_fetch_add_explicit(MP_ATOMIC(pool->in_use), 1, memory_order_relaxed) + 1;
+    uint32_t peak = atomic_load_explicit(MP_ATOMIC(pool->peak_use), memory_order_relaxed);
+    while(in_use > peak) {
+      if(atomic_compare_exchange_weak_explicit(MP_ATOMIC(pool->peak_use), &peak, in_use,
+                                               memory_order_relaxed, memory_order_relaxed))
+        break;
+    }
+  } else {
+    atomic_fetch_add_explicit(MP_ATOMIC(pool_set->alloc_fails), 1, memory_order_relaxed);
+  }
+#endif
+
+#ifdef USE_MP_COLLECT_STATS
+  if(mp__sample_request(pool_set)) {
+    LOCK_POOLS(pool_set);
+      if(pool_set->hist)
+        histogram_add_sample(pool_set->hist, (int32_t)size);
+      if(pool)
+        stats_add_sample(&pool->req_size, sample_size);
+    UNLOCK_POOLS(pool_set);
+  }
+#else
+  (void)size;
+  (void)sample_size;
+#endif
+}
+
+
+// Allocate an element from the thread cache or a pool
+static mpPoolChunk *mp__alloc_element(mpPoolSet *pool_set, size_t size, size_t *alloc_size,
+                                      mpPool **alloc_pool) {
+#ifdef USE_MP_THREAD_CACHE
+  mpThreadCache *cache = mp__cache_get(pool_set);
+  if(cache) {
+    mpPoolChunk *alloc = mp__cache_alloc(cache, size, alloc_size, alloc_pool);
+    if(alloc)
+      return alloc;
+  }
+#endif
+
+  return mp__alloc_from_pools(pool_set, size, 0, /*best_effort*/false, alloc_size, alloc_pool);
 }
 
 
@@ -454,31 +1286,15 @@ Returns:
 */
 void *mp_alloc(mpPoolSet *pool_set, size_t size, size_t *alloc_size) {
   mpPoolChunk *alloc = NULL;
-  mpPool *cur;
-
-#ifdef USE_MP_COLLECT_STATS
-  histogram_add_sample(pool_set->hist, (int32_t)size);
-#endif
+  mpPool *cur = NULL;
 
   if(alloc_size)
     *alloc_size = 0;
 
   if(!pool_set) return NULL;
 
-  LOCK_POOLS(pool_set);
-    // Search for non-empty pool with elements >= size
-    for(cur = pool_set->pools; cur; cur = mp__next(cur)) {
-      if(cur->free_list && cur->element_size >= size && !(cur->flags & MP_FLAG_DISABLED)) {
-        alloc = mp__take_pool_element(cur, alloc_size);
-        break;
-      }
-    }
-  UNLOCK_POOLS(pool_set);
-
-#ifdef USE_MP_COLLECT_STATS
-  if(alloc)
-    stats_add_sample(&cur->req_size, size);
-#endif
+  alloc = mp__alloc_element(pool_set, size, alloc_size, &cur);
+  mp__record_request(pool_set, alloc ? cur : NULL, size, size);
 
   return (void *)alloc;
 }
@@ -495,35 +1311,16 @@ Returns:
 */
 void *mp_alloc_aligned(mpPoolSet *pool_set, size_t size, size_t *alloc_size, size_t alignment) {
   mpPoolChunk *alloc = NULL;
-  mpPool *cur;
-
-#ifdef USE_MP_COLLECT_STATS
-  histogram_add_sample(pool_set->hist, (int32_t)size);
-#endif
+  mpPool *cur = NULL;
 
   if(alloc_size)
     *alloc_size = 0;
 
   if(!pool_set) return NULL;
 
-  LOCK_POOLS(pool_set);
-    // Search for non-empty pool with elements >= size
-    for(cur = pool_set->pools; cur; cur = mp__next(cur)) {
-      if(cur->free_list && cur->element_size >= size && !(cur->flags & MP_FLAG_DISABLED)) {
-        // Check alignment of this pool
-        mpPoolChunk *aligned = (mpPoolChunk *)ALIGN_PTR(cur->free_list, alignment);
-        if(cur->free_list == aligned) {
-          alloc = mp__take_pool_element(cur, alloc_size);
-          break;
-        }
-      }
-    }
-  UNLOCK_POOLS(pool_set);
-
-#ifdef USE_MP_COLLECT_STATS
-  if(alloc)
-    stats_add_sample(&cur->req_size, size);
-#endif
+  // Search for non-empty pool with elements >= size and a suitably aligned free element
+  alloc = mp__alloc_from_pools(pool_set, size, alignment, /*best_effort*/false, alloc_size, &cur);
+  mp__record_request(pool_set, alloc ? cur : NULL, size, size);
 
   return (void *)alloc;
 }
@@ -540,11 +1337,7 @@ Returns:
 */
 void *mp_alloc_best_effort(mpPoolSet *pool_set, size_t size, size_t *alloc_size) {
   mpPoolChunk *alloc = NULL;
-  mpPool *cur, *alloc_pool = NULL;
-
-#ifdef USE_MP_COLLECT_STATS
-  histogram_add_sample(pool_set->hist, (int32_t)size);
-#endif
+  mpPool *alloc_pool = NULL;
 
   if(alloc_size)
     *alloc_size = 0;
@@ -552,31 +1345,26 @@ void *mp_alloc_best_effort(mpPoolSet *pool_set, size_t size, size_t *alloc_size)
   //printf("mp_alloc_best_effort(%lu)\n", size);
   if(!pool_set) return NULL;
 
-  LOCK_POOLS(pool_set);
-    // Search for non-empty pool with elements >= size
-    for(cur = pool_set->pools; cur; cur = mp__next(cur)) {
-      if(cur->free_list && !(cur->flags & MP_FLAG_DISABLED)) {
-        alloc_pool = cur; // Keep track of the most recent pool with available elements
-        if(cur->element_size >= size) // Found ideal pool
-          break;
-      }
-    }
-
-    if(alloc_pool)
-      alloc = mp__take_pool_element(alloc_pool, alloc_size);
-
-  UNLOCK_POOLS(pool_set);
-
-#ifdef USE_MP_COLLECT_STATS
-  if(alloc_pool)
-    stats_add_sample(&alloc_pool->req_size, alloc_pool->element_size);
-#endif
+  alloc = mp__alloc_from_pools(pool_set, size, 0, /*best_effort*/true, alloc_size, &alloc_pool);
+  if(alloc)
+    mp__record_request(pool_set, alloc_pool, size, alloc_pool->element_size);
+  else
+    mp__record_request(pool_set, NULL, size, 0);
 
   return (void *)alloc;
 }
 
 
-typedef atomic_uint mpRefCount;
+// Header preceding reference counted elements. The owning pool is kept so
+// that references can be released without searching the pool set.
+typedef struct {
+  mpPool     *pool;
+  atomic_uint count;
+} mpRefHeader;
+
+static inline mpRefHeader *mp__ref_header(void *element) {
+  return (mpRefHeader *)((uint8_t *)element - sizeof(mpRefHeader));
+}
 
 /*
 Retrieve a reference counted element from a pool
@@ -591,13 +1379,9 @@ Returns:
 */
 void *mp_alloc_with_ref(mpPoolSet *pool_set, size_t size, size_t *alloc_size) {
   mpPoolChunk *alloc = NULL;
-  mpPool *cur;
-
-  size += sizeof(mpRefCount);
+  mpPool *cur = NULL;
 
-#ifdef USE_MP_COLLECT_STATS
-  histogram_add_sample(pool_set->hist, (int32_t)size);
-#endif
+  size += sizeof(mpRefHeader);
 
   if(alloc_size)
     *alloc_size = 0;
@@ -605,34 +1389,55 @@ void *mp_alloc_with_ref(mpPoolSet *pool_set, size_t size, size_t *alloc_size) {
 
   if(!pool_set) return NULL;
 
-  LOCK_POOLS(pool_set);
-    // Search for non-empty pool with elements >= size
-    for(cur = pool_set->pools; cur; cur = mp__next(cur)) {
-      if(cur->free_list && cur->element_size >= size && !(cur->flags & MP_FLAG_DISABLED)) {
-        alloc = mp__take_pool_element(cur, &real_alloc_size);
-        break;
-      }
-    }
-  UNLOCK_POOLS(pool_set);
+  alloc = mp__alloc_element(pool_set, size, &real_alloc_size, &cur);
+  mp__record_request(pool_set, alloc ? cur : NULL, size, size);
+  if(!alloc)
+    return NULL;
 
-  if(alloc) {
-    if(alloc_size)
-      *alloc_size = real_alloc_size - sizeof(mpRefCount);
-    atomic_init((mpRefCount *)alloc, 1);        // Initial count
-    alloc += sizeof(mpRefCount);  // Return pointer following the reference count
+  if(alloc_size)
+    *alloc_size = real_alloc_size - sizeof(mpRefHeader);
 
-#ifdef USE_MP_COLLECT_STATS
-    stats_add_sample(&cur->req_size, size);
-#endif
-  }
+  mpRefHeader *header = (mpRefHeader *)alloc;
+  header->pool = cur;
+  atomic_init(&header->count, 1); // Initial count
 
-  return (void *)alloc;
+  return (void *)(header + 1);  // Return pointer following the header
 }
 
 
 static inline bool mp__is_ref_counted(mpPool *pool, void *element) {
-  // Ref counted elements have a pointer offset by sizeof(mpRefCount)
-  return (uintptr_t)(element - pool->pool_begin) % pool->element_size == sizeof(mpRefCount);
+  // Ref counted elements have a pointer offset by sizeof(mpRefHeader)
+  return (uintptr_t)(element - pool->pool_begin) % pool->element_size == sizeof(mpRefHeader);
+}
+
+
+// Search the index for the pool an element belongs to
+static inline mpPool *mp__search_pool(mpPoolSet *pool_set, void *element) {
+  mpPool *cur = NULL;
+
+  if(pool_set->indexed) {
+    // Binary search for last pool starting at or before element
+    unsigned low = 0;
+    unsigned high = pool_set->num_indexed;
+    while(low < high) {
+      unsigned mid = (low + high) / 2;
+      if(pool_set->by_addr[mid]->pool_begin <= element)
+        low = mid + 1;
+      else
+        high = mid;
+    }
+
+    if(low > 0 && element < pool_set->by_addr[low-1]->pool_end)
+      cur = pool_set->by_addr[low-1];
+
+  } else {
+    for(cur = pool_set->pools; cur; cur = mp__next(cur)) {
+      if(element >= cur->pool_begin && element < cur->pool_end)
+        break;
+    }
+  }
+
+  return cur;
 }
 
 
@@ -640,11 +1445,17 @@ static inline bool mp__is_ref_counted(mpPool *pool, void *element) {
 static inline mpPool *mp__find_pool(mpPoolSet *pool_set, void *element) {
   mpPool *cur;
 
-  LOCK_POOLS(pool_set);
-  for(cur = pool_set->pools; cur; cur = mp__next(cur)) {
-    if(element >= cur->pool_begin && element < cur->pool_end)
-      break;
+#ifdef USE_MP_LOCK_FREE
+  uint32_t gen;
+  if(mp__index_read_begin(pool_set, &gen)) {
+    cur = mp__search_pool(pool_set, element);
+    if(mp__index_read_valid(pool_set, gen))
+      return cur;
   }
+#endif
+
+  LOCK_POOLS(pool_set);
+    cur = mp__search_pool(pool_set, element);
   UNLOCK_POOLS(pool_set);
   return cur;
 }
@@ -695,7 +1506,7 @@ void *mp_realloc(mpPoolSet *pool_set, void *element, size_t size) {
     return NULL;
 
   if(mp__is_ref_counted(pool, element))
-    size += sizeof(mpRefCount);
+    size += sizeof(mpRefHeader);
 
   if(pool->element_size >= size)  // Already big enough
     return element;
@@ -715,12 +1526,14 @@ void *mp_realloc(mpPoolSet *pool_set, void *element, size_t size) {
 
 /*
 Increment the reference count on an allocated pool object
+
+The caller must already hold a reference so no ordering is needed.
+
 Args:
   element:  Object to increment ref count on
 */
 void mp_inc_ref(void *element) {
-  mpRefCount *ref_count = (mpRefCount *)(element - sizeof(mpRefCount));
-  atomic_fetch_add(ref_count, 1);
+  atomic_fetch_add_explicit(&mp__ref_header(element)->count, 1, memory_order_relaxed);
 }
 
 
@@ -732,57 +1545,139 @@ Returns:
   Current ref count of element
 */
 uint32_t mp_ref_count(void *element) {
-  mpRefCount *ref_count = (mpRefCount *)(element - sizeof(mpRefCount));
-  return atomic_load(ref_count);
+  return atomic_load_explicit(&mp__ref_header(element)->count, memory_order_acquire);
 }
 
 
-
 /*
-Deallocate an element taken from a pool set
+Drop a reference and report if it was the last one
+
 Args:
-  pool_set : Set to return element to
-  element  : Element to free
+  header: Header of a reference counted element
 Returns:
-  true on success.
+  true if the element should be freed
 */
-bool mp_free(mpPoolSet *pool_set, void *element) {
-  if(!pool_set || !element) return false;
+static inline bool mp__drop_ref(mpRefHeader *header) {
+  // Release our writes to the element before another thread can free it and
+  // acquire the writes of earlier droppers in case this is the last reference
+  return atomic_fetch_sub_explicit(&header->count, 1, memory_order_acq_rel) == 1;
+}
+
+
+
+// Return an element to its pool. The thread cache is used when slot is not NULL
+static void mp__put_element(mpPoolSet *pool_set, mpPool *pool, mpCacheSlot *slot, void *element,
+                            bool secure) {
+  if(secure)
+    memset(element, 0, pool->element_size); // Clear data
+
+#ifdef USE_MP_TELEMETRY
+  atomic_fetch_sub_explicit(MP_ATOMIC(pool->in_use), 1, memory_order_relaxed);
+#endif
+
+  // Return element to free list
+  mpPoolChunk *chunk = (mpPoolChunk *)element;
+
+#ifdef USE_MP_THREAD_CACHE
+  if(slot) {
+    mp__cache_free(pool_set, slot, chunk);
+    return;
+  }
+#else
+  (void)slot;
+#endif
+
+  LOCK_FREE_LISTS(pool_set);
+    mp__put_pool_element(pool_set, pool, chunk);
+  UNLOCK_FREE_LISTS(pool_set);
+}
+
+
+// Find the thread cache slot for an element. NULL when the cache doesn't cover it
+static inline mpCacheSlot *mp__element_slot(mpPoolSet *pool_set, void *element) {
+#ifdef USE_MP_THREAD_CACHE
+  mpThreadCache *cache = mp__cache_get(pool_set);
+  if(cache)
+    return mp__cache_find_slot(cache, element);
+#endif
+  return NULL;
+}
+
+
+// Return an element to the thread cache or its pool
+static bool mp__free_element(mpPoolSet *pool_set, void *element, bool secure) {
+  mpPool *pool = NULL;
 
   // Find the pool for this element
-  mpPool *pool = mp__find_pool(pool_set, element);
+  mpCacheSlot *slot = mp__element_slot(pool_set, element);
+#ifdef USE_MP_THREAD_CACHE
+  if(slot)
+    pool = slot->pool;
+#endif
+
+  if(!pool)
+    pool = mp__find_pool(pool_set, element);
+
   if(pool) {
 
     // Check if reference counted
     if(mp__is_ref_counted(pool, element)) {
-      mpRefCount *ref_count = (mpRefCount *)(element - sizeof(mpRefCount));
-      if(atomic_fetch_sub(ref_count, 1) > 1)
+      mpRefHeader *header = mp__ref_header(element);
+      if(!mp__drop_ref(header))
         return true;
 
       // Ref count is zero so free the element
-      element = element - sizeof(mpRefCount);
+      element = header;
     }
 
-    // Return element to free list
-    mpPoolChunk *chunk = (mpPoolChunk *)element;
+    mp__put_element(pool_set, pool, slot, element, secure);
+    return true;
+  }
 
-    LOCK_POOLS(pool_set);
-      chunk->next = pool->free_list;
-      pool->free_list = chunk;
-#ifdef USE_MP_COLLECT_STATS
-      pool->free_elems++;
-#endif
+  //printf("## ERROR: No pool\n");
+  return false;
+}
 
-#ifdef USE_MP_POINTER_CHECK
-      chunk->sentinel = SENTINEL_VALUE(chunk);
-#endif
-    UNLOCK_POOLS(pool_set);
 
-    return true;
-  }
+/*
+Decrement the reference count on an allocated pool object
+
+This is a faster alternative to :c:func:`mp_free` for elements known to be from
+:c:func:`mp_alloc_with_ref`. The owning pool is taken from the element header
+so the pool set isn't searched and no lock is needed unless this drops the
+last reference.
+
+Args:
+  pool_set: Set the element was allocated from
+  element:  Reference counted object to release
+Returns:
+  true if the element was freed
+*/
+bool mp_dec_ref(mpPoolSet *pool_set, void *element) {
+  if(!pool_set || !element) return false;
+
+  mpRefHeader *header = mp__ref_header(element);
+  if(!mp__drop_ref(header))
+    return false;
+
+  mp__put_element(pool_set, header->pool, mp__element_slot(pool_set, header), header,
+                  /*secure*/false);
+  return true;
+}
+
+
+/*
+Deallocate an element taken from a pool set
+Args:
+  pool_set : Set to return element to
+  element  : Element to free
+Returns:
+  true on success.
+*/
+bool mp_free(mpPoolSet *pool_set, void *element) {
+  if(!pool_set || !element) return false;
 
-  //printf("## ERROR: No pool\n");
-  return false;
+  return mp__free_element(pool_set, element, /*secure*/false);
 }
 
 
@@ -797,41 +1692,7 @@ Returns:
 bool mp_free_secure(mpPoolSet *pool_set, void *element) {
   if(!pool_set || !element) return false;
 
-  // Find the pool for this element
-  mpPool *pool = mp__find_pool(pool_set, element);
-  if(pool) {
-
-    // Check if reference counted
-    if(mp__is_ref_counted(pool, element)) {
-      mpRefCount *ref_count = (mpRefCount *)(element - sizeof(mpRefCount));
-      if(atomic_fetch_sub(ref_count, 1) > 1)
-        return true;
-
-      // Ref count is zero so free the element
-      element = element - sizeof(mpRefCount);
-    }
-
-    memset(element, 0, pool->element_size); // Clear data
-
-    // Return element to free list
-    mpPoolChunk *chunk = (mpPoolChunk *)element;
-
-    LOCK_POOLS(pool_set);
-      chunk->next = pool->free_list;
-      pool->free_list = chunk;
-#ifdef USE_MP_COLLECT_STATS
-      pool->free_elems++;
-#endif
-
-#ifdef USE_MP_POINTER_CHECK
-      chunk->sentinel = SENTINEL_VALUE(chunk);
-#endif
-    UNLOCK_POOLS(pool_set);
-
-    return true;
-  }
-
-  return false;
+  return mp__free_element(pool_set, element, /*secure*/true);
 }
 
 
@@ -874,6 +1735,189 @@ size_t mp_get_size(mpPoolSet *pool_set, void *element) {
 
 
 
+// ******************** Arena allocation ********************
+
+// Alignment for arena allocations
+#define MP_ARENA_ALIGN  _Alignof(max_align_t)
+
+/*
+Initialize an arena using an element from a pool set
+Args:
+  arena    : Arena to initialize
+  pool_set : Set to allocate the arena buffer from
+  size     : Minimum size of the arena. Use 0 for the largest available element
+Returns:
+  true on success
+*/
+bool mp_arena_init(mpArena *arena, mpPoolSet *pool_set, size_t size) {
+  size_t alloc_size;
+
+  memset(arena, 0, sizeof *arena);
+
+  if(size > 0)
+    arena->buf = mp_alloc(pool_set, size, &alloc_size);
+  else
+    arena->buf = mp_alloc_best_effort(pool_set, SIZE_MAX, &alloc_size);
+
+  if(!arena->buf)
+    return false;
+
+  arena->buf_size = alloc_size;
+  arena->pool_set = pool_set;
+  return true;
+}
+
+
+/*
+Initialize an arena using a static buffer
+Args:
+  arena    : Arena to initialize
+  buf      : Buffer for the arena
+  buf_size : Size of buf
+*/
+void mp_arena_init_static(mpArena *arena, uint8_t *buf, size_t buf_size) {
+  arena->buf      = buf;
+  arena->buf_size = buf_size;
+  arena->used     = 0;
+  arena->pool_set = NULL;
+}
+
+
+/*
+Release an arena buffer back to its pool set
+Args:
+  arena : Arena to free
+*/
+void mp_arena_free(mpArena *arena) {
+  if(arena->pool_set && arena->buf)
+    mp_free(arena->pool_set, arena->buf);
+
+  memset(arena, 0, sizeof *arena);
+}
+
+
+/*
+Allocate memory from an arena
+Args:
+  arena : Arena to allocate from
+  size  : Size of the allocation
+Returns:
+  An allocation aligned for any object or NULL if the arena is full
+*/
+void *mp_arena_alloc(mpArena *arena, size_t size) {
+  uintptr_t base  = (uintptr_t)arena->buf;
+  uintptr_t begin = ROUND_UP_ALIGN(base + arena->used, MP_ARENA_ALIGN);
+
+  if(begin - base > arena->buf_size || size > arena->buf_size - (begin - base))
+    return NULL;
+
+  arena->used = (begin - base) + size;
+  return (void *)begin;
+}
+
+
+
+#ifdef USE_MP_TELEMETRY
+// ******************** Telemetry ********************
+
+// Read the counters for a pool
+static void mp__pool_telemetry(mpPool *pool, mpPoolTelemetry *tm) {
+  tm->element_size = pool->element_size;
+  tm->elements = mp_total_elements(pool);
+  tm->allocs = atomic_load_explicit(MP_ATOMIC(pool->allocs), memory_order_relaxed);
+  tm->in_use = atomic_load_explicit(MP_ATOMIC(pool->in_use), memory_order_relaxed);
+  tm->peak_use = atomic_load_explicit(MP_ATOMIC(pool->peak_use), memory_order_relaxed);
+}
+
+
+/*
+Set a timestamp source for measuring lock hold times
+
+The timer units are arbitrary. Lock hold times are not measured when no timer
+is set.
+
+Args:
+  pool_set : Set to configure
+  timer    : Function returning a free running timestamp. NULL to disable
+Returns:
+  Nothing
+*/
+void mp_set_lock_timer(mpPoolSet *pool_set, mpTimer timer) {
+  if(!pool_set) return;
+
+  LOCK_POOLS(pool_set);
+    pool_set->lock_timer = timer;
+    pool_set->lock_start = timer ? timer() : 0;
+  UNLOCK_POOLS(pool_set);
+}
+
+
+/*
+Get telemetry counters for a pool set
+Args:
+  pool_set : Set to read from
+  tm       : Snapshot of the counters
+Returns:
+  Nothing
+*/
+void mp_get_telemetry(mpPoolSet *pool_set, mpSetTelemetry *tm) {
+  tm->alloc_fails = atomic_load_explicit(MP_ATOMIC(pool_set->alloc_fails), memory_order_relaxed);
+  LOCK_POOLS(pool_set);
+    tm->lock_count = pool_set->lock_count;
+    tm->lock_max = pool_set->lock_max;
+  UNLOCK_POOLS(pool_set);
+}
+
+
+/*
+Get telemetry counters for a pool
+Args:
+  pool_set : Set containing the pool
+  pool_ix  : Index of the pool in size order
+  tm       : Snapshot of the counters
+Returns:
+  true if the pool exists
+*/
+bool mp_get_pool_telemetry(mpPoolSet *pool_set, unsigned pool_ix, mpPoolTelemetry *tm) {
+  mpPool *cur = pool_set->pools;
+  while(cur && pool_ix-- > 0)
+    cur = mp__next(cur);
+
+  if(!cur)
+    return false;
+
+  mp__pool_telemetry(cur, tm);
+  return true;
+}
+
+
+/*
+Restart telemetry collection
+
+Allocation counts, failures, and lock stats are cleared. High-water marks are
+reset to the current number of elements in use.
+
+Args:
+  pool_set : Set to reset
+Returns:
+  Nothing
+*/
+void mp_reset_telemetry(mpPoolSet *pool_set) {
+  for(mpPool *cur = pool_set->pools; cur; cur = mp__next(cur)) {
+    atomic_store_explicit(MP_ATOMIC(cur->allocs), 0, memory_order_relaxed);
+    uint32_t in_use = atomic_load_explicit(MP_ATOMIC(cur->in_use), memory_order_relaxed);
+    atomic_store_explicit(MP_ATOMIC(cur->peak_use), in_use, memory_order_relaxed);
+  }
+
+  atomic_store_explicit(MP_ATOMIC(pool_set->alloc_fails), 0, memory_order_relaxed);
+  LOCK_POOLS(pool_set);
+    pool_set->lock_count = 0;
+    pool_set->lock_max = 0;
+  UNLOCK_POOLS(pool_set);
+}
+#endif // USE_MP_TELEMETRY
+
+
 // ******************** Utility ********************
 
 /*
@@ -916,11 +1960,11 @@ size_t mp_total_free_elements(mpPool *pool) {
   return pool->free_elems;
 #else
   size_t free_count = 0;
-  mpPoolChunk *cur = pool->free_list;
+  mpPoolChunk *cur = mp__free_head(pool);
 
   while(cur) {
     free_count++;
-    cur = cur->next;
+    cur = mp__chunk_next(cur);
   }
 
   return free_count;
@@ -954,7 +1998,7 @@ void mp_summary(mpPoolSet *pool_set) {
     size_t flist_count = 0;
     bool good_free_list = true;
     LOCK_POOLS(pool_set);
-      for(mpPoolChunk *elem = cur->free_list; elem; elem = elem->next) {
+      for(mpPoolChunk *elem = mp__free_head(cur); elem; elem = mp__chunk_next(elem)) {
         flist_count++;
 #ifdef USE_MP_POINTER_CHECK
         uintptr_t check = SENTINEL_VALUE(elem);
@@ -1012,7 +2056,24 @@ void mp_summary(mpPoolSet *pool_set) {
         fputs(" Disabled", stdout);
     }
     puts("");
+
+#ifdef USE_MP_TELEMETRY
+    mpPoolTelemetry ptm;
+    mp__pool_telemetry(cur, &ptm);
+    printf("\tAllocs: %6" PRIu32 "\t\t\tIn use: %" PRIu32 " (Peak %" PRIu32 ")\n",
+            ptm.allocs, ptm.in_use, ptm.peak_use);
+#endif
   }
+
+#ifdef USE_MP_TELEMETRY
+  mpSetTelemetry tm;
+  mp_get_telemetry(pool_set, &tm);
+  printf("\nFailed requests: %" PRIu32 "\n", tm.alloc_fails);
+  printf("Lock count: %" PRIu32, tm.lock_count);
+  if(pool_set->lock_timer)
+    printf("\tMax hold: %" PRIu32, tm.lock_max);
+  puts("");
+#endif
 }
 
 
@@ -1030,3 +2091,365 @@ void mp_plot_stats(mpPoolSet *pool_set) {
 #endif
 }
 
+
+#ifdef USE_MP_COLLECT_STATS
+// ******************** Pool analysis ********************
+
+/*
+Get the largest request size counted in a histogram bin
+Args:
+  hist : Histogram of request sizes
+  bin  : Bin index
+Returns:
+  Upper bound on requests in the bin
+*/
+static inline size_t mp__bin_size(Histogram *hist, size_t bin) {
+  int32_t size = hist->bin_low + (int32_t)(bin+1) * hist->bin_step - 1;
+  if(size > hist->bin_high)
+    size = hist->bin_high;
+
+  return size > 0 ? (size_t)size : 1;
+}
+
+
+/*
+Get the number of histogram bins holding in-range samples
+Args:
+  hist : Histogram of request sizes
+Returns:
+  Bin count excluding any overflow bin
+*/
+static inline size_t mp__hist_bins(Histogram *hist) {
+  return hist->track_overflow ? hist->num_bins-1 : hist->num_bins;
+}
+
+
+/*
+Estimate the peak element demand on a pool from its request statistics
+Args:
+  pool : Pool to evaluate
+Returns:
+  Request size covering most of the requests served by the pool
+*/
+static size_t mp__demand_size(mpPool *pool) {
+  SampleDatum scale = stats_fp_scale(&pool->req_size);
+  SampleDatum size = stats_mean(&pool->req_size) + 2*stats_std_dev(&pool->req_size);
+  size_t demand = (size_t)((size + scale-1) / scale);
+
+  return (demand > 0 && demand < pool->element_size) ? demand : pool->element_size;
+}
+
+
+/*
+Find the smallest proposed pool that can hold a request
+Args:
+  geom      : Array of proposed pools sorted by size
+  num_pools : Number of entries in geom
+  size      : Request size
+Returns:
+  Index into geom. The largest pool is used when none fit.
+*/
+static size_t mp__fit_geometry(mpPoolGeometry *geom, size_t num_pools, size_t size) {
+  for(size_t i = 0; i < num_pools; i++) {
+    if(geom[i].element_size >= size)
+      return i;
+  }
+  return num_pools-1;
+}
+
+
+/*
+Propose a new set of pools from collected allocation statistics
+
+Element sizes are chosen from the request histogram to minimize the total
+bytes wasted by rounding each observed request up to the next pool size.
+Bins are represented by the largest request they can hold so every sampled
+request fits one of the proposed pools.
+
+Element counts are derived from the peak number of elements used in each
+existing pool. The peak is distributed over the new pools according to which
+histogram bins the old pool served and then padded by ``MP_ANALYZE_HEADROOM``
+percent.
+
+Args:
+  pool_set  : Set to analyze. Must have a histogram attached
+  geom      : Array of proposed pools sorted by size
+  max_pools : Maximum number of entries to fill in geom
+  alignment : Alignment applied to element sizes (Must be a power of 2)
+Returns:
+  Number of proposed pools in geom. 0 when there are no statistics available
+*/
+size_t mp_analyze_pools(mpPoolSet *pool_set, mpPoolGeometry *geom, size_t max_pools, size_t alignment) {
+  assert(is_power_of_2(alignment) && alignment >= 1);
+
+  if(!pool_set || !pool_set->hist || !geom || max_pools == 0)
+    return 0;
+
+  Histogram *hist = pool_set->hist;
+  size_t hist_bins = mp__hist_bins(hist);
+
+  // Collect distinct candidate sizes with their request counts
+  size_t num_sizes = 0;
+  for(size_t i = 0; i < hist_bins; i++) {
+    if(hist->bins[i] > 0)
+      num_sizes++;
+  }
+
+  if(num_sizes == 0)
+    return 0;
+
+  size_t max_k = max_pools < num_sizes ? max_pools : num_sizes;
+
+  // Scratch storage for candidates, prefix sums, and the DP tables
+  size_t     *sizes   = malloc(num_sizes * sizeof(size_t));
+  uint64_t   *weights = malloc((num_sizes+1) * sizeof(uint64_t));
+  uint64_t   *bytes   = malloc((num_sizes+1) * sizeof(uint64_t));
+  uint64_t   *cost    = malloc(max_k * num_sizes * sizeof(uint64_t));
+  size_t     *split   = malloc(max_k * num_sizes * sizeof(size_t));
+
+  size_t num_pools = 0;
+  if(!sizes || !weights || !bytes || !cost || !split)
+    goto cleanup;
+
+  num_sizes = 0;
+  weights[0] = 0;
+  bytes[0] = 0;
+  for(size_t i = 0; i < hist_bins; i++) {
+    if(hist->bins[i] == 0)
+      continue;
+
+    size_t size = mp__bin_size(hist, i);
+    if(size < sizeof(mpPoolChunk))
+      size = sizeof(mpPoolChunk);
+    size = ROUND_UP_ALIGN(size, alignment);
+
+    if(num_sizes > 0 && sizes[num_sizes-1] == size) { // Merge with previous bin
+      weights[num_sizes] += hist->bins[i];
+      bytes[num_sizes]   += (uint64_t)hist->bins[i] * size;
+      continue;
+    }
+
+    sizes[num_sizes] = size;
+    weights[num_sizes+1] = weights[num_sizes] + hist->bins[i];
+    bytes[num_sizes+1]   = bytes[num_sizes] + (uint64_t)hist->bins[i] * size;
+    num_sizes++;
+  }
+
+  if(max_k > num_sizes)
+    max_k = num_sizes;
+
+  // Waste from serving candidates [a, b] with a pool of sizes[b]
+#define GROUP_WASTE(a, b)  (sizes[b] * (weights[(b)+1] - weights[a]) - (bytes[(b)+1] - bytes[a]))
+#define COST(k, b)   cost[(k)*num_sizes + (b)]
+#define SPLIT(k, b)  split[(k)*num_sizes + (b)]
+
+  // COST(k, b) is the least waste covering candidates [0, b] with k+1 pools
+  for(size_t b = 0; b < num_sizes; b++) {
+    COST(0, b) = GROUP_WASTE(0, b);
+    SPLIT(0, b) = 0;
+  }
+
+  for(size_t k = 1; k < max_k; k++) {
+    for(size_t b = k; b < num_sizes; b++) {
+      uint64_t best = UINT64_MAX;
+      size_t best_a = k;
+      for(size_t a = k; a <= b; a++) { // Last pool covers [a, b]
+        uint64_t c = COST(k-1, a-1) + GROUP_WASTE(a, b);
+        if(c < best) {
+          best = c;
+          best_a = a;
+        }
+      }
+      COST(k, b) = best;
+      SPLIT(k, b) = best_a;
+    }
+  }
+
+  // Use the fewest pools that reach the minimum waste
+  size_t best_k = 0;
+  for(size_t k = 1; k < max_k; k++) {
+    if(COST(k, num_sizes-1) < COST(best_k, num_sizes-1))
+      best_k = k;
+  }
+
+  num_pools = best_k + 1;
+  size_t b = num_sizes-1;
+  for(size_t k = best_k+1; k-- > 0; ) {
+    size_t a = SPLIT(k, b);
+    geom[k].element_size = sizes[b];
+    geom[k].elements = 0;
+    geom[k].requests = (uint32_t)(weights[b+1] - weights[a]);
+    if(a == 0)
+      break;
+    b = a-1;
+  }
+
+#undef GROUP_WASTE
+#undef COST
+#undef SPLIT
+
+  // Distribute peak usage of existing pools over the new geometry
+  size_t prev_size = 0;
+  for(mpPool *cur = pool_set->pools; cur; cur = mp__next(cur)) {
+    size_t peak = mp_total_elements(cur) - cur->min_free_elems;
+
+    if(peak > 0) {
+      // Requests this pool would have served first
+      uint64_t served = 0;
+      for(size_t i = 0; i < hist_bins; i++) {
+        size_t size = mp__bin_size(hist, i);
+        if(size > prev_size && size <= cur->element_size)
+          served += hist->bins[i];
+      }
+
+      if(served > 0) {
+        for(size_t i = 0; i < hist_bins; i++) {
+          size_t size = mp__bin_size(hist, i);
+          if(hist->bins[i] == 0 || size <= prev_size || size > cur->element_size)
+            continue;
+
+          size_t g = mp__fit_geometry(geom, num_pools, size);
+          geom[g].elements += (size_t)((peak * (uint64_t)hist->bins[i] + served-1) / served);
+        }
+
+      } else { // Only overflow from smaller pools landed here
+        size_t g = mp__fit_geometry(geom, num_pools, mp__demand_size(cur));
+        geom[g].elements += peak;
+      }
+    }
+
+    prev_size = cur->element_size;
+  }
+
+  for(size_t i = 0; i < num_pools; i++) {
+    geom[i].elements += (geom[i].elements * MP_ANALYZE_HEADROOM + 99) / 100;
+    if(geom[i].elements == 0)
+      geom[i].elements = 1;
+  }
+
+cleanup:
+  free(sizes);
+  free(weights);
+  free(bytes);
+  free(cost);
+  free(split);
+
+  return num_pools;
+}
+
+
+/*
+Report on a proposed pool geometry
+Args:
+  pool_set  : Set the geometry was generated from
+  geom      : Array of proposed pools from mp_analyze_pools()
+  num_pools : Number of entries in geom
+Returns:
+  Nothing
+*/
+void mp_print_geometry(mpPoolSet *pool_set, mpPoolGeometry *geom, size_t num_pools) {
+  char buf[8];
+#define TO_SI(v)  to_si_value((v), 0, buf, sizeof buf, 1, SIF_SIMPLIFY | SIF_POW2 | SIF_UPPER_CASE_K)
+
+  size_t new_total = 0;
+  for(size_t i = 0; i < num_pools; i++) {
+    size_t pool_size = geom[i].elements * geom[i].element_size;
+    printf("  %" PRIuz " x %4" PRIuz " B  = %6sB", geom[i].elements, geom[i].element_size, TO_SI(pool_size));
+    printf("\t(%" PRIu32 " requests)\n", geom[i].requests);
+    new_total += pool_size;
+  }
+
+  size_t cur_total = 0;
+  for(mpPool *cur = pool_set->pools; cur; cur = mp__next(cur))
+    cur_total += mp_total_elements(cur) * cur->element_size;
+
+  printf("\n  Current:  %6sB\n", TO_SI(cur_total));
+  printf("  Proposed: %6sB\n", TO_SI(new_total));
+
+  // Compare average waste per request
+  Histogram *hist = pool_set->hist;
+  if(!hist || num_pools == 0)
+    return;
+
+  uint64_t requests = 0;
+  uint64_t cur_waste = 0;
+  uint64_t new_waste = 0;
+  for(size_t i = 0; i < mp__hist_bins(hist); i++) {
+    if(hist->bins[i] == 0)
+      continue;
+
+    size_t size = mp__bin_size(hist, i);
+    requests += hist->bins[i];
+
+    for(mpPool *cur = pool_set->pools; cur; cur = mp__next(cur)) {
+      if(cur->element_size >= size) {
+        cur_waste += (uint64_t)hist->bins[i] * (cur->element_size - size);
+        break;
+      }
+    }
+
+    size_t g = mp__fit_geometry(geom, num_pools, size);
+    if(geom[g].element_size >= size)
+      new_waste += (uint64_t)hist->bins[i] * (geom[g].element_size - size);
+  }
+
+  if(requests > 0) {
+    printf("  Avg. waste: %" PRIu64 " B -> %" PRIu64 " B per request\n",
+            cur_waste / requests, new_waste / requests);
+  }
+#undef TO_SI
+}
+
+
+/*
+Replace the pools in a set with a proposed geometry
+
+New pools are added and all existing pools are disabled. Existing pools
+with no allocated elements are released. Pools still in use remain disabled
+until they are released with mp_release_pool(). The histogram is reset so
+that further analysis reflects the new geometry.
+
+Args:
+  pool_set  : Set to update
+  geom      : Array of proposed pools from mp_analyze_pools()
+  num_pools : Number of entries in geom
+  alignment : Alignment in bytes for each element (Must be a power of 2)
+Returns:
+  Number of pools added. 0 on failure with the pool set unchanged
+*/
+size_t mp_apply_geometry(mpPoolSet *pool_set, mpPoolGeometry *geom, size_t num_pools, size_t alignment) {
+  if(!pool_set || !geom || num_pools == 0 || num_pools > MP_MAX_INDEXED_POOLS)
+    return 0;
+
+  mpPool *new_pools[MP_MAX_INDEXED_POOLS];
+
+  for(size_t i = 0; i < num_pools; i++) {
+    new_pools[i] = mp_create_pool(geom[i].elements, geom[i].element_size, alignment);
+    if(!new_pools[i]) { // Undo partial allocation
+      while(i-- > 0)
+        free(new_pools[i]);
+      return 0;
+    }
+  }
+
+  // Retire the existing pools
+  for(mpPool *cur = pool_set->pools; cur; cur = mp__next(cur))
+    mp_pool_enable(cur, false);
+
+  for(size_t i = 0; i < num_pools; i++)
+    mp_add_pool(pool_set, new_pools[i]);
+
+  mpPool *cur = pool_set->pools;
+  while(cur) {
+    mpPool *next = mp__next(cur);
+    if(cur->flags & MP_FLAG_DISABLED)
+      mp_release_pool(pool_set, cur, /*release_in_use*/false);
+    cur = next;
+  }
+
+  if(pool_set->hist)
+    histogram_reset(pool_set->hist);
+
+  return num_pools;
+}
+#endif // USE_MP_COLLECT_STATS
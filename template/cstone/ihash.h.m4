@@ -0,0 +1,331 @@
+divert(-1)
+changecom(`@@')
+dnl Template parameters:
+dnl   T:  Value type for expanded template
+dnl
+dnl The value type must be defined before including the generated header.
+define(`TN', translit(T, ` ', `_'))
+define(`GUARD', `IHASH_'TN`_H')
+define(`HTYPE', `IHash_'TN)
+define(`ETYPE', `IHashEntry_'TN)
+define(`ITYPE', `IHashIter_'TN)
+divert(0)dnl
+#ifndef GUARD
+#define GUARD
+
+// Generated from ihash.h.m4 template
+//   `T' = T
+
+/*
+Robin Hood hash specialized for uint32_t keys
+
+This is a lightweight alternative to dhash for tables keyed by integers. Keys
+are stored directly in the buckets and hashing and comparison are inlined so
+there are no callbacks on the lookup path. Values are copied in and out of
+the hash and are never destroyed by it.
+
+Bucket arrays are sized in powers of 2 and indexed with a Fibonacci hash.
+Removal uses backward shifting so no tombstones are left behind.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "cstone/platform.h"
+
+
+#ifndef IHASH_MIN_BUCKETS
+#  define IHASH_MIN_BUCKETS     8
+#endif
+
+#ifndef IHASH_MAX_LOAD
+#  define IHASH_MAX_LOAD(b)     ((b) - (b) / 8)  // 87.5%
+#endif
+
+#ifndef IHASH_FIB_MULT
+#  define IHASH_FIB_MULT        2654435769u      // 2^32 / golden ratio
+#endif
+
+
+typedef struct {
+  uint32_t  key;
+  uint32_t  probes;   // Distance from initial bucket + 1. 0 when unused
+  T         value;
+} ETYPE;
+
+
+typedef struct {
+  ETYPE    *buckets;
+  uint32_t  num_buckets;  // Always a power of 2
+  uint32_t  used_buckets;
+  uint8_t   shift;        // Right shift to get bucket index from hashed key
+} HTYPE;
+
+
+typedef struct {
+  HTYPE    *hash;
+  uint32_t  bucket;
+} ITYPE;
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// ******************** Internal ********************
+
+static inline uint32_t `ihash__initial_probe__'TN (HTYPE *hash, uint32_t key) {
+  return (uint32_t)(key * IHASH_FIB_MULT) >> hash->shift;
+}
+
+
+static inline ETYPE *`ihash__find__'TN (HTYPE *hash, uint32_t key) {
+  uint32_t mask = hash->num_buckets - 1;
+  uint32_t b = `ihash__initial_probe__'TN (hash, key);
+
+  // Load factor guarantees an unused bucket will end the search
+  for(uint32_t probes = 1; ; probes++) {
+    ETYPE *entry = &hash->buckets[b];
+
+    if(entry->probes < probes) // Unused or a closer entry: Key not present
+      return NULL;
+
+    if(entry->key == key)
+      return entry;
+
+    b = (b + 1) & mask;
+  }
+}
+
+
+// Add a key that doesn't exist in the hash
+static inline void `ihash__insert_new__'TN (HTYPE *hash, uint32_t key, const T *value) {
+  uint32_t mask = hash->num_buckets - 1;
+  uint32_t b = `ihash__initial_probe__'TN (hash, key);
+
+  ETYPE cur = {
+    .key    = key,
+    .probes = 1
+  };
+  memcpy(&cur.value, value, sizeof(T));
+
+  while(1) {
+    ETYPE *entry = &hash->buckets[b];
+
+    if(entry->probes == 0) { // Unused bucket
+      *entry = cur;
+      hash->used_buckets++;
+      return;
+    }
+
+    if(entry->probes < cur.probes) { // Take from the rich
+      ETYPE tmp = *entry;
+      *entry = cur;
+      cur = tmp;
+    }
+
+    b = (b + 1) & mask;
+    cur.probes++;
+  }
+}
+
+
+static inline bool `ihash__resize__'TN (HTYPE *hash, uint32_t num_buckets) {
+  ETYPE *new_buckets = cs_calloc(num_buckets, sizeof(ETYPE));
+  if(!new_buckets)
+    return false;
+
+  ETYPE *old_buckets = hash->buckets;
+  uint32_t old_num_buckets = hash->num_buckets;
+
+  uint8_t shift = 32;
+  for(uint32_t n = num_buckets; n > 1; n >>= 1) {
+    shift--;
+  }
+
+  hash->buckets = new_buckets;
+  hash->num_buckets = num_buckets;
+  hash->used_buckets = 0;
+  hash->shift = shift;
+
+  for(uint32_t b = 0; b < old_num_buckets; b++) {
+    if(old_buckets[b].probes > 0)
+      `ihash__insert_new__'TN (hash, old_buckets[b].key, &old_buckets[b].value);
+  }
+
+  cs_free(old_buckets);
+  return true;
+}
+
+
+// ******************** Resource management ********************
+
+/*
+Initialize an integer hash
+
+Args:
+  hash:          Hash to init
+  init_capacity: Number of entries to allocate space for
+
+Returns:
+  true on success
+*/
+static inline bool `ihash_init__'TN (HTYPE *hash, size_t init_capacity) {
+  uint32_t num_buckets = IHASH_MIN_BUCKETS;
+  while(IHASH_MAX_LOAD(num_buckets) < init_capacity) {
+    num_buckets <<= 1;
+  }
+
+  memset(hash, 0, sizeof(*hash));
+  return `ihash__resize__'TN (hash, num_buckets);
+}
+
+
+static inline void `ihash_free__'TN (HTYPE *hash) {
+  cs_free(hash->buckets);
+  memset(hash, 0, sizeof(*hash));
+}
+
+
+// ******************** Retrieval ********************
+
+/*
+Search for a hash entry
+
+Args:
+  hash:   Hash to search
+  key:    Key to search
+  value:  Optional copy of the value matching the key
+
+Returns:
+  true if the key exists
+*/
+static inline bool `ihash_lookup__'TN (HTYPE *hash, uint32_t key, T *value) {
+  ETYPE *entry = `ihash__find__'TN (hash, key);
+
+  if(!entry)
+    return false;
+
+  if(value)
+    memcpy(value, &entry->value, sizeof(T));
+  return true;
+}
+
+
+// Get pointer to value stored in a bucket. Invalid after the next insert or remove.
+static inline T *`ihash_lookup_in_place__'TN (HTYPE *hash, uint32_t key) {
+  ETYPE *entry = `ihash__find__'TN (hash, key);
+  return entry ? &entry->value : NULL;
+}
+
+
+static inline void `ihash_iter_init__'TN (HTYPE *hash, ITYPE *it) {
+  it->hash = hash;
+  it->bucket = 0;
+}
+
+
+static inline bool `ihash_iter_next__'TN (ITYPE *it, uint32_t *key, T **value) {
+  HTYPE *hash = it->hash;
+
+  while(it->bucket < hash->num_buckets) {
+    ETYPE *entry = &hash->buckets[it->bucket++];
+
+    if(entry->probes > 0) {
+      *key = entry->key;
+      *value = &entry->value;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+// ******************** Storage ********************
+
+/*
+Add or replace a hash entry
+
+Args:
+  hash:   Hash to insert into
+  key:    Key for new value
+  value:  Value to copy into the hash
+
+Returns:
+  true on success
+*/
+static inline bool `ihash_insert__'TN (HTYPE *hash, uint32_t key, const T *value) {
+  ETYPE *entry = `ihash__find__'TN (hash, key);
+
+  if(entry) { // Replace existing value
+    memcpy(&entry->value, value, sizeof(T));
+    return true;
+  }
+
+  if(hash->used_buckets >= IHASH_MAX_LOAD(hash->num_buckets)) {
+    if(!`ihash__resize__'TN (hash, hash->num_buckets * 2))
+      return false;
+  }
+
+  `ihash__insert_new__'TN (hash, key, value);
+  return true;
+}
+
+
+/*
+Remove a hash entry
+
+Args:
+  hash:   Hash to remove from
+  key:    Key for item to remove
+  value:  Optional copy of the removed value
+
+Returns:
+  true if the key was removed
+*/
+static inline bool `ihash_remove__'TN (HTYPE *hash, uint32_t key, T *value) {
+  ETYPE *entry = `ihash__find__'TN (hash, key);
+
+  if(!entry)
+    return false;
+
+  if(value)
+    memcpy(value, &entry->value, sizeof(T));
+
+  // Shift following entries back until one is in its initial bucket
+  uint32_t mask = hash->num_buckets - 1;
+  uint32_t b = entry - hash->buckets;
+
+  while(1) {
+    uint32_t next = (b + 1) & mask;
+    ETYPE *next_entry = &hash->buckets[next];
+
+    if(next_entry->probes <= 1) {
+      hash->buckets[b].probes = 0;
+      break;
+    }
+
+    hash->buckets[b] = *next_entry;
+    hash->buckets[b].probes--;
+    b = next;
+  }
+
+  hash->used_buckets--;
+  return true;
+}
+
+
+// ******************** Resource utilization ********************
+
+static inline size_t `ihash_num_items__'TN (HTYPE *hash) {
+  return hash->used_buckets;
+}
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // GUARD